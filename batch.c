@@ -0,0 +1,529 @@
+#include "batch.h"
+
+
+
+static double elapsed_since(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+
+int read_url_list(FILE* stream, batch_item** items, size_t* count)
+{
+    char line[MAX_URL_LINE];
+    size_t capacity = 0;
+
+    *items = NULL;
+    *count = 0;
+
+    while (fgets(line, sizeof(line), stream) != NULL)
+    {
+        // Trim the line ending and surrounding blanks
+        char* start = line;
+        while (*start == ' ' || *start == '\t')
+            start++;
+        start[strcspn(start, " \t\r\n")] = '\0';
+
+        if (*start == '\0' || *start == '#')
+            continue;
+
+        if (*count == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            batch_item* new_items = (batch_item*)realloc(*items, capacity * sizeof(batch_item));
+            if (new_items == NULL)
+            {
+                fprintf(stderr, "Malloc failed\n");
+                return -1;
+            }
+            *items = new_items;
+        }
+
+        batch_item* item = &(*items)[*count];
+        memset(item, 0, sizeof(batch_item));
+        item->result = BATCH_PENDING;
+        item->url_string = strdup(start);
+        if (item->url_string == NULL)
+        {
+            fprintf(stderr, "Malloc failed\n");
+            return -1;
+        }
+
+        (*count)++;
+    }
+
+    return 0;
+}
+
+
+static const char* result_name(batch_result result)
+{
+    switch (result)
+    {
+        case BATCH_HIT:
+            return "HIT";
+        case BATCH_SAVED:
+            return "SAVED";
+        case BATCH_REVALIDATED:
+            return "REVALIDATED";
+        case BATCH_NOT_SAVED:
+            return "NOT_SAVED";
+        case BATCH_FAILED:
+            return "FAILED";
+        case BATCH_INVALID:
+            return "INVALID";
+        default:
+            return "PENDING";
+    }
+}
+
+
+static void complete_item(batch_item* item, batch_result result)
+{
+    batch_run* run = item->run;
+
+    item->result = result;
+    item->elapsed_ms = elapsed_since(&item->started);
+    run->completed++;
+
+    // Each item is written as soon as it is done, the histograms follow the summary
+    if (run->timing_stream != NULL)
+    {
+        latency_stats_record(&run->latency, &item->timing);
+        phase_timer_write(run->timing_stream, &item->timing, item->url_string, result_name(result), options.timing);
+    }
+}
+
+
+static void start_next_items(batch_run* run);
+
+
+static int is_queued(batch_run* run, const char* url_string)
+{
+    for (batch_item* item = run->prefetch_head; item != NULL; item = item->next_prefetch)
+        if (strcmp(item->url_string, url_string) == 0)
+            return 1;
+
+    return 0;
+}
+
+
+static void queue_prefetches(batch_run* run, full_URL* page, int depth)
+{
+    char** links;
+    ssize_t count = prefetch_collect(page, options.prefetch, &links);
+
+    for (ssize_t i = 0; i < count; i++)
+    {
+        // Pages of a site share their stylesheets and scripts, each is fetched once
+        if (is_queued(run, links[i]))
+            continue;
+
+        batch_item* item = (batch_item*)calloc(1, sizeof(batch_item));
+        if (item == NULL)
+        {
+            fprintf(stderr, "Malloc failed\n");
+            break;
+        }
+
+        item->run = run;
+        item->url_string = links[i];
+        links[i] = NULL;
+        item->result = BATCH_PENDING;
+        item->depth = depth;
+
+        if (run->prefetch_tail != NULL)
+            run->prefetch_tail->next_prefetch = item;
+        else
+            run->prefetch_head = item;
+        run->prefetch_tail = item;
+        if (run->prefetch_next == NULL)
+            run->prefetch_next = item;
+        run->prefetched++;
+    }
+
+    free_links(links, count > 0 ? (size_t)count : 0);
+}
+
+
+static void handle_batch_done(fetch* upstream, int result, void* ctx)
+{
+    batch_item* item = (batch_item*)ctx;
+    batch_run* run = item->run;
+
+    item->bytes = upstream->response.total_bytes;
+    phase_timer_merge(&item->timing, &upstream->timing);
+    if (result == -1)
+        complete_item(item, BATCH_FAILED);
+    else if (result == 1 && upstream->response.not_modified)
+        complete_item(item, BATCH_REVALIDATED);
+    else
+        complete_item(item, result == 1 ? BATCH_SAVED : BATCH_NOT_SAVED);
+
+    // The subresources of a saved page join the batch
+    if (result == 1 && !upstream->response.not_modified && upstream->response.is_html && options.prefetch > 0 &&
+        item->depth < options.prefetch_depth)
+        queue_prefetches(run, item->url, item->depth + 1);
+
+    event_loop_release(&run->loop, upstream); // Its watcher may still have a pending event
+    item->upstream = NULL;
+    run->in_flight--;
+
+    start_next_items(run);
+}
+
+
+static int find_cached(batch_item* item)
+{
+    // The index answers without touching the object. Stale copies are revalidated by the fetch
+    off_t object_size;
+    cache_metadata metadata;
+    int is_cached = cache_store_lookup(item->url, &object_size, &metadata) && cache_is_fresh(&metadata);
+    if (is_cached)
+        item->bytes = object_size;
+
+    return is_cached;
+}
+
+
+static void start_next_items(batch_run* run)
+{
+    while (run->in_flight < (size_t)run->jobs && (run->next < run->count || run->prefetch_next != NULL))
+    {
+        // The listed URLs come first, then the links found in the saved pages
+        batch_item* item;
+        if (run->next < run->count)
+            item = &run->items[run->next++];
+        else
+        {
+            item = run->prefetch_next;
+            run->prefetch_next = item->next_prefetch;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &item->started);
+        phase_timer_start(&item->timing);
+
+        item->url = parse_URL(item->url_string);
+        if (item->url == NULL)
+        {
+            complete_item(item, BATCH_INVALID);
+            continue;
+        }
+
+        int is_cached = find_cached(item);
+        int failed_status = is_cached ? 0 : cache_store_lookup_failure(item->url);
+        phase_timer_end(&item->timing, PHASE_CACHE_READ);
+        if (is_cached)
+        {
+            complete_item(item, BATCH_HIT);
+            continue;
+        }
+
+        // A URL that failed moments ago fails the same way without its origin being asked
+        if (failed_status != 0)
+        {
+            complete_item(item, failed_status == CACHE_UNREACHABLE ? BATCH_FAILED : BATCH_NOT_SAVED);
+            continue;
+        }
+
+        item->upstream = (fetch*)malloc(sizeof(fetch));
+        if (item->upstream == NULL)
+        {
+            fprintf(stderr, "Malloc failed\n");
+            complete_item(item, BATCH_FAILED);
+            continue;
+        }
+
+        if (fetch_start(item->upstream, &run->env, item->url, NULL, handle_batch_done, item) == -1)
+        {
+            free(item->upstream);
+            item->upstream = NULL;
+            complete_item(item, BATCH_FAILED);
+            continue;
+        }
+
+        run->in_flight++;
+    }
+
+    // Every URL was processed
+    if (run->completed == run->count + run->prefetched)
+        event_loop_stop(&run->loop);
+}
+
+
+static void print_item(batch_item* item, size_t counts[BATCH_INVALID + 1], size_t* total_bytes)
+{
+    counts[item->result]++;
+    *total_bytes += item->bytes;
+    printf("%-11s %12zu bytes %10.1f ms  %s\n", result_name(item->result), item->bytes, item->elapsed_ms,
+           item->url_string);
+}
+
+
+static int print_summary(batch_run* run, double total_ms)
+{
+    size_t counts[BATCH_INVALID + 1] = {0};
+    size_t prefetch_counts[BATCH_INVALID + 1] = {0};
+    size_t total_bytes = 0;
+
+    for (size_t i = 0; i < run->count; i++)
+        print_item(&run->items[i], counts, &total_bytes);
+    for (batch_item* item = run->prefetch_head; item != NULL; item = item->next_prefetch)
+        print_item(item, prefetch_counts, &total_bytes);
+
+    double seconds = total_ms / 1000.0;
+    size_t total_count = run->count + run->prefetched;
+    printf("\n URLs: %zu (hit %zu, saved %zu, revalidated %zu, not saved %zu, failed %zu, invalid %zu)\n", run->count,
+           counts[BATCH_HIT], counts[BATCH_SAVED], counts[BATCH_REVALIDATED], counts[BATCH_NOT_SAVED],
+           counts[BATCH_FAILED], counts[BATCH_INVALID]);
+    if (run->prefetched > 0)
+        printf(" Prefetched: %zu (hit %zu, saved %zu, revalidated %zu, not saved %zu, failed %zu)\n", run->prefetched,
+               prefetch_counts[BATCH_HIT], prefetch_counts[BATCH_SAVED], prefetch_counts[BATCH_REVALIDATED],
+               prefetch_counts[BATCH_NOT_SAVED], prefetch_counts[BATCH_FAILED] + prefetch_counts[BATCH_INVALID]);
+    printf(" Total bytes: %zu in %.1f ms\n", total_bytes, total_ms);
+    if (seconds > 0)
+        printf(" Throughput: %.2f MB/s, %.1f URLs/s\n", total_bytes / seconds / (1024 * 1024), total_count / seconds);
+
+    // Only the listed URLs decide the exit status, a prefetch is a best effort
+    return counts[BATCH_HIT] + counts[BATCH_SAVED] + counts[BATCH_REVALIDATED] == run->count ? 0 : 1;
+}
+
+
+static void free_batch_items(batch_item* items, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        free(items[i].url_string);
+        free_full_URL(items[i].url);
+    }
+    free(items);
+}
+
+
+static void free_prefetched_items(batch_run* run)
+{
+    while (run->prefetch_head != NULL)
+    {
+        batch_item* item = run->prefetch_head;
+        run->prefetch_head = item->next_prefetch;
+        free(item->url_string);
+        free_full_URL(item->url);
+        free(item);
+    }
+}
+
+
+static void expire_idle_sockets(event_loop* loop, void* ctx)
+{
+    (void)loop;
+    conn_pool_expire((conn_pool*)ctx);
+
+    // Finish the evictions the fills left over the disk cache budget
+    cache_store_evict(CACHE_EVICTION_STEPS);
+}
+
+
+static int open_batch(batch_run* run, proxy_options* options)
+{
+    if (event_loop_init(&run->loop) == -1)
+        return -1;
+
+    conn_pool_init(&run->pool, options->max_host_connections, options->idle_timeout);
+    if (resolver_init(&run->dns, &run->loop, options->dns_ttl) == -1)
+    {
+        event_loop_close(&run->loop);
+        return -1;
+    }
+
+    if (event_timer_start(&run->loop, &run->expiry_timer, 1000, expire_idle_sockets, &run->pool) == -1)
+    {
+        resolver_close(&run->dns);
+        event_loop_close(&run->loop);
+        return -1;
+    }
+
+    run->env.loop = &run->loop;
+    run->env.pool = &run->pool;
+    run->env.dns = &run->dns;
+
+    // Writing to an origin that went away must fail with EPIPE instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    for (size_t i = 0; i < run->count; i++)
+        run->items[i].run = run;
+    run->prefetch_head = NULL;
+    run->prefetch_tail = NULL;
+    run->prefetch_next = NULL;
+    run->prefetched = 0;
+    run->next = 0;
+    run->in_flight = 0;
+    run->completed = 0;
+    run->jobs = options->jobs;
+    latency_stats_init(&run->latency);
+    run->timing_stream = NULL;
+    return 0;
+}
+
+
+static void close_batch(batch_run* run)
+{
+    event_timer_stop(&run->loop, &run->expiry_timer);
+    conn_pool_close(&run->pool);
+    resolver_close(&run->dns);
+    event_loop_close(&run->loop);
+    free_batch_items(run->items, run->count);
+    free_prefetched_items(run);
+}
+
+
+int run_batch(proxy_options* options)
+{
+    batch_run run;
+    FILE* stream = stdin;
+    const char* list_path = options->batch_list;
+
+    if (strcmp(list_path, "-") != 0)
+    {
+        stream = fopen(list_path, "r");
+        if (stream == NULL)
+        {
+            fprintf(stderr, "Error opening file %s for reading.\n", list_path);
+            return -1;
+        }
+    }
+
+    int read_result = read_url_list(stream, &run.items, &run.count);
+    if (stream != stdin)
+        fclose(stream);
+
+    if (read_result == -1 || open_batch(&run, options) == -1)
+    {
+        free_batch_items(run.items, run.count);
+        return -1;
+    }
+
+    if (options->timing != TIMING_OFF)
+    {
+        run.timing_stream = open_timing_stream(options->timing_file);
+        if (run.timing_stream == NULL)
+        {
+            close_batch(&run);
+            return -1;
+        }
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    start_next_items(&run);
+    if (run.completed < run.count + run.prefetched)
+        event_loop_run(&run.loop);
+
+    int result = print_summary(&run, elapsed_since(&started));
+
+    if (run.timing_stream != NULL)
+    {
+        latency_stats_write(run.timing_stream, &run.latency, options->timing);
+        if (run.timing_stream != stderr)
+            fclose(run.timing_stream);
+    }
+
+    close_batch(&run);
+    return result;
+}
+
+
+static void close_inherited_descriptors(void)
+{
+    // close_range() needs Linux 5.9, older kernels get one close() per possible descriptor
+    if (close_range(STDERR_FILENO + 1, ~0U, 0) == 0)
+        return;
+
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    for (long fd = STDERR_FILENO + 1; fd < max_fd; fd++)
+        close((int)fd);
+}
+
+
+static int start_background_child(void)
+{
+    // Flush what the caller printed, or the child would print it again
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork\n");
+        return -1;
+    }
+    if (pid > 0)
+        return 1;
+
+    // The child outlives the command, away from its terminal, and locks the cache index on its own descriptor
+    setsid();
+    cache_store_after_fork();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1)
+    {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+
+    // Nothing the command had open stays open for as long as the child runs: not the origin socket, the splice pipe,
+    // the timing file or the --output-fd descriptor, whose reader would otherwise wait for the child to finish
+    close_inherited_descriptors();
+    options.output_fd = STDOUT_FILENO;
+
+    return 0;
+}
+
+
+static void run_in_background(batch_run* run)
+{
+    start_next_items(run);
+    if (run->completed < run->count + run->prefetched)
+        event_loop_run(&run->loop);
+
+    close_batch(run);
+    _exit(EXIT_SUCCESS);
+}
+
+
+int prefetch_in_background(full_URL* my_url)
+{
+    int started = start_background_child();
+    if (started != 0)
+        return started == 1 ? 0 : -1;
+
+    batch_run run;
+    run.items = NULL;
+    run.count = 0;
+    if (open_batch(&run, &options) == -1)
+        _exit(EXIT_FAILURE);
+
+    queue_prefetches(&run, my_url, 1);
+    run_in_background(&run);
+    return 0;
+}
+
+
+int refresh_in_background(full_URL* my_url)
+{
+    int started = start_background_child();
+    if (started != 0)
+        return started == 1 ? 0 : -1;
+
+    // A batch of the one URL: the stale copy is revalidated, and a new HTML page is prefetched from as usual
+    batch_run run;
+    run.items = (batch_item*)calloc(1, sizeof(batch_item));
+    run.count = 1;
+    if (run.items == NULL || (run.items[0].url_string = strdup(my_url->url)) == NULL || open_batch(&run, &options) == -1)
+        _exit(EXIT_FAILURE);
+
+    run_in_background(&run);
+    return 0;
+}
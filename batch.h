@@ -0,0 +1,107 @@
+#ifndef CPROXY_BATCH_H
+#define CPROXY_BATCH_H
+
+
+#include "cproxy.h"
+#include <signal.h>
+#include <time.h>
+#include "event_loop.h"
+#include "fetch.h"
+#include "conn_pool.h"
+#include "resolver.h"
+#include "cache_store.h"
+#include "latency_stats.h"
+#include "prefetch.h"
+
+
+#define DEFAULT_BATCH_JOBS 16 // Default maximum number of concurrent fetches
+#define MAX_URL_LINE 8192 // Maximum length of a line in the URL list
+
+typedef enum{
+    BATCH_PENDING, // Not processed yet
+    BATCH_HIT, // Already in the cache
+    BATCH_SAVED, // Fetched from the origin and saved to the cache
+    BATCH_REVALIDATED, // The stale cached copy was confirmed by the origin with 304 Not Modified
+    BATCH_NOT_SAVED, // Fetched from the origin, but not a 200 response
+    BATCH_FAILED, // The fetch failed
+    BATCH_INVALID // The line is not a legal URL
+} batch_result;
+
+typedef struct batch_run batch_run;
+typedef struct batch_item batch_item;
+
+struct batch_item{
+    batch_run* run; // Batch the item belongs to
+    char* url_string; // URL as given in the list
+    full_URL* url; // Parsed URL, or NULL if it is invalid
+    batch_result result; // Outcome of the item
+    size_t bytes; // Response bytes read, or the cached file size
+    struct timespec started; // When processing of the item started
+    double elapsed_ms; // How long processing the item took
+    fetch* upstream; // Fetch from the origin, or NULL
+    phase_timer timing; // Time spent in each phase, measured when timing is on
+    int depth; // Links followed from a listed URL to this one, 0 for the listed URLs
+    batch_item* next_prefetch; // Next item found in a saved page, or NULL
+};
+
+struct batch_run{
+    event_loop loop; // Loop driving the fetches
+    conn_pool pool; // Keep-alive sockets to the origins
+    resolver dns; // Caching resolver of the origin host names
+    fetch_env env; // What the fetches use: the loop, the pool and the resolver
+    event_timer expiry_timer; // Periodically closes idle sockets of the pool
+    batch_item* items; // URLs of the batch
+    size_t count; // Number of items
+    batch_item* prefetch_head; // Items found in the saved pages, in the order they were found
+    batch_item* prefetch_tail; // Last item found, or NULL
+    batch_item* prefetch_next; // Next found item to process, or NULL
+    size_t prefetched; // Number of items found
+    size_t next; // Index of the next item to process
+    size_t in_flight; // Number of fetches in progress
+    size_t completed; // Number of processed items
+    int jobs; // Maximum number of concurrent fetches
+    latency_stats latency; // Histograms of the phases of every item, filled when timing is on
+    FILE* timing_stream; // Stream the latencies are written to, or NULL when timing is off
+};
+
+
+/**
+ * Reads a list of URLs, one per line. Empty lines and lines starting with '#' are skipped.
+ *
+ * @param stream: The stream to read the list from.
+ * @param items: Set to a dynamically allocated array of items, one per URL.
+ * @param count: Set to the number of items.
+ * @return 0 on success, or -1 if memory allocation fails.
+ */
+int read_url_list(FILE*, batch_item**, size_t*);
+
+/**
+ * Fetches all URLs of a list into the cache, up to 'jobs' at a time, and prints a summary of the results.
+ *
+ * @param options: A pointer to a 'proxy_options' structure with the URL list ("-" for the standard input),
+ *                 the number of jobs and the connection options.
+ * @return 0 if every URL was served from the cache or saved to it, 1 if some were not, or -1 on failure.
+ */
+int run_batch(proxy_options*);
+
+/**
+ * Fetches the subresources of a page just saved to the cache from a child process, so the caller does not wait.
+ * The child follows the links up to the prefetch depth, like the batch mode, and prints nothing. It keeps none of
+ * the caller's descriptors past the standard ones, which it points at /dev/null.
+ *
+ * @param my_url: A pointer to the 'full_URL' structure of the saved HTML page.
+ * @return 0 if the child was started, or -1 if fork() failed.
+ */
+int prefetch_in_background(full_URL*);
+
+/**
+ * Revalidates a stale cached object from a child process, after it was printed to the caller. Like the prefetching
+ * child, it keeps none of the caller's descriptors, so the output of the command ends when the command does.
+ *
+ * @param my_url: A pointer to the 'full_URL' structure of the stale object.
+ * @return 0 if the child was started, or -1 if fork() failed.
+ */
+int refresh_in_background(full_URL*);
+
+
+#endif //CPROXY_BATCH_H
@@ -0,0 +1,829 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4, nftw and friends
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+
+#define BENCH_USAGE "Usage: cproxy_bench [--proxy <path>] [--mode server|cli] [--workload cold|warm|mixed|all]\n" \
+                    "                    [--requests <n>] [--concurrency <n>] [--objects <n>] [--hit-ratio <percent>]\n" \
+                    "                    [--size <bytes>] [--latency <ms>] [--chunked] [--no-keep-alive]\n"
+#define DEFAULT_REQUESTS 2000 // Requests per workload
+#define DEFAULT_CONCURRENCY 16 // Concurrent clients
+#define DEFAULT_OBJECTS 100 // Objects of the warm set
+#define DEFAULT_OBJECT_SIZE (16 * 1024) // Body size of every object
+#define DEFAULT_HIT_RATIO 80 // Percentage of mixed requests that go to the warm set
+#define COLD_OBJECT_BASE 1000000 // First object id of the cold requests, far from the warm set
+#define ORIGIN_CHUNK_SIZE (16 * 1024) // Size of the chunks of a chunked origin response
+#define REQUEST_BUFFER_SIZE 8192 // Largest request header the origin reads
+#define PROXY_START_TIMEOUT_MS 5000 // How long to wait for the proxy to accept connections
+
+typedef enum{
+    MODE_SERVER, // Clients send proxy requests to 'cproxy --listen'
+    MODE_CLI // Every request runs 'cproxy <URL>', which goes through open_file or read_from_connection
+} bench_mode;
+
+typedef enum{
+    WORKLOAD_COLD, // Every request is for an object the cache never saw
+    WORKLOAD_WARM, // Every request is for a prefilled object
+    WORKLOAD_MIXED // hit_ratio percent of the requests are warm, the others cold
+} bench_workload;
+
+typedef struct{
+    char proxy_path[PATH_MAX]; // Absolute path of the cproxy executable
+    bench_mode mode; // How cproxy is driven
+    int workloads[3]; // 1 for every bench_workload to run
+    long requests; // Requests per workload
+    int concurrency; // Concurrent clients
+    long objects; // Objects of the warm set
+    int hit_ratio; // Percentage of warm requests in the mixed workload
+    size_t object_size; // Body size of every object
+    int latency_ms; // Delay of the origin before every response
+    int chunked; // 1 if the origin sends chunked bodies
+    int keep_alive; // 1 if the origin keeps connections open between requests
+} bench_options;
+
+typedef struct{
+    int listen_fd; // Listening socket of the origin
+    int port; // Port of the origin
+    const bench_options* options; // Object size, latency and framing of the responses
+    char* body; // Body sent for every object
+    atomic_long requests; // Requests served
+} bench_origin;
+
+typedef struct{
+    const bench_options* options; // Benchmark settings
+    bench_workload workload; // Workload being run
+    int origin_port; // Port of the origin
+    int proxy_port; // Port of 'cproxy --listen', or 0 in CLI mode
+    const char* work_dir; // Working directory of cproxy, holding its cache
+    atomic_long next_request; // Index of the next request to send
+    long cold_base; // First object id of the cold requests of this run
+    double* latencies_ms; // Latency of every request
+    atomic_long errors; // Requests that failed
+    atomic_long bytes; // Response bytes received
+} bench_run;
+
+
+/**
+ * Returns the milliseconds elapsed since a point in time.
+ *
+ * @param start: The point in time, read from CLOCK_MONOTONIC.
+ * @return The elapsed time in milliseconds.
+ */
+static double elapsed_since(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+
+static int write_all(int fd, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t wrote_bytes = send(fd, data, length, MSG_NOSIGNAL);
+        if (wrote_bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        data += wrote_bytes;
+        length -= wrote_bytes;
+    }
+
+    return 0;
+}
+
+
+static int listen_on_loopback(int* port)
+{
+    int sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd == -1)
+    {
+        perror("socket\n");
+        return -1;
+    }
+
+    int enable = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    // Port 0 lets the kernel pick a free one
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(*port);
+
+    socklen_t length = sizeof(address);
+    if (bind(sd, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(sd, 1024) == -1 ||
+        getsockname(sd, (struct sockaddr*)&address, &length) == -1)
+    {
+        perror("bind\n");
+        close(sd);
+        return -1;
+    }
+
+    *port = ntohs(address.sin_port);
+    return sd;
+}
+
+
+static int connect_to_loopback(int port)
+{
+    int sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd == -1)
+        return -1;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if (connect(sd, (struct sockaddr*)&address, sizeof(address)) == -1)
+    {
+        close(sd);
+        return -1;
+    }
+
+    int enable = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    return sd;
+}
+
+
+static int send_origin_response(bench_origin* origin, int sd, int close_after)
+{
+    const bench_options* options = origin->options;
+
+    // Chunked bodies have no Content-Length
+    char framing[64] = "Transfer-Encoding: chunked\r\n";
+    if (!options->chunked)
+        snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", options->object_size);
+
+    char header[256];
+    int header_length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\n%s%s\r\n",
+                                 framing, close_after ? "Connection: close\r\n" : "");
+
+    if (write_all(sd, header, header_length) == -1)
+        return -1;
+
+    if (!options->chunked)
+        return write_all(sd, origin->body, options->object_size);
+
+    for (size_t sent = 0; sent < options->object_size; sent += ORIGIN_CHUNK_SIZE)
+    {
+        size_t part = options->object_size - sent < ORIGIN_CHUNK_SIZE ? options->object_size - sent : ORIGIN_CHUNK_SIZE;
+        char size_line[32];
+        int size_length = snprintf(size_line, sizeof(size_line), "%zx\r\n", part);
+        if (write_all(sd, size_line, size_length) == -1 || write_all(sd, origin->body + sent, part) == -1 ||
+            write_all(sd, "\r\n", 2) == -1)
+            return -1;
+    }
+
+    return write_all(sd, "0\r\n\r\n", 5);
+}
+
+
+static void* serve_origin_connection(void* arg)
+{
+    bench_origin* origin = ((void**)arg)[0];
+    int sd = (int)(long)((void**)arg)[1];
+    free(arg);
+
+    char request[REQUEST_BUFFER_SIZE + 1];
+    size_t request_length = 0;
+
+    while (1)
+    {
+        // Read one request header, keeping what follows it for the next one
+        char* header_end;
+        request[request_length] = '\0';
+        while ((header_end = strstr(request, "\r\n\r\n")) == NULL)
+        {
+            if (request_length == REQUEST_BUFFER_SIZE)
+                goto done;
+
+            ssize_t read_bytes = read(sd, request + request_length, REQUEST_BUFFER_SIZE - request_length);
+            if (read_bytes <= 0)
+                goto done;
+
+            request_length += read_bytes;
+            request[request_length] = '\0';
+        }
+
+        header_end += 4;
+        int close_after = !origin->options->keep_alive || strcasestr(request, "\r\nConnection: close") != NULL;
+
+        if (origin->options->latency_ms > 0)
+            usleep(origin->options->latency_ms * 1000);
+
+        atomic_fetch_add(&origin->requests, 1);
+        if (send_origin_response(origin, sd, close_after) == -1 || close_after)
+            break;
+
+        request_length -= header_end - request;
+        memmove(request, header_end, request_length);
+    }
+
+done:
+    close(sd);
+    return NULL;
+}
+
+
+static void* run_origin(void* arg)
+{
+    bench_origin* origin = (bench_origin*)arg;
+
+    // One thread per connection keeps the origin simple; latency injection then never delays other connections
+    while (1)
+    {
+        int sd = accept4(origin->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return NULL;
+        }
+
+        // Headers and bodies go out in separate writes, which Nagle would hold back for a delayed ACK
+        int enable = 1;
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        void** connection = (void**)malloc(2 * sizeof(void*));
+        pthread_t thread;
+        if (connection == NULL)
+        {
+            close(sd);
+            continue;
+        }
+
+        connection[0] = origin;
+        connection[1] = (void*)(long)sd;
+        if (pthread_create(&thread, NULL, serve_origin_connection, connection) != 0)
+        {
+            free(connection);
+            close(sd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+
+/**
+ * Starts the stand-in origin on a free loopback port, serving every object with the configured size and framing.
+ *
+ * @param origin: A pointer to the 'bench_origin' structure to initialize.
+ * @param options: The benchmark settings.
+ * @return 0 on success, or -1 on failure.
+ */
+static int start_origin(bench_origin* origin, const bench_options* options)
+{
+    origin->options = options;
+    origin->port = 0;
+    atomic_init(&origin->requests, 0);
+
+    origin->body = (char*)malloc(options->object_size + 1);
+    if (origin->body == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < options->object_size; i++)
+        origin->body[i] = "abcdefghijklmnopqrstuvwxyz0123456789\n"[i % 37];
+
+    origin->listen_fd = listen_on_loopback(&origin->port);
+    if (origin->listen_fd == -1)
+        return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_origin, origin) != 0)
+    {
+        fprintf(stderr, "pthread_create failed\n");
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return 0;
+}
+
+
+/**
+ * Starts 'cproxy --listen' in the benchmark working directory and waits until it accepts connections.
+ *
+ * @param options: The benchmark settings, with the path of cproxy.
+ * @param work_dir: The directory cproxy runs in, which holds its cache.
+ * @param port: Set to the port cproxy listens on.
+ * @return The process id of cproxy, or -1 on failure.
+ */
+static pid_t start_proxy(const bench_options* options, const char* work_dir, int* port)
+{
+    // Find a free port for the proxy
+    *port = 0;
+    int probe = listen_on_loopback(port);
+    if (probe == -1)
+        return -1;
+    close(probe);
+
+    char port_string[16];
+    snprintf(port_string, sizeof(port_string), "%d", *port);
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork\n");
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (chdir(work_dir) == -1 || null_fd == -1)
+            _exit(EXIT_FAILURE);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execl(options->proxy_path, options->proxy_path, "--listen", port_string, (char*)NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    while (elapsed_since(&started) < PROXY_START_TIMEOUT_MS)
+    {
+        int sd = connect_to_loopback(*port);
+        if (sd != -1)
+        {
+            close(sd);
+            return pid;
+        }
+
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            break;
+        usleep(10000);
+    }
+
+    fprintf(stderr, "%s did not start listening on port %d\n", options->proxy_path, *port);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+
+static long fetch_through_server(bench_run* run, long object_id)
+{
+    int sd = connect_to_loopback(run->proxy_port);
+    if (sd == -1)
+        return -1;
+
+    char request[256];
+    int request_length = snprintf(request, sizeof(request),
+                                  "GET http://127.0.0.1:%d/obj/%ld HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+                                  run->origin_port, object_id, run->origin_port);
+    if (write_all(sd, request, request_length) == -1)
+    {
+        close(sd);
+        return -1;
+    }
+
+    // The proxy closes the connection after every response
+    char buffer[64 * 1024];
+    long total_bytes = 0;
+    int status_ok = 0;
+    ssize_t read_bytes;
+    while ((read_bytes = read(sd, buffer, sizeof(buffer))) > 0)
+    {
+        if (total_bytes == 0)
+            status_ok = read_bytes >= 12 && memcmp(buffer + 8, " 200", 4) == 0;
+        total_bytes += read_bytes;
+    }
+
+    close(sd);
+    return read_bytes == 0 && status_ok ? total_bytes : -1;
+}
+
+
+static long fetch_through_cli(bench_run* run, long object_id)
+{
+    char url[128];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/obj/%ld", run->origin_port, object_id);
+
+    pid_t pid = fork();
+    if (pid == -1)
+        return -1;
+
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (chdir(run->work_dir) == -1 || null_fd == -1)
+            _exit(EXIT_FAILURE);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execl(run->options->proxy_path, run->options->proxy_path, url, (char*)NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    return (long)run->options->object_size;
+}
+
+
+static long fetch_object(bench_run* run, long object_id)
+{
+    if (run->options->mode == MODE_CLI)
+        return fetch_through_cli(run, object_id);
+    return fetch_through_server(run, object_id);
+}
+
+
+static long pick_object(bench_run* run, long index)
+{
+    const bench_options* options = run->options;
+
+    switch (run->workload)
+    {
+        case WORKLOAD_WARM:
+            return index % options->objects;
+
+        case WORKLOAD_MIXED:
+            // Spread the cold requests evenly instead of bunching them
+            if ((index * 37) % 100 < options->hit_ratio)
+                return index % options->objects;
+            return run->cold_base + index;
+
+        default:
+            return run->cold_base + index;
+    }
+}
+
+
+static void* run_client(void* arg)
+{
+    bench_run* run = (bench_run*)arg;
+
+    while (1)
+    {
+        long index = atomic_fetch_add(&run->next_request, 1);
+        if (index >= run->options->requests)
+            return NULL;
+
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        long bytes = fetch_object(run, pick_object(run, index));
+        run->latencies_ms[index] = elapsed_since(&started);
+
+        if (bytes < 0)
+            atomic_fetch_add(&run->errors, 1);
+        else
+            atomic_fetch_add(&run->bytes, bytes);
+    }
+}
+
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+static double percentile(const double* sorted, long count, double fraction)
+{
+    long index = (long)(fraction * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+
+/**
+ * Runs one workload with the configured number of concurrent clients and prints a line of results.
+ *
+ * @param run: A pointer to a 'bench_run' structure with the settings, ports and workload to run.
+ * @return 0 on success, or -1 if the clients could not be started.
+ */
+static int run_workload(bench_run* run)
+{
+    static const char* const names[] = {"cold", "warm", "mixed"};
+    const bench_options* options = run->options;
+
+    atomic_store(&run->next_request, 0);
+    atomic_store(&run->errors, 0);
+    atomic_store(&run->bytes, 0);
+
+    pthread_t* clients = (pthread_t*)malloc(options->concurrency * sizeof(pthread_t));
+    if (clients == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return -1;
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    int started_clients = 0;
+    for (int i = 0; i < options->concurrency; i++)
+    {
+        if (pthread_create(&clients[i], NULL, run_client, run) != 0)
+            break;
+        started_clients++;
+    }
+
+    for (int i = 0; i < started_clients; i++)
+        pthread_join(clients[i], NULL);
+
+    double elapsed_ms = elapsed_since(&started);
+    free(clients);
+
+    if (started_clients == 0)
+    {
+        fprintf(stderr, "pthread_create failed\n");
+        return -1;
+    }
+
+    qsort(run->latencies_ms, options->requests, sizeof(double), compare_doubles);
+    double seconds = elapsed_ms / 1000.0;
+    printf("%-8s %9ld %7ld %9.3f %11.1f %10.2f %9.3f %9.3f %9.3f\n", names[run->workload], options->requests,
+           (long)atomic_load(&run->errors), seconds, options->requests / seconds,
+           atomic_load(&run->bytes) / seconds / (1024.0 * 1024.0), percentile(run->latencies_ms, options->requests, 0.5),
+           percentile(run->latencies_ms, options->requests, 0.99), run->latencies_ms[options->requests - 1]);
+    fflush(stdout);
+
+    // The next cold requests must not hit objects this run cached
+    run->cold_base += options->requests;
+    return 0;
+}
+
+
+static int prefill_warm_set(bench_run* run)
+{
+    // Every warm object is cached once, outside of any measurement
+    for (long id = 0; id < run->options->objects; id++)
+        if (fetch_object(run, id) < 0)
+            return -1;
+
+    return 0;
+}
+
+
+static int parse_count(const char* str, long min, long max, long* value)
+{
+    char* end;
+    errno = 0;
+    long number = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || errno == ERANGE || number < min || number > max)
+        return -1;
+
+    *value = number;
+    return 0;
+}
+
+
+/**
+ * Parses the command-line arguments of the benchmark.
+ *
+ * @param argc: The number of command-line arguments.
+ * @param argv: The command-line arguments.
+ * @param options: A pointer to a 'bench_options' structure to fill.
+ * @return 0 if the options are legal, else -1.
+ */
+static int parse_bench_options(int argc, char** argv, bench_options* options)
+{
+    static struct option long_options[] = {
+        {"proxy", required_argument, NULL, 'p'},
+        {"mode", required_argument, NULL, 'm'},
+        {"workload", required_argument, NULL, 'w'},
+        {"requests", required_argument, NULL, 'n'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"objects", required_argument, NULL, 'o'},
+        {"hit-ratio", required_argument, NULL, 'r'},
+        {"size", required_argument, NULL, 's'},
+        {"latency", required_argument, NULL, 'l'},
+        {"chunked", no_argument, NULL, 'k'},
+        {"no-keep-alive", no_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0}
+    };
+
+    const char* proxy = "./cproxy";
+    options->mode = MODE_SERVER;
+    options->workloads[WORKLOAD_COLD] = options->workloads[WORKLOAD_WARM] = options->workloads[WORKLOAD_MIXED] = 1;
+    options->requests = DEFAULT_REQUESTS;
+    options->concurrency = DEFAULT_CONCURRENCY;
+    options->objects = DEFAULT_OBJECTS;
+    options->hit_ratio = DEFAULT_HIT_RATIO;
+    options->object_size = DEFAULT_OBJECT_SIZE;
+    options->latency_ms = 0;
+    options->chunked = 0;
+    options->keep_alive = 1;
+
+    int option;
+    long value;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+            case 'p':
+                proxy = optarg;
+                break;
+
+            case 'm':
+                if (strcmp(optarg, "server") != 0 && strcmp(optarg, "cli") != 0)
+                    return -1;
+                options->mode = strcmp(optarg, "cli") == 0 ? MODE_CLI : MODE_SERVER;
+                break;
+
+            case 'w':
+            {
+                static const char* const names[] = {"cold", "warm", "mixed"};
+                if (strcmp(optarg, "all") == 0)
+                    break;
+
+                int found = 0;
+                for (int i = 0; i < 3; i++)
+                {
+                    options->workloads[i] = strcmp(optarg, names[i]) == 0;
+                    found |= options->workloads[i];
+                }
+                if (!found)
+                    return -1;
+                break;
+            }
+
+            case 'n':
+                if (parse_count(optarg, 1, LONG_MAX / 2, &options->requests) == -1)
+                    return -1;
+                break;
+
+            case 'c':
+                if (parse_count(optarg, 1, 4096, &value) == -1)
+                    return -1;
+                options->concurrency = (int)value;
+                break;
+
+            case 'o':
+                if (parse_count(optarg, 1, COLD_OBJECT_BASE, &options->objects) == -1)
+                    return -1;
+                break;
+
+            case 'r':
+                if (parse_count(optarg, 0, 100, &value) == -1)
+                    return -1;
+                options->hit_ratio = (int)value;
+                break;
+
+            case 's':
+                if (parse_count(optarg, 0, LONG_MAX / 2, &value) == -1)
+                    return -1;
+                options->object_size = (size_t)value;
+                break;
+
+            case 'l':
+                if (parse_count(optarg, 0, 60000, &value) == -1)
+                    return -1;
+                options->latency_ms = (int)value;
+                break;
+
+            case 'k':
+                options->chunked = 1;
+                break;
+
+            case 'K':
+                options->keep_alive = 0;
+                break;
+
+            default:
+                return -1;
+        }
+    }
+
+    // cproxy runs in the benchmark directory, so it needs an absolute path
+    if (optind != argc || realpath(proxy, options->proxy_path) == NULL)
+    {
+        if (optind == argc)
+            fprintf(stderr, "Cannot find %s\n", proxy);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int remove_entry(const char* path, const struct stat* info, int type, struct FTW* ftw)
+{
+    (void)info;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+
+int main(int argc, char* argv[])
+{
+    bench_options options;
+    if (parse_bench_options(argc, argv, &options) == -1)
+    {
+        printf(BENCH_USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // cproxy keeps its cache in its working directory, a fresh one gives every benchmark a cold cache
+    char work_dir[] = "/tmp/cproxy-bench-XXXXXX";
+    if (mkdtemp(work_dir) == NULL)
+    {
+        perror("mkdtemp\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bench_origin origin;
+    if (start_origin(&origin, &options) == -1)
+        exit(EXIT_FAILURE);
+
+    bench_run run;
+    memset(&run, 0, sizeof(run));
+    run.options = &options;
+    run.origin_port = origin.port;
+    run.work_dir = work_dir;
+    run.cold_base = COLD_OBJECT_BASE;
+    run.latencies_ms = (double*)malloc(options.requests * sizeof(double));
+    if (run.latencies_ms == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t proxy_pid = -1;
+    if (options.mode == MODE_SERVER)
+    {
+        proxy_pid = start_proxy(&options, work_dir, &run.proxy_port);
+        if (proxy_pid == -1)
+            exit(EXIT_FAILURE);
+    }
+
+    printf("cproxy %s mode, %ld requests per workload, %d clients, %zu-byte objects%s%s, %d ms origin latency\n",
+           options.mode == MODE_CLI ? "single-URL" : "server", options.requests, options.concurrency,
+           options.object_size, options.chunked ? ", chunked" : "", options.keep_alive ? "" : ", no keep-alive",
+           options.latency_ms);
+    printf("%-8s %9s %7s %9s %11s %10s %9s %9s %9s\n", "workload", "requests", "errors", "seconds", "requests/s",
+           "MiB/s", "p50 ms", "p99 ms", "max ms");
+
+    int result = 0;
+    int warm_set_cached = 0;
+    for (int workload = WORKLOAD_COLD; workload <= WORKLOAD_MIXED && result == 0; workload++)
+    {
+        if (!options.workloads[workload])
+            continue;
+
+        if (workload != WORKLOAD_COLD && !warm_set_cached)
+        {
+            if (prefill_warm_set(&run) == -1)
+            {
+                fprintf(stderr, "Prefilling the warm set failed\n");
+                result = -1;
+                break;
+            }
+            warm_set_cached = 1;
+        }
+
+        run.workload = (bench_workload)workload;
+        result = run_workload(&run);
+    }
+
+    printf("Origin requests: %ld\n", (long)atomic_load(&origin.requests));
+
+    if (proxy_pid != -1)
+    {
+        kill(proxy_pid, SIGTERM);
+        waitpid(proxy_pid, NULL, 0);
+    }
+
+    nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    free(run.latencies_ms);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,444 @@
+// The parser is linked from response.c as it ships; cproxy.c is built in here so its main can be renamed out of the way
+#define main cproxy_main
+#include "../cproxy.c"
+#undef main
+
+#include <getopt.h>
+#include <time.h>
+
+
+#define HEADER_BENCH_USAGE "Usage: header_parse_bench [--iterations <n>] [--read-size <bytes>]\n"
+#define DEFAULT_ITERATIONS 300000 // Parses of every sample header by every parser
+#define DEFAULT_READ_SIZE 97 // Bytes per read of the split run, small enough to cut most lines
+
+typedef struct{
+    const char* name; // Printed with the timings
+    const char* header; // Whole response header, ending with the empty line
+} header_sample;
+
+// Headers of the sizes and shapes origins send: framing only, the caching headers with dates, and a long one
+static const header_sample samples[] = {
+    {"no dates",
+     "HTTP/1.1 200 OK\r\n"
+     "Server: nginx/1.24.0\r\n"
+     "Content-Type: text/html; charset=utf-8\r\n"
+     "Content-Length: 48213\r\n"
+     "Connection: keep-alive\r\n"
+     "Vary: Accept-Encoding\r\n"
+     "Cache-Control: public, max-age=3600\r\n"
+     "ETag: \"5f8e2c1a-bc55\"\r\n"
+     "X-Content-Type-Options: nosniff\r\n"
+     "X-Frame-Options: SAMEORIGIN\r\n"
+     "Accept-Ranges: bytes\r\n"
+     "Strict-Transport-Security: max-age=31536000\r\n"
+     "\r\n"},
+    {"with dates",
+     "HTTP/1.1 200 OK\r\n"
+     "Date: Sat, 17 Oct 2026 10:15:00 GMT\r\n"
+     "Server: Apache/2.4.58\r\n"
+     "Last-Modified: Tue, 06 Oct 2026 08:49:37 GMT\r\n"
+     "ETag: \"2aa6-5f8e2c1a9b4c0\"\r\n"
+     "Accept-Ranges: bytes\r\n"
+     "Content-Length: 10918\r\n"
+     "Expires: Sat, 17 Oct 2026 11:15:00 GMT\r\n"
+     "Age: 12\r\n"
+     "Content-Type: application/pdf\r\n"
+     "Connection: keep-alive\r\n"
+     "Vary: Accept-Encoding\r\n"
+     "\r\n"},
+    {"long",
+     "HTTP/1.1 200 OK\r\n"
+     "Date: Sat, 17 Oct 2026 10:15:00 GMT\r\n"
+     "Content-Type: text/html; charset=UTF-8\r\n"
+     "Transfer-Encoding: chunked\r\n"
+     "Connection: keep-alive\r\n"
+     "Set-Cookie: session=8f2b1c9e7a6d5f4e3b2a1c0d9e8f7a6b; Path=/; HttpOnly; SameSite=Lax; "
+     "Expires=Sun, 18 Oct 2026 10:15:00 GMT\r\n"
+     "Set-Cookie: preferences=theme%3Ddark%26lang%3Den%26tz%3DUTC; Path=/; Max-Age=31536000\r\n"
+     "Cache-Control: private, no-cache, must-revalidate\r\n"
+     "Content-Security-Policy: default-src 'self'; script-src 'self' https://cdn.example.com; "
+     "style-src 'self' 'unsafe-inline'; img-src 'self' data: https:; frame-ancestors 'none'\r\n"
+     "Link: </static/app.css>; rel=preload; as=style, </static/app.js>; rel=preload; as=script\r\n"
+     "Server-Timing: db;dur=53, app;dur=47.2, cache;desc=\"miss\"\r\n"
+     "X-Request-Id: 3f1e9b2c-7d4a-4c8e-9f6b-2a1d0e8c7b5a\r\n"
+     "Vary: Accept-Encoding, Cookie\r\n"
+     "\r\n"}
+};
+
+
+
+/*
+ * The parser that the line state machine replaced: the end of the header was found with strstr() on the read that
+ * held it, then every line was scanned with memmem() and the dates went through strptime(). Kept as it was apart
+ * from the names, as the baseline of the timings.
+ */
+
+static int previous_header_value_is(const char* value, size_t value_length, const char* expected)
+{
+    return value_length == strlen(expected) && strncasecmp(value, expected, value_length) == 0;
+}
+
+
+static time_t previous_parse_http_date(const char* value, size_t value_length)
+{
+    char date[64];
+    if (value_length >= sizeof(date))
+        return -1;
+
+    memcpy(date, value, value_length);
+    date[value_length] = '\0';
+
+    struct tm date_info;
+    memset(&date_info, 0, sizeof(date_info));
+    const char* end = strptime(date, HTTP_DATE_FORMAT, &date_info);
+    if (end == NULL || *end != '\0')
+        return -1;
+
+    return timegm(&date_info);
+}
+
+
+static long previous_parse_directive_seconds(const char* value, size_t value_length)
+{
+    if (value_length == 0 || value[0] == '-')
+        return -1;
+
+    char* end;
+    long seconds = strtol(value, &end, 10);
+    return end == value ? -1 : seconds;
+}
+
+
+static void previous_parse_cache_control(const char* value, size_t value_length, long* max_age,
+                                         long* shared_max_age, int* no_cache, int* cacheable)
+{
+    const char* end = value + value_length;
+
+    while (value < end)
+    {
+        const char* directive_end = memchr(value, ',', end - value);
+        if (directive_end == NULL)
+            directive_end = end;
+
+        while (value < directive_end && (*value == ' ' || *value == '\t'))
+            value++;
+        size_t directive_length = directive_end - value;
+        while (directive_length > 0 && (value[directive_length - 1] == ' ' || value[directive_length - 1] == '\t'))
+            directive_length--;
+
+        if (directive_length > strlen("max-age=") && strncasecmp(value, "max-age=", strlen("max-age=")) == 0)
+            *max_age = previous_parse_directive_seconds(value + strlen("max-age="),
+                                                        directive_length - strlen("max-age="));
+        else if (directive_length > strlen("s-maxage=") && strncasecmp(value, "s-maxage=", strlen("s-maxage=")) == 0)
+            *shared_max_age = previous_parse_directive_seconds(value + strlen("s-maxage="),
+                                                               directive_length - strlen("s-maxage="));
+        else if (previous_header_value_is(value, directive_length, "no-cache"))
+            *no_cache = 1;
+        else if (previous_header_value_is(value, directive_length, "no-store") ||
+                 previous_header_value_is(value, directive_length, "private"))
+            *cacheable = 0;
+
+        value = directive_end + 1;
+    }
+}
+
+
+static int previous_parse_response_header(http_response* response, const char* header, size_t length)
+{
+    int major;
+    if (sscanf(header, "HTTP/%d.%d %d", &major, &response->http_minor, &response->status_code) != 3 || major != 1)
+        return -1;
+
+    int connection_close = 0;
+    int connection_keep_alive = 0;
+    time_t date = -1;
+    time_t expires = -1;
+    long age = 0;
+    long max_age = -1;
+    long shared_max_age = -1;
+    int no_cache = 0;
+    int has_expires = 0;
+
+    const char* end = header + length;
+    const char* line = memmem(header, length, "\r\n", 2);
+
+    // Walk the header lines after the status line
+    while (line != NULL && line + 2 < end)
+    {
+        line += 2;
+        const char* line_end = memmem(line, end - line, "\r\n", 2);
+        if (line_end == NULL || line_end == line)
+            break;
+
+        const char* colon = memchr(line, ':', line_end - line);
+        if (colon != NULL)
+        {
+            size_t name_length = colon - line;
+            const char* value = colon + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t'))
+                value++;
+            size_t value_length = line_end - value;
+            while (value_length > 0 && (value[value_length - 1] == ' ' || value[value_length - 1] == '\t'))
+                value_length--;
+
+            if (name_length == strlen("Content-Length") && strncasecmp(line, "Content-Length", name_length) == 0)
+                response->content_length = strtol(value, NULL, 10);
+            else if (name_length == strlen("Transfer-Encoding") && strncasecmp(line, "Transfer-Encoding", name_length) == 0)
+                response->chunked = !previous_header_value_is(value, value_length, "identity");
+            else if (name_length == strlen("Connection") && strncasecmp(line, "Connection", name_length) == 0)
+            {
+                connection_close = previous_header_value_is(value, value_length, "close");
+                connection_keep_alive = previous_header_value_is(value, value_length, "keep-alive");
+            }
+            else if (name_length == strlen("Date") && strncasecmp(line, "Date", name_length) == 0)
+                date = previous_parse_http_date(value, value_length);
+            else if (name_length == strlen("Expires") && strncasecmp(line, "Expires", name_length) == 0)
+            {
+                has_expires = 1;
+                expires = previous_parse_http_date(value, value_length); // Invalid dates such as "0" mean expired
+            }
+            else if (name_length == strlen("Age") && strncasecmp(line, "Age", name_length) == 0)
+            {
+                long parsed_age = previous_parse_directive_seconds(value, value_length);
+                age = parsed_age > 0 ? parsed_age : 0;
+            }
+            else if (name_length == strlen("Cache-Control") && strncasecmp(line, "Cache-Control", name_length) == 0)
+                previous_parse_cache_control(value, value_length, &max_age, &shared_max_age, &no_cache,
+                                             &response->cacheable);
+            else if (name_length == strlen("Last-Modified") && strncasecmp(line, "Last-Modified", name_length) == 0)
+            {
+                time_t last_modified = previous_parse_http_date(value, value_length);
+                response->metadata.last_modified = last_modified > 0 ? last_modified : 0;
+            }
+            else if (name_length == strlen("ETag") && strncasecmp(line, "ETag", name_length) == 0 &&
+                     value_length < sizeof(response->metadata.etag))
+            {
+                memcpy(response->metadata.etag, value, value_length);
+                response->metadata.etag[value_length] = '\0';
+            }
+        }
+
+        line = line_end;
+    }
+
+    // Freshness lifetime, in the order of precedence a shared cache applies
+    time_t now = time(NULL);
+    long lifetime = 0;
+    if (no_cache)
+        lifetime = 0; // Stored, but revalidated before every use
+    else if (shared_max_age >= 0)
+        lifetime = shared_max_age;
+    else if (max_age >= 0)
+        lifetime = max_age;
+    else if (has_expires)
+        lifetime = expires == -1 ? 0 : expires - (date != -1 ? date : now);
+    else if (response->metadata.last_modified != 0)
+    {
+        // Heuristic freshness: a tenth of the time since the last modification
+        time_t since_modified = (date != -1 ? date : now) - response->metadata.last_modified;
+        lifetime = since_modified > 0 ? since_modified / 10 : 0;
+    }
+
+    response->metadata.expires_at = now + lifetime - age;
+    response->not_modified = response->status_code == 304;
+
+    // Responses to GET that never carry a body
+    if ((response->status_code >= 100 && response->status_code < 200) || response->status_code == 204 ||
+        response->status_code == 304)
+        response->content_length = 0;
+
+    // A chunked body wins over Content-Length
+    if (response->chunked)
+        response->content_length = -1;
+
+    // HTTP/1.1 keeps connections open unless told otherwise, HTTP/1.0 only when asked to
+    if (response->http_minor >= 1)
+        response->keep_alive = !connection_close;
+    else
+        response->keep_alive = connection_keep_alive;
+
+    // Only a body whose end is known leaves the connection usable
+    if (response->content_length < 0)
+        response->keep_alive = 0;
+
+    return 0;
+}
+
+
+static int previous_parse(http_response* response, const char* data)
+{
+    // As response_feed did on the read holding the whole header
+    response_init(response, NULL);
+    const char* header_end = strstr(data, "\r\n\r\n");
+    if (header_end == NULL)
+        return -1;
+
+    response->header_end_found = 1;
+    return previous_parse_response_header(response, data, header_end - data + 4);
+}
+
+
+static int current_parse(http_response* response, const char* data, size_t length, size_t read_size)
+{
+    response_init(response, NULL);
+    for (size_t offset = 0; offset < length && !response->header_end_found; offset += read_size)
+        parse_response_header(response, data + offset, length - offset < read_size ? length - offset : read_size);
+
+    return response->header_end_found ? 0 : -1;
+}
+
+
+/**
+ * Compares what two parses of the same header left in the response.
+ *
+ * @return NULL if they agree, else the name of the first field that differs.
+ */
+static const char* compare_responses(const http_response* expected, const http_response* actual)
+{
+    if (expected->status_code != actual->status_code || expected->http_minor != actual->http_minor)
+        return "status line";
+    if (expected->content_length != actual->content_length || expected->chunked != actual->chunked)
+        return "framing";
+    // The chunked framing is decoded since, so a chunked body no longer closes the connection
+    if (expected->keep_alive != actual->keep_alive && !actual->chunked)
+        return "keep_alive";
+    if (expected->cacheable != actual->cacheable || expected->not_modified != actual->not_modified)
+        return "cacheable";
+    if (expected->metadata.last_modified != actual->metadata.last_modified ||
+        strcmp(expected->metadata.etag, actual->metadata.etag) != 0)
+        return "validators";
+    // The two parses may read the clock on both sides of a second
+    if (llabs((long long)(expected->metadata.expires_at - actual->metadata.expires_at)) > 1)
+        return "expires_at";
+    return NULL;
+}
+
+
+/**
+ * Checks that the incremental parser agrees with the previous one on every sample, read whole and cut into reads of
+ * every size, so the timings compare parsers that do the same work.
+ *
+ * @return The number of disagreements.
+ */
+static int check_samples(http_response* expected, http_response* actual)
+{
+    int mismatches = 0;
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++)
+    {
+        size_t length = strlen(samples[i].header);
+        if (previous_parse(expected, samples[i].header) == -1)
+        {
+            fprintf(stderr, "%s: rejected by the previous parser\n", samples[i].name);
+            mismatches++;
+            continue;
+        }
+
+        for (size_t read_size = 1; read_size <= length; read_size++)
+        {
+            const char* field = current_parse(actual, samples[i].header, length, read_size) == -1
+                                ? "header end" : compare_responses(expected, actual);
+            if (field != NULL)
+            {
+                fprintf(stderr, "%s: %s differs in reads of %zu bytes\n", samples[i].name, field, read_size);
+                mismatches++;
+                break;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+
+static double elapsed_ns(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+
+static int parse_count(const char* str, long max, long* value)
+{
+    char* end;
+    errno = 0;
+    long number = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || errno == ERANGE || number < 1 || number > max)
+        return -1;
+
+    *value = number;
+    return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+    static struct option long_options[] = {
+        {"iterations", required_argument, NULL, 'n'},
+        {"read-size", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+
+    long iterations = DEFAULT_ITERATIONS;
+    long read_size = DEFAULT_READ_SIZE;
+    int option;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        if ((option == 'n' && parse_count(optarg, LONG_MAX, &iterations) == 0) ||
+            (option == 'r' && parse_count(optarg, INT_MAX, &read_size) == 0))
+            continue;
+
+        printf(HEADER_BENCH_USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if (optind != argc)
+    {
+        printf(HEADER_BENCH_USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    static http_response expected_response; // Filled by the previous parser
+    static http_response actual_response; // Filled by the incremental parser
+    http_response* expected = &expected_response;
+    http_response* actual = &actual_response;
+
+    int mismatches = check_samples(expected, actual);
+    printf("check: %d mismatches\n", mismatches);
+
+    volatile long sink = 0; // Keeps the results alive
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++)
+    {
+        const char* header = samples[i].header;
+        size_t length = strlen(header);
+        struct timespec start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long j = 0; j < iterations; j++)
+        {
+            previous_parse(expected, header);
+            sink += expected->content_length;
+        }
+        double previous_ns = elapsed_ns(&start) / iterations;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long j = 0; j < iterations; j++)
+        {
+            current_parse(actual, header, length, length);
+            sink += actual->content_length;
+        }
+        double whole_ns = elapsed_ns(&start) / iterations;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long j = 0; j < iterations; j++)
+        {
+            current_parse(actual, header, length, (size_t)read_size);
+            sink += actual->content_length;
+        }
+        double split_ns = elapsed_ns(&start) / iterations;
+
+        printf("%-10s %4zu bytes: previous %5.0f ns, incremental %5.0f ns (%5.0f ns in %ld-byte reads)\n",
+               samples[i].name, length, previous_ns, whole_ns, split_ns, read_size);
+    }
+
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
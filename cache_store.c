@@ -0,0 +1,760 @@
+#include "cache_store.h"
+
+
+static int store_status = 0; // 1 once the index is mapped, -1 if it could not be, 0 before the first use
+static int index_fd = -1; // Descriptor of the index file, locked while slots are changed
+static cache_index_header* header = NULL; // Header of the mapped index, holding the usage counters
+static cache_slot* slots = NULL; // Slots of the mapped index
+static uint8_t created_directories[256 / 8]; // Bit set for every fan-out directory known to exist
+static unsigned fill_sequence = 0; // Numbers the temporary files of the fills of this process
+
+
+
+static int open_index(void)
+{
+    if (store_status != 0)
+        return store_status == 1 ? 0 : -1;
+
+    store_status = -1;
+
+    if (mkdir(CACHE_ROOT, 0777) == -1 && errno != EEXIST)
+    {
+        perror("Error creating the cache directory\n");
+        return -1;
+    }
+
+    int fd = open(CACHE_INDEX_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1)
+    {
+        perror("Error opening the cache index\n");
+        return -1;
+    }
+
+    size_t map_size = sizeof(cache_index_header) + CACHE_INDEX_SLOTS * sizeof(cache_slot);
+
+    // Other processes may be creating the index at the same time
+    flock(fd, LOCK_EX);
+
+    struct stat index_info;
+    if (fstat(fd, &index_info) == -1 || (index_info.st_size != (off_t)map_size && ftruncate(fd, map_size) == -1))
+    {
+        perror("Error sizing the cache index\n");
+        flock(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("Error mapping the cache index\n");
+        flock(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+
+    // A new index, or one of another layout, starts empty. Truncating zeroes it without touching every page
+    header = (cache_index_header*)map;
+    if (memcmp(header->magic, CACHE_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->slot_count != CACHE_INDEX_SLOTS)
+    {
+        if (ftruncate(fd, 0) == -1 || ftruncate(fd, map_size) == -1)
+        {
+            perror("Error resetting the cache index\n");
+            munmap(map, map_size);
+            flock(fd, LOCK_UN);
+            close(fd);
+            return -1;
+        }
+
+        header->slot_count = CACHE_INDEX_SLOTS;
+        memcpy(header->magic, CACHE_INDEX_MAGIC, sizeof(header->magic));
+    }
+
+    flock(fd, LOCK_UN);
+
+    index_fd = fd;
+    slots = (cache_slot*)(header + 1);
+    store_status = 1;
+    return 0;
+}
+
+
+static int key_length_of(full_URL* my_url)
+{
+    // The key was built with the URL, only its length decides whether the index can hold it
+    if (my_url->key_length > CACHE_KEY_CAPACITY)
+        return -1;
+
+    return (int)my_url->key_length;
+}
+
+
+char* cache_key(full_URL* my_url)
+{
+    if (key_length_of(my_url) == -1)
+        return NULL;
+
+    char* copy = strdup(my_url->key);
+    if (copy == NULL)
+        fprintf(stderr, "Malloc failed\n");
+    return copy;
+}
+
+
+uint64_t cache_key_hash(const char* key, size_t key_length)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < key_length; i++)
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211u;
+    return hash;
+}
+
+
+static cache_slot* find_slot(uint64_t hash, const char* key, size_t key_length, cache_slot** free_slot,
+                             int* conflict)
+{
+    // For writers, which hold the index lock. Readers go through read_slot
+    for (size_t probe = 0; probe < CACHE_MAX_PROBES; probe++)
+    {
+        cache_slot* slot = &slots[(hash + probe) % CACHE_INDEX_SLOTS];
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if (state != SLOT_VALID)
+        {
+            if (free_slot != NULL && *free_slot == NULL)
+                *free_slot = slot;
+
+            if (state == SLOT_EMPTY)
+                break;
+            continue;
+        }
+
+        if (slot->hash != hash)
+            continue;
+
+        if (slot->key_length == key_length && memcmp(slot->key, key, key_length) == 0)
+            return slot;
+
+        // Another URL with the same hash owns the object name
+        if (conflict != NULL)
+            *conflict = 1;
+    }
+
+    return NULL;
+}
+
+
+static uint32_t begin_update(cache_slot* slot)
+{
+    // Called with the index locked. An odd sequence left behind by a writer that died is taken over as is
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&slot->sequence, sequence, __ATOMIC_RELAXED);
+
+    // The changes of the slot are not seen before the odd sequence
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return sequence;
+}
+
+
+static void end_update(cache_slot* slot, uint32_t sequence)
+{
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+
+static cache_slot* read_slot(uint64_t hash, const char* key, size_t key_length, int64_t* size,
+                             cache_metadata* metadata, uint32_t* sequence)
+{
+    // Readers take no lock: a copy counts only if the sequence of the slot was even and did not move while it was made
+    for (size_t probe = 0; probe < CACHE_MAX_PROBES; probe++)
+    {
+        cache_slot* slot = &slots[(hash + probe) % CACHE_INDEX_SLOTS];
+
+        int consistent = 0;
+        uint32_t state = SLOT_DELETED;
+        int matches = 0;
+        for (int attempt = 0; !consistent && attempt < CACHE_READ_RETRIES; attempt++)
+        {
+            uint32_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+            if (before & 1)
+            {
+                sched_yield(); // A writer is in the middle of it
+                continue;
+            }
+
+            state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+            matches = state == SLOT_VALID && slot->hash == hash && slot->key_length == key_length &&
+                      memcmp(slot->key, key, key_length) == 0;
+            if (matches)
+            {
+                *size = slot->size;
+                *metadata = slot->metadata;
+            }
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            consistent = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == before;
+            *sequence = before;
+        }
+
+        // A slot that never held still is skipped, like a miss
+        if (!consistent)
+            continue;
+
+        if (matches)
+            return slot;
+        if (state == SLOT_EMPTY)
+            break;
+    }
+
+    return NULL;
+}
+
+
+static char* object_path(uint64_t hash)
+{
+    // 256 directories keep each one small
+    char* path = (char*)malloc(strlen(CACHE_ROOT) + 21);
+    if (path == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return NULL;
+    }
+
+    sprintf(path, "%s/%02x/%016llx", CACHE_ROOT, (unsigned)(hash >> 56), (unsigned long long)hash);
+    return path;
+}
+
+
+static void record_hit(cache_slot* slot, const cache_metadata* metadata)
+{
+    // Only reads that serve the object count. Lost updates between processes are harmless, so no lock is taken
+    uint32_t frequency = __atomic_load_n(&slot->frequency, __ATOMIC_RELAXED);
+    if (cache_is_fresh(metadata) && frequency < CACHE_MAX_FREQUENCY)
+        __atomic_store_n(&slot->frequency, frequency + 1, __ATOMIC_RELAXED);
+}
+
+
+static void release_slot(cache_slot* slot)
+{
+    // Called with the index locked
+    uint32_t sequence = begin_update(slot);
+    header->total_bytes -= slot->size;
+    header->object_count--;
+    __atomic_store_n(&slot->state, SLOT_DELETED, __ATOMIC_RELEASE);
+    end_update(slot, sequence);
+}
+
+
+static int over_budget(void)
+{
+    return (options.cache_size > 0 && header->total_bytes > (int64_t)options.cache_size) ||
+           (options.cache_objects > 0 && header->object_count > (int64_t)options.cache_objects);
+}
+
+
+int cache_store_lookup(full_URL* my_url, off_t* size, cache_metadata* metadata)
+{
+    const char* key = my_url->key;
+    int key_length = key_length_of(my_url);
+    if (key_length == -1 || open_index() == -1)
+        return 0;
+
+    int64_t slot_size;
+    cache_metadata slot_metadata;
+    uint32_t sequence;
+    cache_slot* slot = read_slot(my_url->key_hash, key, key_length, &slot_size, &slot_metadata, &sequence);
+    if (slot == NULL)
+        return 0;
+
+    // A negative entry has no object
+    if (slot_metadata.status != 0)
+        return 0;
+
+    record_hit(slot, &slot_metadata);
+
+    if (size != NULL)
+        *size = slot_size;
+    if (metadata != NULL)
+        *metadata = slot_metadata;
+    return 1;
+}
+
+
+static void remove_if_unchanged(cache_slot* slot, uint32_t sequence)
+{
+    flock(index_fd, LOCK_EX);
+
+    // A commit may have put a new object in place since the slot was read
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence)
+        release_slot(slot);
+
+    flock(index_fd, LOCK_UN);
+}
+
+
+int cache_store_open_object(full_URL* my_url, off_t* size, cache_metadata* metadata)
+{
+    const char* key = my_url->key;
+    int key_length = key_length_of(my_url);
+    if (key_length == -1 || open_index() == -1)
+        return -1;
+
+    uint64_t hash = my_url->key_hash;
+    char* path = object_path(hash);
+    if (path == NULL)
+        return -1;
+
+    int fd = -1;
+    for (int attempt = 0; attempt < CACHE_READ_RETRIES; attempt++)
+    {
+        int64_t slot_size;
+        cache_metadata slot_metadata;
+        uint32_t sequence;
+        cache_slot* slot = read_slot(hash, key, key_length, &slot_size, &slot_metadata, &sequence);
+        if (slot == NULL || slot_metadata.status != 0)
+            break;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        int open_error = errno;
+
+        // The file matches the metadata only if the slot did not change meanwhile: commits rename while it is odd
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != sequence)
+        {
+            if (fd != -1)
+                close(fd);
+            fd = -1;
+            continue;
+        }
+
+        // The object was deleted behind the index
+        if (fd == -1 && open_error == ENOENT)
+            remove_if_unchanged(slot, sequence);
+
+        if (fd != -1)
+        {
+            record_hit(slot, &slot_metadata);
+            if (metadata != NULL)
+                *metadata = slot_metadata;
+        }
+        break;
+    }
+    free(path);
+
+    struct stat file_info;
+    if (fd != -1 && (fstat(fd, &file_info) == -1 || !S_ISREG(file_info.st_mode)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (fd != -1)
+        *size = file_info.st_size;
+    return fd;
+}
+
+
+static int create_fan_out_directory(unsigned directory)
+{
+    // Fills skip the mkdir calls once a directory is known to exist
+    if (created_directories[directory / 8] & (1u << (directory % 8)))
+        return 0;
+
+    char path[sizeof(CACHE_ROOT) + 4];
+    snprintf(path, sizeof(path), "%s/%02x", CACHE_ROOT, directory);
+    if (create_directories(path) == -1)
+        return -1;
+
+    created_directories[directory / 8] |= (uint8_t)(1u << (directory % 8));
+    return 0;
+}
+
+
+int cache_store_prepare(full_URL* my_url, char** temp_path)
+{
+    const char* key = my_url->key;
+    int key_length = key_length_of(my_url);
+    if (key_length == -1 || open_index() == -1)
+        return -1;
+
+    uint64_t hash = my_url->key_hash;
+    int conflict = 0;
+    if (find_slot(hash, key, key_length, NULL, &conflict) == NULL && conflict)
+        return -1;
+
+    // Next to the object, so the rename stays on one file system. The name is never reused, not even across crashes
+    unsigned directory = (unsigned)(hash >> 56);
+    char* path = (char*)malloc(strlen(CACHE_ROOT) + 64);
+    if (path == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return -1;
+    }
+    sprintf(path, "%s/%02x/%016llx.%ld.%u.tmp", CACHE_ROOT, directory, (unsigned long long)hash, (long)getpid(),
+            fill_sequence++);
+
+    int fd = -1;
+    for (int attempt = 0; fd == -1 && attempt < 2; attempt++)
+    {
+        if (create_fan_out_directory(directory) == -1)
+            break;
+
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+        // The directory was removed behind this process, create it again
+        if (fd == -1 && errno == ENOENT)
+            created_directories[directory / 8] &= (uint8_t)~(1u << (directory % 8));
+        else if (fd == -1)
+            break;
+    }
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error opening file %s for writing.\n", path);
+        free(path);
+        return -1;
+    }
+
+    *temp_path = path;
+    return fd;
+}
+
+
+int cache_store_commit(full_URL* my_url, const char* temp_path, off_t size, const cache_metadata* metadata)
+{
+    const char* key = my_url->key;
+    int key_length = key_length_of(my_url);
+    if (key_length == -1 || open_index() == -1)
+        return -1;
+
+    uint64_t hash = my_url->key_hash;
+    char* path = object_path(hash);
+    if (path == NULL)
+        return -1;
+
+    int result = 0;
+
+    flock(index_fd, LOCK_EX);
+
+    cache_slot* free_slot = NULL;
+    cache_slot* slot = find_slot(hash, key, key_length, &free_slot, NULL);
+
+    // Readers that opened the object while the slot changed read it again, so the file and its metadata go together
+    cache_slot* target = slot != NULL ? slot : free_slot;
+    uint32_t sequence = target != NULL ? begin_update(target) : 0;
+
+    // Readers see either the previous object or the complete new one, never a partial file
+    if (target != NULL && rename(temp_path, path) == -1)
+    {
+        perror("Error moving a filled object into place\n");
+        result = -1;
+    }
+    else if (slot != NULL)
+    {
+        // Fetching it again is a use too
+        header->total_bytes += size - slot->size;
+        if (slot->frequency < CACHE_MAX_FREQUENCY)
+            slot->frequency++;
+
+        slot->size = size;
+        slot->stored_at = time(NULL);
+        slot->metadata = *metadata;
+    }
+    else if (free_slot != NULL)
+    {
+        free_slot->hash = hash;
+        free_slot->key_length = key_length;
+        memcpy(free_slot->key, key, key_length);
+        free_slot->size = size;
+        free_slot->stored_at = time(NULL);
+        free_slot->metadata = *metadata;
+
+        // A new object survives one pass of the hand, so it is not evicted before it is read
+        free_slot->frequency = 1;
+        header->total_bytes += size;
+        header->object_count++;
+
+        // Readers only look at the other fields once the slot is valid
+        __atomic_store_n(&free_slot->state, SLOT_VALID, __ATOMIC_RELEASE);
+    }
+    else
+        result = -1; // Every slot of the probe sequence is taken
+
+    if (target != NULL)
+        end_update(target, sequence);
+
+    flock(index_fd, LOCK_UN);
+    free(path);
+
+    // Make room for what was just added, a bounded amount at a time
+    cache_store_evict(CACHE_EVICTION_STEPS);
+    return result;
+}
+
+
+int cache_store_refresh(full_URL* my_url, const cache_metadata* metadata)
+{
+    const char* key = my_url->key;
+    int key_length = key_length_of(my_url);
+    if (key_length == -1 || open_index() == -1)
+        return -1;
+
+    flock(index_fd, LOCK_EX);
+
+    // A 304 never answers a negative entry, it was asked for without validators
+    cache_slot* slot = find_slot(my_url->key_hash, key, key_length, NULL, NULL);
+    if (slot != NULL && slot->metadata.status != 0)
+        slot = NULL;
+
+    if (slot != NULL)
+    {
+        uint32_t sequence = begin_update(slot);
+        slot->metadata.expires_at = metadata->expires_at;
+        if (metadata->last_modified != 0)
+            slot->metadata.last_modified = metadata->last_modified;
+        if (metadata->etag[0] != '\0')
+            memcpy(slot->metadata.etag, metadata->etag, sizeof(slot->metadata.etag));
+        end_update(slot, sequence);
+    }
+
+    flock(index_fd, LOCK_UN);
+    return slot != NULL ? 0 : -1;
+}
+
+
+int cache_store_record_failure(full_URL* my_url, int status)
+{
+    const char* key = my_url->key;
+    int key_length = key_length_of(my_url);
+    if (options.negative_ttl == 0 || key_length == -1 || open_index() == -1)
+        return -1;
+
+    cache_metadata metadata;
+    memset(&metadata, 0, sizeof(metadata));
+    metadata.expires_at = (int64_t)time(NULL) + options.negative_ttl;
+    metadata.status = status;
+
+    uint64_t hash = my_url->key_hash;
+    int result = 0;
+
+    flock(index_fd, LOCK_EX);
+
+    cache_slot* free_slot = NULL;
+    cache_slot* slot = find_slot(hash, key, key_length, &free_slot, NULL);
+
+    // A stale copy is better than an error that may not last, only 404 and 410 say the object is gone
+    int object_gone = status == 404 || status == 410;
+    if (slot != NULL && (slot->metadata.status != 0 || object_gone))
+    {
+        uint32_t sequence = begin_update(slot);
+
+        // The origin no longer has the object. Under the lock, so a fill cannot rename a new one into place in between
+        if (slot->metadata.status == 0)
+        {
+            char* path = object_path(hash);
+            if (path != NULL && unlink(path) == -1 && errno != ENOENT)
+                perror("Error removing an object the origin no longer has\n");
+            free(path);
+        }
+
+        header->total_bytes -= slot->size;
+        slot->size = 0;
+        slot->stored_at = time(NULL);
+        slot->metadata = metadata;
+        end_update(slot, sequence);
+    }
+    else if (slot == NULL && free_slot != NULL)
+    {
+        uint32_t sequence = begin_update(free_slot);
+        free_slot->hash = hash;
+        free_slot->key_length = key_length;
+        memcpy(free_slot->key, key, key_length);
+        free_slot->size = 0;
+        free_slot->stored_at = time(NULL);
+        free_slot->metadata = metadata;
+
+        // Cheap to lose, so the hand may take it on its first pass
+        free_slot->frequency = 0;
+        header->object_count++;
+
+        __atomic_store_n(&free_slot->state, SLOT_VALID, __ATOMIC_RELEASE);
+        end_update(free_slot, sequence);
+    }
+    else if (slot == NULL)
+        result = -1; // Every slot of the probe sequence is taken
+
+    flock(index_fd, LOCK_UN);
+
+    cache_store_evict(CACHE_EVICTION_STEPS);
+    return result;
+}
+
+
+int cache_store_lookup_failure(full_URL* my_url)
+{
+    const char* key = my_url->key;
+    int key_length = key_length_of(my_url);
+    if (options.negative_ttl == 0 || key_length == -1 || open_index() == -1)
+        return 0;
+
+    int64_t slot_size;
+    cache_metadata slot_metadata;
+    uint32_t sequence;
+    cache_slot* slot = read_slot(my_url->key_hash, key, key_length, &slot_size, &slot_metadata, &sequence);
+    if (slot == NULL)
+        return 0;
+
+    // An expired entry stays until the URL is fetched again or the hand takes it
+    if (slot_metadata.status == 0 || !cache_is_fresh(&slot_metadata))
+        return 0;
+
+    record_hit(slot, &slot_metadata);
+    return slot_metadata.status;
+}
+
+
+int cache_is_fresh(const cache_metadata* metadata)
+{
+    return metadata->expires_at > (int64_t)time(NULL);
+}
+
+
+int cache_is_usable(const cache_metadata* metadata, int max_staleness)
+{
+    return max_staleness == -1 || metadata->expires_at + max_staleness > (int64_t)time(NULL);
+}
+
+
+size_t cache_conditional_headers(full_URL* my_url, char* headers, size_t size)
+{
+    headers[0] = '\0';
+
+    cache_metadata metadata;
+    if (!cache_store_lookup(my_url, NULL, &metadata) || cache_is_fresh(&metadata))
+        return 0;
+
+    size_t length = 0;
+    if (metadata.etag[0] != '\0')
+    {
+        int written = snprintf(headers, size, "If-None-Match: %s\r\n", metadata.etag);
+        if (written < 0 || (size_t)written >= size)
+        {
+            headers[0] = '\0';
+            return 0;
+        }
+        length = written;
+    }
+
+    if (metadata.last_modified != 0)
+    {
+        char date[64];
+        time_t last_modified = (time_t)metadata.last_modified;
+        struct tm date_info;
+        strftime(date, sizeof(date), HTTP_DATE_FORMAT, gmtime_r(&last_modified, &date_info));
+
+        int written = snprintf(headers + length, size - length, "If-Modified-Since: %s\r\n", date);
+        if (written < 0 || (size_t)written >= size - length)
+            headers[length] = '\0'; // The ETag alone still validates
+        else
+            length += written;
+    }
+
+    return length;
+}
+
+
+void cache_store_remove(full_URL* my_url)
+{
+    const char* key = my_url->key;
+    int key_length = key_length_of(my_url);
+    if (key_length == -1 || open_index() == -1)
+        return;
+
+    flock(index_fd, LOCK_EX);
+
+    cache_slot* slot = find_slot(my_url->key_hash, key, key_length, NULL, NULL);
+    if (slot != NULL)
+        release_slot(slot);
+
+    flock(index_fd, LOCK_UN);
+}
+
+
+int cache_store_evict(size_t max_steps)
+{
+    // Without a budget the index is not even opened
+    if ((options.cache_size == 0 && options.cache_objects == 0) || open_index() == -1 || !over_budget())
+        return 0;
+
+    int evicted = 0;
+
+    flock(index_fd, LOCK_EX);
+
+    // Free slots are skipped cheaply, only objects count as steps. A pass never goes round more than once
+    size_t step = 0;
+    for (size_t scanned = 0; scanned < CACHE_INDEX_SLOTS && step < max_steps && evicted < CACHE_EVICTION_BATCH &&
+                             over_budget(); scanned++)
+    {
+        cache_slot* slot = &slots[header->clock_hand];
+        header->clock_hand = (header->clock_hand + 1) % CACHE_INDEX_SLOTS;
+
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_VALID)
+            continue;
+
+        step++;
+
+        // Objects read since the hand last passed get another round
+        uint32_t frequency = __atomic_load_n(&slot->frequency, __ATOMIC_RELAXED);
+        if (frequency > 0)
+        {
+            __atomic_store_n(&slot->frequency, frequency - 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Under the lock, so a fill of the same URL cannot rename its object into place in between. A negative
+        // entry has no file, and the one named after its hash may belong to another URL
+        if (slot->metadata.status == 0)
+        {
+            char* path = object_path(slot->hash);
+            if (path != NULL && unlink(path) == -1 && errno != ENOENT)
+                perror("Error removing an evicted object\n");
+            free(path);
+        }
+
+        release_slot(slot);
+        evicted++;
+    }
+
+    header->evictions += evicted;
+    flock(index_fd, LOCK_UN);
+
+    return evicted;
+}
+
+
+int cache_store_usage(int64_t* bytes, int64_t* objects, int64_t* evictions)
+{
+    if (open_index() == -1)
+        return -1;
+
+    *bytes = header->total_bytes;
+    *objects = header->object_count;
+    *evictions = header->evictions;
+    return 0;
+}
+
+
+void cache_store_after_fork(void)
+{
+    if (store_status == 1)
+    {
+        munmap(header, sizeof(cache_index_header) + CACHE_INDEX_SLOTS * sizeof(cache_slot));
+        close(index_fd);
+    }
+
+    store_status = 0;
+    index_fd = -1;
+    header = NULL;
+    slots = NULL;
+}
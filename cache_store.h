@@ -0,0 +1,216 @@
+#ifndef CPROXY_CACHE_STORE_H
+#define CPROXY_CACHE_STORE_H
+
+
+#include "cproxy.h"
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sched.h>
+
+
+#define CACHE_ROOT "cache" // Directory holding the index and the cached objects
+#define CACHE_INDEX_PATH CACHE_ROOT "/index" // Memory-mapped index of the cached objects
+#define CACHE_INDEX_MAGIC "CPRXIDX6" // Identifies an index file and its layout version
+#define CACHE_INDEX_SLOTS 65536 // Number of slots of the index hash table
+#define CACHE_MAX_PROBES 64 // Slots examined before a lookup gives up
+#define CACHE_READ_RETRIES 64 // Times a reader reads a slot again while it is being written, before it gives up
+#define CACHE_KEY_CAPACITY 384 // Longest normalized URL that can be cached
+#define CACHE_MAX_FREQUENCY 3 // Passes of the eviction hand a frequently hit object survives
+#define CACHE_EVICTION_STEPS 256 // Objects the eviction hand examines per pass
+#define CACHE_EVICTION_BATCH 64 // Objects evicted per pass at most
+#define CACHE_ETAG_CAPACITY 64 // Room for an ETag and its null terminator, longer ones are not kept
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT" // IMF-fixdate, the format of HTTP date headers
+#define CACHE_UNREACHABLE -1 // Status of a negative entry for an origin that could not be resolved or connected to
+
+typedef enum{
+    SLOT_EMPTY, // Never used, ends a probe sequence
+    SLOT_VALID, // Describes a cached object
+    SLOT_DELETED // Used to describe an object, probing continues past it
+} slot_state;
+
+typedef struct{
+    int64_t expires_at; // When the object becomes stale, in seconds since the epoch
+    int64_t last_modified; // Last-Modified of the object in seconds since the epoch, or 0
+    char etag[CACHE_ETAG_CAPACITY]; // ETag of the object including its quotes, or an empty string
+    int32_t encoding; // content_encoding of the object as stored: compressed bodies are kept compressed
+    int32_t status; // 0 for an object, else the error of a negative entry: a status code or CACHE_UNREACHABLE
+} cache_metadata;
+
+typedef struct{
+    uint64_t hash; // Hash of the key, also the name of the object file
+    uint32_t state; // slot_state, written last when a slot is filled
+    uint32_t key_length; // Length of key
+    int64_t size; // Size of the cached object
+    int64_t stored_at; // When the object was saved, in seconds since the epoch
+    cache_metadata metadata; // Freshness and validators of the object
+    uint32_t frequency; // Fresh reads since the eviction hand last passed, up to CACHE_MAX_FREQUENCY
+    uint32_t sequence; // Odd while a writer changes the slot, bumped again once done. Readers retry if it moved
+    char key[CACHE_KEY_CAPACITY]; // Normalized URL, compared on lookup so hash collisions never give wrong hits
+} cache_slot;
+
+typedef struct{
+    char magic[8]; // CACHE_INDEX_MAGIC
+    uint32_t slot_count; // Number of slots following the header
+    uint32_t clock_hand; // Next slot the eviction hand examines
+    uint32_t padding; // Keeps the counters aligned
+    int64_t total_bytes; // Sum of the sizes of the valid slots
+    int64_t object_count; // Number of valid slots
+    int64_t evictions; // Objects evicted to stay within the budget since the index was created
+    char reserved[sizeof(cache_slot) - 48]; // Keeps the slots aligned
+} cache_index_header;
+
+
+/**
+ * Builds the normalized key of a URL: lowercase host, explicit port and path without fragment.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @return A pointer to a dynamically allocated string containing the key, or NULL if memory allocation fails.
+ */
+char* cache_key(full_URL*);
+
+/**
+ * Hashes a normalized key with FNV-1a. The hash names the object file of the key.
+ *
+ * @param key: The key, as built by cache_key.
+ * @param key_length: The length of the key.
+ * @return The 64-bit hash of the key.
+ */
+uint64_t cache_key_hash(const char*, size_t);
+
+/**
+ * Finds the cached object of a URL in the index.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param size: Set to the size of the object when it is found. It can be NULL.
+ * @param metadata: Set to the freshness and validators of the object when it is found. It can be NULL.
+ * @return 1 if the URL is cached, fresh or not, else 0. A negative entry is not an object and gives 0.
+ */
+int cache_store_lookup(full_URL*, off_t*, cache_metadata*);
+
+/**
+ * Opens the cached object of a URL for reading.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param size: Set to the size of the object when it is opened.
+ * @param metadata: Set to the freshness and validators of the object when it is opened. It can be NULL.
+ * @return The descriptor of the object, or -1 if the URL is not cached.
+ */
+int cache_store_open_object(full_URL*, off_t*, cache_metadata*);
+
+/**
+ * Prepares saving the object of a URL: creates a temporary file next to where the object goes.
+ * The fill writes it, and cache_store_commit moves it into place once complete.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param temp_path: Set to a dynamically allocated string containing the path of the temporary file.
+ *                   The caller frees it, and unlinks the file if it is not committed.
+ * @return The descriptor of the temporary file open for writing,
+ *         or -1 if the URL cannot be cached (index unavailable, key too long, hash collision or file error).
+ */
+int cache_store_prepare(full_URL*, char**);
+
+/**
+ * Renames a file filled after cache_store_prepare over the object of a URL and records it in the index.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param temp_path: The path of the temporary file.
+ * @param size: The size of the saved object.
+ * @param metadata: The freshness and validators of the saved object.
+ * @return 0 on success, or -1 if the index has no room for the URL or the file cannot be renamed.
+ *         The temporary file is left in place on failure.
+ */
+int cache_store_commit(full_URL*, const char*, off_t, const cache_metadata*);
+
+/**
+ * Updates the freshness of a cached object the origin confirmed with 304 Not Modified.
+ * Validators missing from the 304 response keep their stored values.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param metadata: The freshness and validators sent with the 304 response.
+ * @return 0 on success, or -1 if the URL is no longer cached.
+ */
+int cache_store_refresh(full_URL*, const cache_metadata*);
+
+/**
+ * Remembers for '--negative-ttl' seconds that a URL failed, so the next requests are answered without the origin.
+ * The entry takes the slot of the URL, without an object file. A cached object of the URL is kept when the failure
+ * may be temporary (5xx or an unreachable origin), so it can still be served stale; 404 and 410 replace it.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param status: The status code of the error response, or CACHE_UNREACHABLE.
+ * @return 0 on success, or -1 if negative caching is off, the index has no room for the URL or is unavailable.
+ */
+int cache_store_record_failure(full_URL*, int);
+
+/**
+ * Finds a negative entry of a URL that has not expired yet.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @return The status recorded with cache_store_record_failure, or 0 if the URL has no fresh negative entry.
+ */
+int cache_store_lookup_failure(full_URL*);
+
+/**
+ * Checks whether a cached object can be served without asking the origin.
+ *
+ * @param metadata: The freshness and validators of the object.
+ * @return 1 if the object is fresh, else 0.
+ */
+int cache_is_fresh(const cache_metadata*);
+
+/**
+ * Checks whether a cached object may still be served, fresh or stale for a bounded time.
+ *
+ * @param metadata: The freshness and validators of the object.
+ * @param max_staleness: The seconds the object may have been stale for, 0 to require a fresh one, -1 for any.
+ * @return 1 if the object may be served, else 0.
+ */
+int cache_is_usable(const cache_metadata*, int);
+
+/**
+ * Builds the conditional request headers (If-None-Match, If-Modified-Since) for a URL whose cached copy is stale.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param headers: The buffer the null-terminated header lines are written to, each ending with CRLF.
+ * @param size: The size of the buffer.
+ * @return The length of the headers, or 0 if the URL has no stale copy with validators.
+ */
+size_t cache_conditional_headers(full_URL*, char*, size_t);
+
+/**
+ * Evicts objects until the cache is within the '--cache-size' and '--cache-objects' budgets, or the pass ends.
+ * A CLOCK hand sweeps the slots: objects read since it last passed lose one pass of credit, the others go.
+ * Every commit runs a pass, the server and batch modes run one every second to finish what the fills left.
+ *
+ * @param max_steps: Objects the hand may examine.
+ * @return The number of objects evicted.
+ */
+int cache_store_evict(size_t);
+
+/**
+ * Reads the usage of the disk cache, shared by every process using it.
+ *
+ * @param bytes: Set to the sum of the sizes of the cached objects.
+ * @param objects: Set to the number of cached objects.
+ * @param evictions: Set to the number of objects evicted since the index was created.
+ * @return 0 on success, or -1 if the index is unavailable.
+ */
+int cache_store_usage(int64_t*, int64_t*, int64_t*);
+
+/**
+ * Removes a URL from the index, for example because its object went missing.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ */
+void cache_store_remove(full_URL*);
+
+/**
+ * Forgets the index inherited from the parent after fork(). A lock on the inherited descriptor would be shared with
+ * the parent, so the child opens the index again on its next use and locks its own descriptor.
+ */
+void cache_store_after_fork(void);
+
+
+#endif //CPROXY_CACHE_STORE_H
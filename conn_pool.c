@@ -0,0 +1,233 @@
+#include "conn_pool.h"
+
+
+
+void conn_pool_init(conn_pool* pool, size_t max_host_connections, long idle_timeout)
+{
+    memset(pool->buckets, 0, sizeof(pool->buckets));
+    pool->max_host_connections = max_host_connections;
+    pool->idle_timeout = idle_timeout;
+}
+
+
+static size_t hash_origin(const char* host, int port)
+{
+    // FNV-1a over the lower-cased host name and the port
+    size_t hash = 2166136261u;
+    for (const char* c = host; *c != '\0'; c++)
+    {
+        char lower = (*c >= 'A' && *c <= 'Z') ? (char)(*c - 'A' + 'a') : *c;
+        hash = (hash ^ (unsigned char)lower) * 16777619u;
+    }
+
+    hash = (hash ^ (size_t)port) * 16777619u;
+    return hash % POOL_BUCKETS;
+}
+
+
+static host_pool* find_host_pool(conn_pool* pool, full_URL* my_url, int create)
+{
+    size_t bucket = hash_origin(my_url->host, my_url->port);
+
+    for (host_pool* entry = pool->buckets[bucket]; entry != NULL; entry = entry->next)
+        if (entry->port == my_url->port && strcasecmp(entry->host, my_url->host) == 0)
+            return entry;
+
+    if (!create)
+        return NULL;
+
+    host_pool* entry = (host_pool*)calloc(1, sizeof(host_pool));
+    if (entry == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return NULL;
+    }
+
+    entry->host = strdup(my_url->host);
+    if (entry->host == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        free(entry);
+        return NULL;
+    }
+
+    entry->port = my_url->port;
+    entry->next = pool->buckets[bucket];
+    pool->buckets[bucket] = entry;
+    return entry;
+}
+
+
+static int is_socket_alive(int sd)
+{
+    char byte;
+
+    // An idle socket must have nothing to read: EOF or stray bytes both make it unusable
+    ssize_t peeked = recv(sd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+pool_result conn_pool_acquire(conn_pool* pool, full_URL* my_url, int* sd)
+{
+    host_pool* entry = find_host_pool(pool, my_url, 1);
+    if (entry == NULL)
+        return POOL_ERROR;
+
+    // Hand out the most recently used idle socket that the origin did not close meanwhile
+    while (entry->idle != NULL)
+    {
+        idle_socket* idle = entry->idle;
+        entry->idle = idle->next;
+
+        int idle_sd = idle->sd;
+        free(idle);
+
+        if (is_socket_alive(idle_sd))
+        {
+            entry->active++;
+            *sd = idle_sd;
+            return POOL_REUSED;
+        }
+
+        close(idle_sd);
+    }
+
+    if (entry->active >= pool->max_host_connections)
+        return POOL_FULL;
+
+    entry->active++;
+    return POOL_NEW;
+}
+
+
+void conn_pool_release(conn_pool* pool, full_URL* my_url, int sd, int reusable)
+{
+    host_pool* entry = find_host_pool(pool, my_url, 0);
+    if (entry == NULL)
+    {
+        if (sd != -1)
+            close(sd);
+        return;
+    }
+
+    entry->active--;
+
+    idle_socket* idle = NULL;
+    if (sd != -1 && reusable && pool->idle_timeout > 0)
+        idle = (idle_socket*)malloc(sizeof(idle_socket));
+
+    if (idle != NULL)
+    {
+        idle->sd = sd;
+        clock_gettime(CLOCK_MONOTONIC, &idle->idle_since);
+        idle->next = entry->idle;
+        entry->idle = idle;
+    }
+    else if (sd != -1)
+        close(sd);
+
+    // Let the first waiting fetch take the socket or the freed slot
+    pool_waiter* waiter = entry->waiters_head;
+    if (waiter != NULL)
+    {
+        entry->waiters_head = waiter->next;
+        if (entry->waiters_head == NULL)
+            entry->waiters_tail = NULL;
+        waiter->next = NULL;
+        waiter->ready(waiter);
+    }
+}
+
+
+void conn_pool_wait(conn_pool* pool, full_URL* my_url, pool_waiter* waiter)
+{
+    host_pool* entry = find_host_pool(pool, my_url, 0);
+    if (entry == NULL)
+        return;
+
+    waiter->next = NULL;
+    if (entry->waiters_tail != NULL)
+        entry->waiters_tail->next = waiter;
+    else
+        entry->waiters_head = waiter;
+    entry->waiters_tail = waiter;
+}
+
+
+void conn_pool_cancel_wait(conn_pool* pool, full_URL* my_url, pool_waiter* waiter)
+{
+    host_pool* entry = find_host_pool(pool, my_url, 0);
+    if (entry == NULL)
+        return;
+
+    pool_waiter* previous = NULL;
+    for (pool_waiter* current = entry->waiters_head; current != NULL; previous = current, current = current->next)
+    {
+        if (current != waiter)
+            continue;
+
+        if (previous != NULL)
+            previous->next = current->next;
+        else
+            entry->waiters_head = current->next;
+
+        if (entry->waiters_tail == current)
+            entry->waiters_tail = previous;
+        return;
+    }
+}
+
+
+void conn_pool_expire(conn_pool* pool)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (size_t bucket = 0; bucket < POOL_BUCKETS; bucket++)
+    {
+        for (host_pool* entry = pool->buckets[bucket]; entry != NULL; entry = entry->next)
+        {
+            idle_socket** link = &entry->idle;
+            while (*link != NULL)
+            {
+                idle_socket* idle = *link;
+                if (now.tv_sec - idle->idle_since.tv_sec >= pool->idle_timeout)
+                {
+                    *link = idle->next;
+                    close(idle->sd);
+                    free(idle);
+                }
+                else
+                    link = &idle->next;
+            }
+        }
+    }
+}
+
+
+void conn_pool_close(conn_pool* pool)
+{
+    for (size_t bucket = 0; bucket < POOL_BUCKETS; bucket++)
+    {
+        host_pool* entry = pool->buckets[bucket];
+        while (entry != NULL)
+        {
+            host_pool* next = entry->next;
+
+            while (entry->idle != NULL)
+            {
+                idle_socket* idle = entry->idle;
+                entry->idle = idle->next;
+                close(idle->sd);
+                free(idle);
+            }
+
+            free(entry->host);
+            free(entry);
+            entry = next;
+        }
+
+        pool->buckets[bucket] = NULL;
+    }
+}
@@ -0,0 +1,118 @@
+#ifndef CPROXY_CONN_POOL_H
+#define CPROXY_CONN_POOL_H
+
+
+#include "cproxy.h"
+#include <strings.h>
+#include <time.h>
+#include <sys/socket.h>
+
+
+#define POOL_BUCKETS 256 // Number of hash buckets for the per-origin pools
+#define DEFAULT_MAX_HOST_CONNECTIONS 8 // Default maximum number of sockets per origin
+#define DEFAULT_IDLE_TIMEOUT 30 // Default seconds an idle socket is kept open
+
+typedef enum{
+    POOL_REUSED, // An idle socket was handed out
+    POOL_NEW, // A slot was granted, the caller opens a new socket
+    POOL_FULL, // The origin is at its limit, the caller has to wait
+    POOL_ERROR // Memory allocation failed
+} pool_result;
+
+typedef struct pool_waiter pool_waiter;
+
+struct pool_waiter{
+    void (*ready)(pool_waiter*); // Called once a slot may be available
+    pool_waiter* next; // Next waiter of the same origin
+};
+
+typedef struct idle_socket{
+    int sd; // Socket descriptor
+    struct timespec idle_since; // When the socket was returned to the pool
+    struct idle_socket* next; // Next idle socket of the same origin
+} idle_socket;
+
+typedef struct host_pool{
+    char* host; // Origin host name
+    int port; // Origin port
+    size_t active; // Sockets handed out and not released yet
+    idle_socket* idle; // Idle sockets, most recently used first
+    pool_waiter* waiters_head; // First fetch waiting for a slot
+    pool_waiter* waiters_tail; // Last fetch waiting for a slot
+    struct host_pool* next; // Next pool in the same bucket
+} host_pool;
+
+typedef struct{
+    host_pool* buckets[POOL_BUCKETS]; // Per-origin pools, hashed by host and port
+    size_t max_host_connections; // Maximum number of sockets handed out per origin
+    long idle_timeout; // Seconds an idle socket is kept open
+} conn_pool;
+
+
+/**
+ * Initializes an empty connection pool.
+ *
+ * @param pool: A pointer to the 'conn_pool' structure to initialize.
+ * @param max_host_connections: The maximum number of sockets per origin.
+ * @param idle_timeout: The number of seconds an idle socket is kept open.
+ */
+void conn_pool_init(conn_pool*, size_t, long);
+
+/**
+ * Requests a socket to the origin of a URL.
+ *
+ * @param pool: A pointer to an initialized 'conn_pool' structure.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name and port.
+ * @param sd: Set to the idle socket descriptor when POOL_REUSED is returned.
+ * @return
+ *   - POOL_REUSED if a live idle socket was found.
+ *   - POOL_NEW if the caller may open a new socket. It must be passed to conn_pool_release later, even on failure.
+ *   - POOL_FULL if the origin already has its maximum number of sockets. See conn_pool_wait.
+ *   - POOL_ERROR if memory allocation fails.
+ */
+pool_result conn_pool_acquire(conn_pool*, full_URL*, int*);
+
+/**
+ * Returns a socket obtained through conn_pool_acquire and wakes up a fetch waiting for the origin.
+ *
+ * @param pool: A pointer to an initialized 'conn_pool' structure.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name and port.
+ * @param sd: The socket descriptor, or -1 if opening it failed.
+ * @param reusable: 1 to keep the socket open for the next request, 0 to close it.
+ */
+void conn_pool_release(conn_pool*, full_URL*, int, int);
+
+/**
+ * Queues a waiter to be notified once the origin of a URL may have a free slot.
+ *
+ * @param pool: A pointer to an initialized 'conn_pool' structure.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name and port.
+ * @param waiter: The waiter to queue. Its ready function must be set.
+ */
+void conn_pool_wait(conn_pool*, full_URL*, pool_waiter*);
+
+/**
+ * Removes a queued waiter.
+ *
+ * @param pool: A pointer to an initialized 'conn_pool' structure.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name and port.
+ * @param waiter: The waiter to remove.
+ */
+void conn_pool_cancel_wait(conn_pool*, full_URL*, pool_waiter*);
+
+/**
+ * Closes the idle sockets that exceeded the idle timeout.
+ *
+ * @param pool: A pointer to an initialized 'conn_pool' structure.
+ */
+void conn_pool_expire(conn_pool*);
+
+/**
+ * Closes all idle sockets and frees the pool.
+ *
+ * @param pool: A pointer to an initialized 'conn_pool' structure.
+ */
+void conn_pool_close(conn_pool*);
+
+
+#endif //CPROXY_CONN_POOL_H
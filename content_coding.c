@@ -0,0 +1,242 @@
+#include "content_coding.h"
+
+
+
+static int token_is(const char* token, size_t token_length, const char* expected)
+{
+    return token_length == strlen(expected) && strncasecmp(token, expected, token_length) == 0;
+}
+
+
+content_encoding parse_content_encoding(const char* value, size_t length)
+{
+    while (length > 0 && (*value == ' ' || *value == '\t'))
+    {
+        value++;
+        length--;
+    }
+    while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t'))
+        length--;
+
+    if (length == 0 || token_is(value, length, "identity"))
+        return ENCODING_IDENTITY;
+    if (token_is(value, length, "gzip") || token_is(value, length, "x-gzip"))
+        return ENCODING_GZIP;
+    if (token_is(value, length, "deflate"))
+        return ENCODING_DEFLATE;
+
+    return ENCODING_UNSUPPORTED;
+}
+
+
+static int quality_is_zero(const char* parameters, size_t length)
+{
+    // ";q=0", ";q=0.0" and so on refuse the coding
+    const char* quality = NULL;
+    for (size_t i = 0; i + 1 < length; i++)
+    {
+        if ((parameters[i] == 'q' || parameters[i] == 'Q') && parameters[i + 1] == '=')
+        {
+            quality = parameters + i + 2;
+            length -= i + 2;
+            break;
+        }
+    }
+
+    if (quality == NULL || length == 0 || quality[0] != '0')
+        return 0;
+
+    for (size_t i = 1; i < length; i++)
+        if (quality[i] != '.' && quality[i] != '0' && quality[i] != ' ' && quality[i] != '\t')
+            return 0;
+
+    return 1;
+}
+
+
+unsigned parse_accept_encoding(const char* request)
+{
+    unsigned accepted = 1u << ENCODING_IDENTITY;
+
+    const char* value = strcasestr(request, "\r\nAccept-Encoding:");
+    if (value == NULL)
+        return accepted;
+
+    value += strlen("\r\nAccept-Encoding:");
+    const char* end = strstr(value, "\r\n");
+    if (end == NULL)
+        end = value + strlen(value);
+
+    while (value < end)
+    {
+        const char* item_end = memchr(value, ',', end - value);
+        if (item_end == NULL)
+            item_end = end;
+
+        while (value < item_end && (*value == ' ' || *value == '\t'))
+            value++;
+
+        // The coding name ends at its parameters, if any
+        size_t name_length = 0;
+        while (value + name_length < item_end && value[name_length] != ';' && value[name_length] != ' ' &&
+               value[name_length] != '\t')
+            name_length++;
+
+        if (!quality_is_zero(value + name_length, item_end - value - name_length))
+        {
+            if (token_is(value, name_length, "gzip") || token_is(value, name_length, "x-gzip"))
+                accepted |= 1u << ENCODING_GZIP;
+            else if (token_is(value, name_length, "deflate"))
+                accepted |= 1u << ENCODING_DEFLATE;
+            else if (token_is(value, name_length, "*"))
+                accepted |= (1u << ENCODING_GZIP) | (1u << ENCODING_DEFLATE);
+        }
+
+        value = item_end + 1;
+    }
+
+    return accepted;
+}
+
+
+int encoding_accepted(unsigned accepted, content_encoding encoding)
+{
+    return encoding != ENCODING_UNSUPPORTED && (accepted & (1u << encoding)) != 0;
+}
+
+
+int format_cached_header(char* header, size_t size, off_t body_size, content_encoding encoding)
+{
+    char length_field[64] = "";
+    if (body_size >= 0)
+        snprintf(length_field, sizeof(length_field), "Content-Length: %ld\r\n", (long)body_size);
+
+    // Other clients may get the same object decoded
+    const char* coding_field = "";
+    if (encoding == ENCODING_GZIP)
+        coding_field = "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+    else if (encoding == ENCODING_DEFLATE)
+        coding_field = "Content-Encoding: deflate\r\nVary: Accept-Encoding\r\n";
+
+    return snprintf(header, size, "HTTP/1.0 200 OK\r\n%s%s\r\n", length_field, coding_field);
+}
+
+
+void body_decoder_init(body_decoder* decoder, content_encoding encoding, int fd, off_t size)
+{
+    memset(&decoder->stream, 0, sizeof(decoder->stream));
+    decoder->started = 0;
+    decoder->finished = size == 0; // An empty body needs no decoding
+    decoder->encoding = encoding;
+    decoder->fd = fd;
+    decoder->offset = 0;
+    decoder->size = size;
+}
+
+
+static int start_inflating(body_decoder* decoder)
+{
+    // 16 + 15 reads a gzip wrapper, 15 a zlib one and -15 raw deflate data
+    int window_bits = 16 + MAX_WBITS;
+    if (decoder->encoding == ENCODING_DEFLATE)
+    {
+        // A zlib header names the deflate method and is a multiple of 31
+        const unsigned char* data = decoder->stream.next_in;
+        int zlib_header = decoder->stream.avail_in >= 2 && (data[0] & 0x0f) == Z_DEFLATED &&
+                          ((data[0] << 8) | data[1]) % 31 == 0;
+        window_bits = zlib_header ? MAX_WBITS : -MAX_WBITS;
+    }
+
+    if (inflateInit2(&decoder->stream, window_bits) != Z_OK)
+    {
+        fprintf(stderr, "inflateInit2 failed\n");
+        return -1;
+    }
+
+    decoder->started = 1;
+    return 0;
+}
+
+
+ssize_t body_decoder_read(body_decoder* decoder, char* out, size_t out_size)
+{
+    if (decoder->finished)
+        return 0;
+
+    decoder->stream.next_out = (Bytef*)out;
+    decoder->stream.avail_out = out_size;
+
+    while (1)
+    {
+        // Only DECODER_INPUT_SIZE compressed bytes are held at a time
+        if (decoder->stream.avail_in == 0 && decoder->offset < decoder->size)
+        {
+            size_t wanted = decoder->size - decoder->offset;
+            if (wanted > sizeof(decoder->input))
+                wanted = sizeof(decoder->input);
+
+            ssize_t read_size = pread(decoder->fd, decoder->input, wanted, decoder->offset);
+            if (read_size < 0 && errno == EINTR)
+                continue;
+            if (read_size <= 0)
+                return -1; // The file shrank meanwhile
+
+            decoder->offset += read_size;
+            decoder->stream.next_in = decoder->input;
+            decoder->stream.avail_in = read_size;
+        }
+
+        if (!decoder->started && start_inflating(decoder) == -1)
+            return -1;
+
+        int status = inflate(&decoder->stream, Z_NO_FLUSH);
+        size_t produced = out_size - decoder->stream.avail_out;
+
+        if (status == Z_STREAM_END)
+        {
+            decoder->finished = 1;
+            return produced;
+        }
+
+        if (status != Z_OK && status != Z_BUF_ERROR)
+            return -1;
+
+        if (produced > 0)
+            return produced;
+
+        // The object ended before the compressed stream did
+        if (decoder->stream.avail_in == 0 && decoder->offset >= decoder->size)
+            return -1;
+    }
+}
+
+
+void body_decoder_close(body_decoder* decoder)
+{
+    if (decoder->started)
+        inflateEnd(&decoder->stream);
+    decoder->started = 0;
+}
+
+
+ssize_t decode_file_contents(int out_fd, int in_fd, off_t size, content_encoding encoding)
+{
+    body_decoder decoder;
+    char buffer[DECODER_INPUT_SIZE];
+    size_t total_written_bytes = 0;
+    ssize_t decoded_bytes;
+
+    body_decoder_init(&decoder, encoding, in_fd, size);
+    while ((decoded_bytes = body_decoder_read(&decoder, buffer, sizeof(buffer))) > 0)
+    {
+        if (write_all(out_fd, buffer, decoded_bytes) == -1)
+        {
+            decoded_bytes = -1;
+            break;
+        }
+        total_written_bytes += decoded_bytes;
+    }
+
+    body_decoder_close(&decoder);
+    return decoded_bytes == -1 ? -1 : (ssize_t)total_written_bytes;
+}
@@ -0,0 +1,109 @@
+#ifndef CPROXY_CONTENT_CODING_H
+#define CPROXY_CONTENT_CODING_H
+
+
+#include "cproxy.h"
+#include <strings.h>
+#include <zlib.h>
+
+
+#define ACCEPT_ENCODING "gzip, deflate" // Content codings asked from the origins
+#define DECODER_INPUT_SIZE (16 * 1024) // Compressed bytes read from a cached object at a time
+
+typedef enum{
+    ENCODING_IDENTITY, // Not compressed
+    ENCODING_GZIP, // gzip
+    ENCODING_DEFLATE, // zlib stream, or a raw deflate stream from origins that get "deflate" wrong
+    ENCODING_UNSUPPORTED // Any other coding, or several stacked ones
+} content_encoding;
+
+typedef struct{
+    z_stream stream; // State of zlib
+    int started; // 1 once inflateInit2 was called, which waits for the first compressed bytes
+    int finished; // 1 once the end of the compressed stream was reached
+    content_encoding encoding; // Coding of the object
+    int fd; // Descriptor of the compressed object
+    off_t offset; // Offset of the next compressed bytes to read
+    off_t size; // Size of the compressed object
+    unsigned char input[DECODER_INPUT_SIZE]; // Compressed bytes not inflated yet
+} body_decoder;
+
+
+/**
+ * Parses the value of a Content-Encoding header.
+ *
+ * @param value: The header value, not null-terminated.
+ * @param length: The length of the value.
+ * @return The coding of the body, ENCODING_UNSUPPORTED if it cannot be decoded.
+ */
+content_encoding parse_content_encoding(const char*, size_t);
+
+/**
+ * Finds the content codings a client accepts in the Accept-Encoding header of its request.
+ * Clients that send no Accept-Encoding get identity, since tools that do not decode bodies leave it out.
+ *
+ * @param request: The null-terminated request header.
+ * @return A bit mask with bit (1 << encoding) set for every accepted coding. Identity is always accepted.
+ */
+unsigned parse_accept_encoding(const char*);
+
+/**
+ * Checks whether a body in the given coding can be sent to a client as-is.
+ *
+ * @param accepted: The mask returned by parse_accept_encoding.
+ * @param encoding: The coding of the body.
+ * @return 1 if the client accepts the coding, else 0.
+ */
+int encoding_accepted(unsigned, content_encoding);
+
+/**
+ * Builds the header sent in front of a cached object.
+ *
+ * @param header: The buffer the null-terminated header is written to.
+ * @param size: The size of the buffer.
+ * @param body_size: The size of the body, or -1 if it is decoded while sent and its end is marked by closing.
+ * @param encoding: The coding of the body as sent, named in Content-Encoding unless it is identity.
+ * @return The length of the header.
+ */
+int format_cached_header(char*, size_t, off_t, content_encoding);
+
+/**
+ * Prepares the streaming decompression of a cached object. Memory use is bounded whatever the object size.
+ *
+ * @param decoder: A pointer to the 'body_decoder' structure to initialize.
+ * @param encoding: The coding of the object, ENCODING_GZIP or ENCODING_DEFLATE.
+ * @param fd: The descriptor of the object. It is read with pread and not closed by the decoder.
+ * @param size: The size of the object.
+ */
+void body_decoder_init(body_decoder*, content_encoding, int, off_t);
+
+/**
+ * Decompresses the next part of an object.
+ *
+ * @param decoder: A pointer to an initialized 'body_decoder' structure.
+ * @param out: The buffer the decoded bytes are written to.
+ * @param out_size: The size of out.
+ * @return The number of decoded bytes, 0 at the end of the object, or -1 if it is corrupt or cannot be read.
+ */
+ssize_t body_decoder_read(body_decoder*, char*, size_t);
+
+/**
+ * Releases the zlib state of a decoder.
+ *
+ * @param decoder: A pointer to an initialized 'body_decoder' structure.
+ */
+void body_decoder_close(body_decoder*);
+
+/**
+ * Decompresses a cached object to a descriptor.
+ *
+ * @param out_fd: The descriptor to write to.
+ * @param in_fd: The descriptor of the compressed object.
+ * @param size: The size of the compressed object.
+ * @param encoding: The coding of the object, ENCODING_GZIP or ENCODING_DEFLATE.
+ * @return The number of decoded bytes written, or -1 if the object is corrupt or writing failed.
+ */
+ssize_t decode_file_contents(int, int, off_t, content_encoding);
+
+
+#endif //CPROXY_CONTENT_CODING_H
@@ -1,4 +1,19 @@
 #include "cproxy.h"
+#include "response.h"
+#include "server.h"
+#include "batch.h"
+#include "conn_pool.h"
+#include "resolver.h"
+#include "mem_cache.h"
+#include "cache_store.h"
+#include "content_coding.h"
+#include "range_fetch.h"
+#include "latency_stats.h"
+#include "prefetch.h"
+
+
+proxy_options options; // Command-line options of the running process
+static phase_timer request_timing; // Phases of the single fetch mode, measured when timing is on
 
 
 
@@ -9,220 +24,250 @@ void exit_program(full_URL* my_url)
 }
 
 
-full_URL* initialize_full_URL()
-{
-    full_URL* my_url = (full_URL*)malloc(sizeof(full_URL));
-    if (my_url == NULL)
-    {
-        fprintf(stderr, "Malloc failed\n");
-        return NULL;
-    }
+typedef struct{
+    char* next; // Where the next string is copied
+} url_arena;
 
-    // Initialize members to default values
-    my_url->host = NULL;
-    my_url->path = NULL;
-    my_url->port = 80; // Default port for HTTP
-    my_url->is_legal_path = -1;
 
-    return my_url;
+static char* arena_start(url_arena* arena)
+{
+    return arena->next;
 }
 
 
-int get_path(const char* str, full_URL* my_url)
+static void arena_append(url_arena* arena, const char* str, size_t length)
 {
-    if (my_url == NULL || str == NULL)
-    {
-        fprintf(stderr, "Given input is not valid.\n");
-        return -1;
-    }
-
-
-    const char* http_pos = strstr(str, "http://");
-    if (http_pos == NULL)
-    { // No 'http://' found, invalid URL
-        fprintf(stderr, "URL format is invalid.\n");
-        return -1;
-    }
-
-    http_pos += 7; // Skip 'http://'
-
-    // Find the start of the path, which is after the host and optional port
-    const char* path_start = strchr(http_pos, '/');
-    if (path_start == NULL)
-    {
-        // URL ends after host (no port, no path)
-        my_url->path = (char*)malloc(2); // Allocate memory for "/"
-        if (my_url->path == NULL)
-        {
-            fprintf(stderr, "Malloc failed\n");
-            return -1;
-        }
-        strcpy(my_url->path, "/");
-        my_url->is_legal_path = !PATH_EXISTS;
-        return 0;
-    }
-
-    // Allocate memory for path
-    my_url->path = (char*)malloc(strlen(path_start) + 1);
-    if (my_url->path == NULL)
-    {
-        fprintf(stderr, "Malloc failed\n");
-        return -1;
-    }
-
-    strcpy(my_url->path, path_start);
-
-    // Check if path is just '/'
-    if (strcmp(my_url->path, "/") == 0)
-        my_url->is_legal_path = !PATH_EXISTS; // Indicate that the path is just '/'
-    else
-        my_url->is_legal_path = PATH_EXISTS; // Indicate that it's a full path
-
-    return 0;
+    // The block is sized for the longest strings a URL of its length gives, so this never runs out
+    memcpy(arena->next, str, length);
+    arena->next += length;
 }
 
 
-void free_full_URL(full_URL* my_url)
+static char* arena_finish(url_arena* arena, char* str)
 {
-    if (my_url != NULL)
-    {
-        if (my_url->host != NULL)
-            free(my_url->host);
-
-        if (my_url->path != NULL)
-            free(my_url->path);
-
-        free(my_url);
-    }
+    // Ends the string started at str
+    *arena->next++ = '\0';
+    return str;
 }
 
 
-int get_host(const char* str, full_URL* my_url)
+static char* arena_copy(url_arena* arena, const char* str, size_t length)
 {
-
-    if (str == NULL || my_url == NULL)
-        return -1;
+    char* copy = arena_start(arena);
+    arena_append(arena, str, length);
+    return arena_finish(arena, copy);
+}
 
 
-    const char* http_pos = strstr(str, "http://");
-    if (http_pos == NULL)
-        return -1; // No 'http://' found, invalid URL
+full_URL* parse_URL(const char* url)
+{
+    if (url == NULL || !starts_with_http(url))
+        return NULL;
 
-    http_pos += 7; // Skip 'http://'
+    // One pass over the authority: the last '@' ends the userinfo, brackets enclose an IPv6 literal, a colon
+    // outside of them starts the port
+    const char* host_start = url + strlen("http://");
+    const char* host_end = NULL;
+    const char* port_start = NULL;
+    const char* c = host_start;
+    int in_brackets = 0;
 
+    for (; *c != '\0' && *c != '/' && *c != '?' && *c != '#'; c++)
+    {
+        if ((unsigned char)*c <= ' ' || *c == 0x7f)
+            return NULL;
 
-    // Find the position of the first '/' after 'http://'
-    const char* slash_pos = strchr(http_pos, '/');
-    // Check if there is a port in the URL
-    const char* port_pos = strchr(http_pos, ':');
+        if (*c == '@')
+        {
+            host_start = c + 1;
+            host_end = port_start = NULL;
+        }
+        else if (*c == '[' && c == host_start)
+            in_brackets = 1;
+        else if (*c == ']' && in_brackets)
+            in_brackets = 0;
+        else if (*c == ':' && !in_brackets && port_start == NULL)
+        {
+            host_end = c;
+            port_start = c + 1;
+        }
+    }
 
-    const char* end_pos;
+    const char* authority_end = c;
+    if (host_end == NULL)
+        host_end = authority_end;
+    if (in_brackets || host_end == host_start)
+        return NULL;
 
-    if (port_pos != NULL && (slash_pos == NULL || port_pos < slash_pos)) // Port found and before any slash
-        end_pos = port_pos;
-    else  // Slash found or no port
-        end_pos = (slash_pos != NULL) ? slash_pos : http_pos + strlen(http_pos);
+    // The host given to the resolver loses the brackets, the Host header and the cache key keep them
+    const char* name_start = host_start;
+    const char* name_end = host_end;
+    if (*host_start == '[')
+    {
+        if (host_end[-1] != ']' || host_end - host_start < 3)
+            return NULL;
+        name_start++;
+        name_end--;
+    }
+    // No other bracket may appear, in a bare host or inside the ones of a literal
+    if (memchr(name_start, '[', name_end - name_start) != NULL || memchr(name_start, ']', name_end - name_start))
+        return NULL;
 
+    // No port, or an empty one, means the default one
+    long port = 80;
+    if (port_start != NULL && port_start < authority_end)
+    {
+        port = 0;
+        for (const char* digit = port_start; digit < authority_end; digit++)
+        {
+            if (*digit < '0' || *digit > '9' || port > 65535)
+                return NULL;
+            port = port * 10 + (*digit - '0');
+        }
+        if (port < 1 || port > 65535)
+            return NULL;
+    }
 
-    size_t host_length = end_pos - http_pos; // Calculate length of host part
-    my_url->host = (char*)malloc(host_length + 1); // Allocate memory for host
-    if (my_url->host == NULL)
+    // The path runs to the fragment, which is never sent to the origin
+    const char* path_start = authority_end;
+    for (c = path_start; *c != '\0' && *c != '#'; c++)
+        if ((unsigned char)*c <= ' ' || *c == 0x7f)
+            return NULL;
+    size_t path_length = c - path_start;
+
+    // Every string lives in the block of the structure: the URL, the host, the path (with a leading slash added before
+    // a query string), the Host header value, the cache key and the head of the request. The last three repeat the
+    // host, the key and the head the path too, with at most a port and a few more characters
+    size_t url_length = strlen(url);
+    size_t host_length = host_end - host_start;
+    size_t arena_size = sizeof(full_URL) + url_length + 4 * host_length + 3 * path_length + 64;
+    full_URL* my_url = (full_URL*)malloc(arena_size);
+    if (my_url == NULL)
     {
         fprintf(stderr, "Malloc failed\n");
-        return -1;
+        return NULL;
     }
 
-    strncpy(my_url->host, http_pos, host_length);
-    my_url->host[host_length] = '\0';
+    url_arena arena = {(char*)(my_url + 1)};
+    my_url->url = arena_copy(&arena, url, url_length);
+    my_url->host = arena_copy(&arena, name_start, name_end - name_start);
+    my_url->port = (int)port;
+
+    char* path = arena_start(&arena);
+    if (path_length == 0 || *path_start != '/')
+        arena_append(&arena, "/", 1);
+    arena_append(&arena, path_start, path_length);
+    path_length = arena.next - path;
+    my_url->path = arena_finish(&arena, path);
+    my_url->is_legal_path = path_length == 1 ? !PATH_EXISTS : PATH_EXISTS;
+
+    // The port as given, or the default one, formatted backwards from its last digit
+    char port_digits[8];
+    char* port_string = port_digits + sizeof(port_digits);
+    for (long rest = port; rest > 0; rest /= 10)
+        *--port_string = (char)('0' + rest % 10);
+    *--port_string = ':';
+    int port_length = port_digits + sizeof(port_digits) - port_string;
+
+    // The Host header names the port unless it is the default one
+    char* host_header = arena_start(&arena);
+    arena_append(&arena, host_start, host_length);
+    if (port != 80)
+        arena_append(&arena, port_string, port_length);
+    size_t host_header_length = arena.next - host_header;
+    my_url->host_header = arena_finish(&arena, host_header);
+
+    // Host names are case-insensitive
+    char* key = arena_start(&arena);
+    for (const char* h = host_start; h < host_end; h++)
+        *arena.next++ = (char)(*h >= 'A' && *h <= 'Z' ? *h - 'A' + 'a' : *h);
+    arena_append(&arena, port_string, port_length);
+    arena_append(&arena, path, path_length);
+    my_url->key_length = arena.next - key;
+    my_url->key = arena_finish(&arena, key);
+    my_url->key_hash = cache_key_hash(my_url->key, my_url->key_length);
+
+    char* request_head = arena_start(&arena);
+    arena_append(&arena, "GET ", strlen("GET "));
+    arena_append(&arena, path, path_length);
+    arena_append(&arena, " HTTP/1.1\r\nHost: ", strlen(" HTTP/1.1\r\nHost: "));
+    arena_append(&arena, host_header, host_header_length);
+    arena_append(&arena, "\r\n", 2);
+    my_url->request_head_length = arena.next - request_head;
+    my_url->request_head = arena_finish(&arena, request_head);
 
-    return 0;
+    return my_url;
 }
 
 
-int get_port(const char* str, full_URL* my_url)
+full_URL* duplicate_full_URL(const full_URL* my_url)
 {
+    return parse_URL(my_url->url);
+}
 
-    if (my_url == NULL || str == NULL)
-        return -1;
 
+void free_full_URL(full_URL* my_url)
+{
+    // The strings share the block of the structure
+    free(my_url);
+}
 
-    const char* http_pos = strstr(str, "http://");
-    if (http_pos == NULL)
-        return -1; // No 'http://' found, invalid URL
 
-    http_pos += 7; // Skip 'http://'
 
-    // Find the position of the colon (if any), after skipping 'http://'
-    const char* colon_pos = strchr(http_pos, ':');
-    if (colon_pos == NULL)
-    {
-        my_url->port = 80; // Default port if no colon found
-        return 0; // Success
-    }
+int set_connection(full_URL* my_url)
+{
+    // The next runs answer from the negative cache instead of trying again
+    int sd = start_connection(my_url, 0, &request_timing);
+    if (sd == -1)
+        cache_store_record_failure(my_url, CACHE_UNREACHABLE);
+    return sd;
+}
 
-    char* end_ptr;
-    // Convert the string portion representing the port number to a long integer
-    long port_number = strtol(colon_pos + 1, &end_ptr, 10); // base 10 for decimal, skip ':'
 
-    // Check for errors
-    if ((colon_pos + 1) == end_ptr)
-    {
-        my_url->port = 80; // No number found, default to port 80
-        return 0; // Success
-    }
+int start_connection(full_URL* my_url, int nonblocking, phase_timer* timing)
+{
+    resolved_addresses result; // Addresses of the host
 
-    if (errno == ERANGE && (port_number == LONG_MAX || port_number == LONG_MIN))
+    int status = resolve_host(my_url->host, &result); // Get the server IPv4 and IPv6 addresses using the host name
+    if (status != 0) // Check if the resolution succeeded
     {
-        perror("The number is out of range for a long integer.");
-        return -1;
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status)); // Print error if host name resolution fails
+        return -1; // Return -1 to indicate failure
     }
+    phase_timer_end(timing, PHASE_DNS);
 
-    if (port_number < 0 || port_number > 65535)
+    // Try the addresses in order until one accepts the connection
+    for (int i = 0; i < result.count; i++)
     {
-        printf("Invalid port number. Port number should be between 0 and 65535.\n");
-        return -1;
+        int sd = connect_to_address(&result.addresses[i], result.lengths[i], my_url->port, nonblocking);
+        if (sd != -1)
+        {
+            phase_timer_end(timing, PHASE_CONNECT);
+            return sd; // Return the socket descriptor for the successful connection
+        }
     }
 
-    // If everything is fine, set the port number in my_url
-    my_url->port = (int)port_number;
-    return 0;
+    return -1; // Return -1 to indicate failure
 }
 
 
-
-int set_connection(full_URL* my_url)
+int connect_to_address(struct sockaddr_storage* address, socklen_t length, int port, int nonblocking)
 {
     int sd; // socket descriptor
-    struct hostent* server_info; // Structure to store information about the given host
-    struct sockaddr_in socket_info; // Structure to store the socket information
 
-    // Create socket with IPv4 and TCP
-    if ((sd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+    // Create a TCP socket of the address family
+    if ((sd = socket(address->ss_family, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0)) == -1)
     {
         perror("socket\n"); // Print error if socket creation fails
-        close(sd); // Close the socket
-        return -1; // Return -1 to indicate failure
-    }
-
-    // Initialize socket_info memory with zeros
-    memset(&socket_info, 0, sizeof(struct sockaddr_in));
-
-    socket_info.sin_family = AF_INET; // Set family to IPv4
-    server_info = gethostbyname(my_url->host); // Get server IP address using the host name
-    if (server_info == NULL) // Check if gethostbyname succeeded
-    {
-        herror("gethostbyname\n"); // Print error if host name resolution fails
-        close(sd); // Close the socket
         return -1; // Return -1 to indicate failure
     }
 
-    // Set the socket's IP address
-    socket_info.sin_addr.s_addr = ((struct in_addr*) server_info->h_addr)->s_addr;
     // Convert port number from host byte order to network byte order and set the socket's port
-    socket_info.sin_port = htons(my_url->port);
+    set_address_port(address, port);
 
     // Attempt to connect to the server
-    if(connect(sd, (struct sockaddr*) &socket_info, sizeof(struct sockaddr_in)) == -1)
+    // A non-blocking connect reports completion later through writability
+    if(connect(sd, (struct sockaddr*) address, length) == -1 && !(nonblocking && errno == EINPROGRESS))
     {
         perror("connect\n"); // Print error if connection attempt fails
         close(sd); // Close the socket
@@ -236,17 +281,28 @@ int set_connection(full_URL* my_url)
 size_t write_to_connection(int sd, full_URL* my_url)
 {
     size_t total_written_bytes = 0; // Counter for total bytes successfully written
-
-    // Buffer to hold the constructed HTTP request
-    char request[50 + strlen(my_url->path) + strlen(my_url->host)];
+    size_t data_length; // Length of the request to be sent
 
     // Construct the HTTP GET request with the host and path
-    snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", my_url->path, my_url->host);
-
-    size_t data_length = strlen(request); // Length of the request to be sent
+    char* request = build_request(my_url, 0, NULL, &data_length);
+    if (request == NULL)
+    {
+        close(sd); // Close the socket
+        exit(EXIT_FAILURE); // Exit with failure
+    }
 
-    // Debug print to show the constructed HTTP request and its length
-    printf("HTTP request =\n%s\nLEN = %zu\n", request, strlen(request));
+    // Full output shows the request and its length, written with its label in one call
+    if (options.output == OUTPUT_FULL)
+    {
+        char length_line[64];
+        int length_line_size = snprintf(length_line, sizeof(length_line), "\nLEN = %zu\n", data_length);
+        struct iovec parts[3] = {
+            {(char*)"HTTP request =\n", strlen("HTTP request =\n")},
+            {request, data_length},
+            {length_line, length_line_size}
+        };
+        writev_all(options.output_fd, parts, 3);
+    }
 
     do {
         // Attempt to write the request to the socket
@@ -264,322 +320,490 @@ size_t write_to_connection(int sd, full_URL* my_url)
 
     } while (total_written_bytes < data_length); // Continue until the entire request is sent
 
+    free(request);
     return total_written_bytes; // Return the count of total bytes written
 }
 
 
+char* build_request(full_URL* my_url, int keep_alive, const char* extra_headers, size_t* length)
+{
+    // A stale cached copy is revalidated instead of fetched again
+    char conditional[256];
+    cache_conditional_headers(my_url, conditional, sizeof(conditional));
+
+    if (extra_headers == NULL)
+        extra_headers = "";
+
+    size_t request_size = 120 + my_url->request_head_length + strlen(conditional) + strlen(extra_headers);
+    char* request = (char*)malloc(request_size);
+    if (request == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return NULL;
+    }
+
+    // The request line and Host header were built with the URL. HTTP/1.1 connections stay open unless asked
+    // otherwise. Compressed bodies are asked for, and cached as they arrive
+    memcpy(request, my_url->request_head, my_url->request_head_length);
+    int request_length = snprintf(request + my_url->request_head_length, request_size - my_url->request_head_length,
+                                  "Accept-Encoding: " ACCEPT_ENCODING "\r\n%s%s%s\r\n", conditional, extra_headers,
+                                  keep_alive ? "" : "Connection: close\r\n");
+
+    *length = my_url->request_head_length + (size_t)request_length;
+    return request;
+}
+
+
 int starts_with_http(const char* input)
 {
     return strncmp(input, "http://", strlen("http://")) == 0;
 }
 
 
-char* get_file_full_path(full_URL* my_url, const char* directories_path)
+static int prints_saved_body(http_response* response)
+{
+    // A body being cached is printed from the cache file once complete when it must be decoded, or printed alone
+    return response->header_end_found && response->save_file_flag &&
+           (options.output == OUTPUT_BODY ||
+            (options.output == OUTPUT_FULL && response->metadata.encoding != ENCODING_IDENTITY));
+}
+
+
+static void print_total_bytes(size_t total_bytes)
 {
-    // Find the last occurrence of '/' in the path
-    char* last_slash_ptr = strrchr(my_url->path, '/');
-    char* path_to_use = my_url->path;
+    if (options.output != OUTPUT_FULL)
+        return;
 
-    // If a '/' is found, and it's not the first character, adjust the path_to_use to start from the last '/'
-    if (last_slash_ptr != NULL && last_slash_ptr != my_url->path)
-        path_to_use = last_slash_ptr;
+    char line[64];
+    int line_length = snprintf(line, sizeof(line), "\n Total response bytes: %zu\n", total_bytes);
+    write_all(options.output_fd, line, line_length);
+}
 
-    // Calculate the required size for full_path
-    unsigned long file_path_size = strlen(path_to_use) + 1 + strlen(directories_path); // +1 for null terminator
-    if (my_url->is_legal_path == !PATH_EXISTS)
-        file_path_size += strlen(DEFAULT_PATH); // add length of DEFAULT_PATH if needed
 
-    char* full_path = (char*)malloc(file_path_size);
-    if (full_path == NULL)
+static ssize_t splice_from_connection(int sd, http_response* response, int pipe_fds[2], int* print_fd,
+                                      int output_is_pipe)
+{
+    // The pipe is only needed once there is a body to save
+    if (pipe_fds[0] == -1 && create_splice_pipe(pipe_fds, options.buffer_size) == -1)
     {
-        fprintf(stderr, "Malloc failed\n");
-        return NULL;
+        errno = EINVAL;
+        return -1;
     }
 
-    strcpy(full_path, directories_path);
-    strcat(full_path, path_to_use); // Concatenate the part from the last slash
+    // A pipe as output gets a kernel-side copy of the body with tee()
+    int print_body = options.output == OUTPUT_FULL && !prints_saved_body(response);
+    ssize_t moved = response_splice_body(response, sd, pipe_fds, output_is_pipe && print_body ? options.output_fd : -1,
+                                         options.buffer_size, 0);
+    if (moved <= 0 || output_is_pipe || !print_body)
+        return moved;
+
+    // Other outputs get the bytes just written to the cache file
+    if (*print_fd == -1)
+        *print_fd = open(response->full_file_path, O_RDONLY | O_CLOEXEC);
+
+    if (*print_fd != -1)
+        send_file_contents(options.output_fd, *print_fd, response->body_bytes - moved, moved);
+
+    return moved;
+}
+
 
-    if (my_url->is_legal_path == !PATH_EXISTS)
-        strcat(full_path, DEFAULT_PATH); // Append DEFAULT_PATH if path is "/"
+static ssize_t print_object_body(int fd, size_t file_size, content_encoding encoding)
+{
+    // The output is not an HTTP client, so compressed objects are decoded while printed
+    if (encoding != ENCODING_IDENTITY)
+        return decode_file_contents(options.output_fd, fd, file_size, encoding);
 
-    return full_path;
+    return send_file_contents(options.output_fd, fd, 0, file_size);
 }
 
 
-FILE* get_file(char* full_path)
+static int print_cached_object(int fd, size_t file_size, content_encoding encoding)
 {
-    // Open the file for writing
-    FILE* file = fopen(full_path, "wb");
-    if (file == NULL)
+    // The decoded length of a compressed object is not known up front, its end is the end of the output
+    char header[256];
+    int header_len = format_cached_header(header, sizeof(header),
+                                          encoding == ENCODING_IDENTITY ? (off_t)file_size : -1, ENCODING_IDENTITY);
+
+    // Print the header with the correct Content-Length, after the origin of the response in full output
+    const char* label = "File is given from local filesystem\n";
+    struct iovec parts[2] = {{(char*)label, strlen(label)}, {header, header_len}};
+    ssize_t header_written_size = 0;
+    if (options.output == OUTPUT_FULL)
+        header_written_size = writev_all(options.output_fd, parts, 2) == -1 ? -1 : header_len;
+    else if (options.output == OUTPUT_HEADERS)
+        header_written_size = write_all(options.output_fd, header, header_len);
+
+    ssize_t body_written_size = 0;
+    if (header_written_size == -1)
+        body_written_size = -1;
+    else if (options.output == OUTPUT_FULL || options.output == OUTPUT_BODY)
+        body_written_size = print_object_body(fd, file_size, encoding);
+
+    // Close the file when done
+    close(fd);
+
+    if (body_written_size == -1)
     {
-        fprintf(stderr, "Error opening file %s for writing.\n", full_path);
-        return NULL;
+        perror("Failed to write the cached file\n");
+        return 1; // The file exists, fetching it again would not help
     }
 
-    return file;
+    print_total_bytes(header_written_size + body_written_size); // Print the total written bytes
+    return 1;
 }
 
 
-char* get_directories_path(full_URL* my_url)
+static int print_stale_object(full_URL* my_url)
 {
-    unsigned long full_path_size = strlen(my_url->host) + strlen(my_url->path) + strlen(DEFAULT_PATH) + 1;
-    // Allocate memory for the full path string
-    char* full_path = (char*) malloc(full_path_size);
+    if (options.stale_if_error == 0)
+        return -1;
+
+    off_t object_size;
+    cache_metadata metadata;
+    int fd = cache_store_open_object(my_url, &object_size, &metadata);
+    if (fd == -1)
+        return -1;
 
-    // Check if memory allocation is successful
-    if (full_path == NULL)
+    if (!cache_is_usable(&metadata, options.stale_if_error))
     {
-        fprintf(stderr, "Malloc failed\n");
-        return NULL;
+        close(fd);
+        return -1;
     }
 
-    // Construct the full path by concatenating host, and path
-    strcpy(full_path, my_url->host);
+    return print_cached_object(fd, object_size, metadata.encoding);
+}
 
-    strcat(full_path, my_url->path);
 
-    // Allocate memory for directories_path
-    char* directories_path = (char*) malloc(strlen(full_path) + 1);
-    // Check if memory allocation is successful
-    if (directories_path == NULL)
-    {
-        fprintf(stderr, "Malloc failed\n");
-        free(full_path); // Free the previously allocated full_path
-        return NULL; // Return NULL to indicate failure
-    }
+static void print_failure(int status)
+{
+    char status_text[64];
+    negative_status_text(status, status_text, sizeof(status_text));
 
-    // Copy the full path into directories_path
-    strcpy(directories_path, full_path);
-    // Find the last occurrence of '/' to isolate the directories part
-    char* last_slash = strrchr(directories_path, '/');
-    // If a slash is found, null-terminate the string at that position to exclude the file name
-    if (last_slash != NULL)
-        last_slash[0] = '\0';
+    char header[128];
+    int header_len = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Length: 0\r\n\r\n", status_text);
 
-    // Free the memory allocated for full_path as it's no longer needed
-    free(full_path);
-    // Return the directories path
-    return directories_path;
+    // Printed like the response the origin gave, which has no body worth keeping
+    const char* label = "Error is given from the negative cache\n";
+    struct iovec parts[2] = {{(char*)label, strlen(label)}, {header, header_len}};
+    if (options.output == OUTPUT_FULL)
+        writev_all(options.output_fd, parts, 2);
+    else if (options.output == OUTPUT_HEADERS)
+        write_all(options.output_fd, header, header_len);
+
+    print_total_bytes(header_len);
 }
 
 
 int read_from_connection(int sd, full_URL* my_url)
 {
     char buffer[READ_BUFFER_SIZE]; // Buffer to store the data read from the connection
-    size_t total_read_bytes = 0; // Counter for total bytes read
-    int header_end_found = 0; // Flag to indicate the end of the header part
-    char* full_file_path = NULL; // String to hold the full file path
-    char* directories_path = NULL; // String to hold the directories path
-    int save_file_flag = 1; // Flag to indicate if the file should be saved
     ssize_t read_bytes; // Variable to store the count of bytes read in each read operation
-    FILE* file = NULL; // File pointer for the file to be written
+    http_response response; // Header and cache state of the response being read
+    int pipe_fds[2] = {-1, -1}; // Pipe the body is spliced through once the header was processed
+    int print_fd = -1; // Cache file opened for reading, to print spliced bytes when stdout is not a pipe
+    int splice_enabled = 1; // Cleared if the socket does not support splice()
+    int result;
+
+    struct stat output_info;
+    int output_is_pipe = fstat(options.output_fd, &output_info) == 0 && S_ISFIFO(output_info.st_mode);
+
+    response_init(&response, my_url);
+    response.timing = &request_timing;
+
+    // A body that is not saved can only be printed as it is decoded from its framing
+    if (options.output == OUTPUT_BODY)
+        response.body_fd = options.output_fd;
 
     while (1)
     {
-        // Read data from the connection
-        read_bytes = read(sd, buffer, sizeof(buffer) - 1);
-
-        // Check for read error
-        if (read_bytes < 0)
+        // After the header, move the body to the cache file inside the kernel
+        if (splice_enabled && response_can_splice(&response))
         {
-            if (read_bytes < 0)
-                perror("Failed to read from file descriptor\n"); // Print error message
-
-            if (file != NULL)
-                fclose(file); // Close the file if it's open
+            size_t body_bytes = response.body_bytes;
+            read_bytes = splice_from_connection(sd, &response, pipe_fds, &print_fd, output_is_pipe);
 
-            // Free allocated memory if save_file_flag is set
-            if (save_file_flag)
+            // Nothing was moved, so the body can still be read the usual way
+            if (read_bytes < 0 && errno == EINVAL && response.body_bytes == body_bytes)
             {
-                free(directories_path);
-                free(full_file_path);
+                splice_enabled = 0;
+                continue;
             }
-            return -1;
         }
+        else
+        {
+            // Read data from the connection
+            read_bytes = read(sd, buffer, sizeof(buffer));
 
-        // Finished reading
-        if (read_bytes == 0)
-            break;
+            if (read_bytes > 0)
+            {
+                size_t header_bytes = response.header_bytes;
+                if (response.total_bytes == 0)
+                    phase_timer_end(&request_timing, PHASE_FIRST_BYTE);
+
+                // Parse the header and save the body to the cache
+                if (response_feed(&response, buffer, read_bytes) == -1)
+                {
+                    response_abort(&response);
+                    result = -1;
+                    break;
+                }
+
+                // An origin error is answered with a recent enough stale copy, decided before any of it was printed
+                if (header_bytes == 0 && response.header_end_found && response.status_code >= 500 &&
+                    print_stale_object(my_url) == 1)
+                {
+                    response_abort(&response);
+                    result = 1;
+                    break;
+                }
 
+                // The header part comes first in the buffer, and the body is binary: print with write, not stdio
+                size_t header_part = response.header_bytes - header_bytes;
+                size_t print_length = 0;
+                if (options.output == OUTPUT_FULL)
+                    print_length = prints_saved_body(&response) ? header_part : (size_t)read_bytes;
+                else if (options.output == OUTPUT_HEADERS)
+                    print_length = header_part;
 
-        buffer[read_bytes] = '\0'; // Null-terminate the buffer
-        total_read_bytes += read_bytes; // Update the total bytes read
-        printf("%s", buffer);
+                if (print_length > 0)
+                    write_all(options.output_fd, buffer, print_length);
+            }
+        }
 
-        // Check if the end of the header has been found
-        if (!header_end_found)
+        // Check for read error
+        if (read_bytes < 0)
         {
-            char *header_end = strstr(buffer, "\r\n\r\n"); // Find the end of the header
+            perror("Failed to read from file descriptor\n"); // Print error message
+            response_abort(&response);
+            result = response.total_bytes == 0 && print_stale_object(my_url) == 1 ? 1 : -1;
+            break;
+        }
 
-            if (header_end != NULL) // If the end of the header is found
-            {
-                header_end_found = 1; // Set the flag
-                size_t header_length = header_end - buffer + 4; // Calculate the header length
+        // Finished reading: the framing says the response is over, or the origin closed the connection
+        if (read_bytes == 0 || response.complete)
+        {
+            if (response.total_bytes > 0)
+                phase_timer_end(&request_timing, PHASE_TRANSFER);
+            result = response_finish(&response);
 
-                // Check if the response is OK
-                if (strstr(buffer, "200 OK\r\n") == NULL)
-                    save_file_flag = 0; // If not OK, set save_file_flag to 0
-                else // If OK
+            // The body was just saved, print it from the cache file after the header
+            if (result == 1 && prints_saved_body(&response))
+            {
+                off_t object_size;
+                int fd = cache_store_open_object(my_url, &object_size, NULL);
+                if (fd != -1)
                 {
-                    directories_path = get_directories_path(my_url);
-                    if (directories_path == NULL)
-                    {
-                        free(directories_path);
-                        return -1;
-                    }
-
-
-                    if (create_directories(directories_path) == -1)
-                    {
-                        free(directories_path);
-                        return -1;
-                    }
-
-                    full_file_path = get_file_full_path(my_url, directories_path);
-                    if (full_file_path == NULL)
-                    {
-                        free(directories_path);
-                        return -1;
-                    }
-
-                    file = get_file(full_file_path);
-                    if (file == NULL)
-                    {
-                        free(directories_path);
-                        free(full_file_path);
-                        return -1;
-                    }
+                    if (print_object_body(fd, object_size, response.metadata.encoding) == -1)
+                        perror("Failed to write the decoded body\n");
+                    close(fd);
                 }
+            }
+
+            // Print the total bytes read
+            print_total_bytes(response.total_bytes);
 
-                // Write any part of the body that's in the buffer to the file
-                if (header_length < (size_t)read_bytes && save_file_flag)
-                    fwrite(header_end + 4, 1, read_bytes - header_length, file);
+            // The origin confirmed the cached copy, print it as a hit
+            if (result == 1 && response.not_modified)
+            {
+                off_t object_size;
+                cache_metadata metadata;
+                int fd = cache_store_open_object(my_url, &object_size, &metadata);
+                result = fd == -1 ? 0 : print_cached_object(fd, object_size, metadata.encoding);
             }
-        }
-        else // If the header end has been found
-        {
-            // Write to the file if save_file_flag is set
-            if (save_file_flag)
-                fwrite(buffer, 1, read_bytes, file);
+
+            // Printing the saved or confirmed copy reads it back from the cache
+            if (result == 1 && (response.not_modified || prints_saved_body(&response)))
+                phase_timer_end(&request_timing, PHASE_CACHE_READ);
+
+            // What the page loads is fetched while the command returns
+            if (result == 1 && !response.not_modified && response.is_html && options.prefetch > 0)
+                prefetch_in_background(my_url);
+            break;
         }
     }
 
-    // Close the file if it's open
-    if (save_file_flag && file != NULL)
-        fclose(file);
-
-    // Free allocated memory if save_file_flag is set
-    if (save_file_flag)
+    if (pipe_fds[0] != -1)
     {
-        free(directories_path);
-        free(full_file_path);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
     }
 
-    // Print the total bytes read
-    printf("\n Total response bytes: %ld\n", total_read_bytes);
+    if (print_fd != -1)
+        close(print_fd);
 
-    return save_file_flag;
+    return result;
 }
 
 
 
 int create_directories(char* path)
 {
-    char* path_copy = strdup(path);
-    if (path_copy == NULL)
+    // Each component is cut off in place in turn, so paths of any length work
+    for (char* slash = path; slash != NULL; )
     {
-        perror("Error duplicating path\n");
-        return -1;
-    }
+        slash = strchr(slash + 1, '/');
+        if (slash != NULL)
+            *slash = '\0';
 
-    char* token = strtok(path_copy, "/");
-    char current_directory[256] = ".";  // Start from the current directory
+        int created = mkdir(path, 0777) == 0 || errno == EEXIST;
 
-    // Process all but the last component
-    while (token != NULL)
-    {
-        strcat(current_directory, "/");
-        strcat(current_directory, token);
+        if (slash != NULL)
+            *slash = '/';
 
-        if (mkdir(current_directory, 0777) != 0 && errno != EEXIST) {
+        if (!created)
+        {
             perror("Error creating directory\n");
-            free(path_copy);
             return -1;
         }
-
-        token = strtok(NULL, "/");
     }
 
-    free(path_copy);
     return 1;
 }
 
 
 
-int open_file(full_URL* my_url)
+ssize_t write_all(int fd, const char* data, size_t length)
 {
-    unsigned long full_path_size = strlen(my_url->path) + strlen(my_url->host) + strlen(DEFAULT_PATH) + 1;
-    char* full_path = (char*) malloc(full_path_size);
-    if (full_path == NULL)
+    size_t total_written_bytes = 0; // Counter for total bytes successfully written
+
+    while (total_written_bytes < length)
     {
-        fprintf(stderr, "Malloc failed\n");
-        return -1;
+        ssize_t wrote_bytes = write(fd, data + total_written_bytes, length - total_written_bytes);
+        if (wrote_bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        total_written_bytes += wrote_bytes;
     }
 
-    strcpy(full_path, my_url->host);
-    strcat(full_path, my_url->path);
+    return (ssize_t)total_written_bytes;
+}
+
 
-    if (my_url->is_legal_path == !PATH_EXISTS)
-        strcat(full_path, DEFAULT_PATH);
+ssize_t writev_all(int fd, struct iovec* parts, int count)
+{
+    size_t total_written_bytes = 0;
 
-    // Check if the file exists
-    if (access(full_path, F_OK) != -1)
+    while (count > 0)
     {
-        // File exists, open it
-        FILE* file = fopen(full_path, "rb");
+        ssize_t wrote_bytes = writev(fd, parts, count);
+        if (wrote_bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        total_written_bytes += wrote_bytes;
 
-        if (file != NULL)
+        // Skip the buffers written in full, and the written start of the next one
+        while (count > 0 && (size_t)wrote_bytes >= parts->iov_len)
         {
-            size_t read_size;
-            unsigned char buffer[READ_BUFFER_SIZE];
-            fseek(file, 0, SEEK_END);
-            size_t file_size = ftell(file);
-            fseek(file, 0, SEEK_SET);
+            wrote_bytes -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0)
+        {
+            parts->iov_base = (char*)parts->iov_base + wrote_bytes;
+            parts->iov_len -= wrote_bytes;
+        }
+    }
 
-            printf("File is given from local filesystem\n");
+    return (ssize_t)total_written_bytes;
+}
 
-            // Prepare the header format and the initial part of the header
-            const char* header_format = "HTTP/1.0 200 OK\r\nContent-Length: %ld\r\n\r\n";
 
-            char header[256];
-            int header_len = snprintf(header, sizeof(header), header_format, file_size);
+ssize_t send_file_contents(int out_fd, int in_fd, off_t start, size_t count)
+{
+    off_t offset = start;
+    off_t end = start + count;
 
-            // Print the header with the correct Content-Length
-            size_t header_written_size = fwrite(header, 1, header_len, stdout);
+    // Let the kernel move the bytes from the page cache to the output descriptor
+    while (offset < end)
+    {
+        ssize_t sent_bytes = sendfile(out_fd, in_fd, &offset, end - offset);
+        if (sent_bytes > 0)
+            continue;
 
-            size_t total_written_size = header_written_size; // Track total written bytes
+        if (sent_bytes == 0)
+            return offset - start; // The file shrank meanwhile
 
-            // Read the file and print to the screen in chunks
-            while ((read_size = fread(buffer, 1, sizeof(buffer), file)) > 0)
-            {
-                size_t chunk_written_size = fwrite(buffer, 1, read_size, stdout);
-                total_written_size += chunk_written_size; // Add the size of the written chunk
-            }
+        if (errno == EINTR)
+            continue;
 
-            // Close the file when done
-            fclose(file);
-            free(full_path);
+        // Some outputs (e.g. terminals on recent kernels) do not support sendfile, copy through user space instead
+        if (errno == EINVAL || errno == ENOSYS)
+            break;
 
-            printf("\n Total response bytes: %ld\n", total_written_size); // Print the total written bytes
-            return 1;
-        }
-        else
-            printf("fopen failed\n");
+        return -1;
+    }
+
+    char buffer[READ_BUFFER_SIZE];
+    while (offset < end)
+    {
+        size_t chunk_size = (size_t)(end - offset) < sizeof(buffer) ? (size_t)(end - offset) : sizeof(buffer);
+        ssize_t read_size = pread(in_fd, buffer, chunk_size, offset);
+        if (read_size < 0)
+            return -1;
+
+        if (read_size == 0)
+            break;
+
+        if (write_all(out_fd, buffer, read_size) == -1)
+            return -1;
+
+        offset += read_size;
+    }
+
+    return offset - start;
+}
+
+
+int open_file(full_URL* my_url)
+{
+    // Open the cached object if the index has one
+    off_t object_size;
+    cache_metadata metadata;
+    int fd = cache_store_open_object(my_url, &object_size, &metadata);
+    if (fd == -1)
+    {
+        phase_timer_end(&request_timing, PHASE_CACHE_READ);
+        return -1;
+    }
 
+    // A stale object is revalidated with the origin first, unless it is recent enough to be refreshed afterwards
+    int is_fresh = cache_is_fresh(&metadata);
+    if (!cache_is_usable(&metadata, options.stale_while_revalidate))
+    {
+        close(fd);
+        phase_timer_end(&request_timing, PHASE_CACHE_READ);
+        return -1;
     }
 
-    free(full_path);
-    return -1;
+    int result = print_cached_object(fd, object_size, metadata.encoding);
+    phase_timer_end(&request_timing, PHASE_CACHE_READ);
+
+    if (!is_fresh)
+        refresh_in_background(my_url);
+    return result;
+}
+
+
+static int print_saved_object(full_URL* my_url)
+{
+    // Just saved, so it is printed even if the origin made it stale right away
+    off_t object_size;
+    cache_metadata metadata;
+    int fd = cache_store_open_object(my_url, &object_size, &metadata);
+    if (fd == -1)
+        return 0;
+
+    return print_cached_object(fd, object_size, metadata.encoding);
 }
 
 
@@ -596,77 +820,468 @@ int is_legal_URL(char* url, char* flag)
 }
 
 
+int parse_positive_number(const char* str, long max)
+{
+    char* end_ptr;
+    errno = 0;
+    long number = strtol(str, &end_ptr, 10);
+
+    if (end_ptr == str || *end_ptr != '\0' || errno == ERANGE || number < 1 || number > max)
+        return -1;
+
+    return (int)number;
+}
+
+
+static int parse_size(const char* str, size_t* count)
+{
+    char* end_ptr;
+    errno = 0;
+    unsigned long long number = strtoull(str, &end_ptr, 10);
+    if (end_ptr == str || errno == ERANGE || str[0] == '-')
+        return -1;
+
+    // An optional binary suffix
+    int shift = 0;
+    if (*end_ptr != '\0')
+    {
+        const char* suffix = strchr("KMG", *end_ptr >= 'a' ? *end_ptr - 'a' + 'A' : *end_ptr);
+        if (suffix == NULL || *suffix == '\0' || end_ptr[1] != '\0')
+            return -1;
+        shift = 10 * (int)(suffix - "KMG" + 1);
+    }
+
+    if (number > (SIZE_MAX >> shift))
+        return -1;
+
+    *count = (size_t)(number << shift);
+    return 0;
+}
+
+
+int parse_options(int argc, char** argv, proxy_options* options)
+{
+    static struct option long_options[] = {
+        {"listen", required_argument, NULL, 'l'},
+        {"batch", required_argument, NULL, 'b'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"max-host-connections", required_argument, NULL, 'm'},
+        {"idle-timeout", required_argument, NULL, 't'},
+        {"buffer-size", required_argument, NULL, 'z'},
+        {"dns-ttl", required_argument, NULL, 'd'},
+        {"memory-cache", required_argument, NULL, 'c'},
+        {"ranges", required_argument, NULL, 'r'},
+        {"timing", required_argument, NULL, 'T'},
+        {"timing-file", required_argument, NULL, 'F'},
+        {"output", required_argument, NULL, 'o'},
+        {"output-fd", required_argument, NULL, 'O'},
+        {"cache-size", required_argument, NULL, 'C'},
+        {"cache-objects", required_argument, NULL, 'n'},
+        {"io-engine", required_argument, NULL, 'e'},
+        {"prefetch", required_argument, NULL, 'p'},
+        {"prefetch-depth", required_argument, NULL, 'D'},
+        {"stale-while-revalidate", required_argument, NULL, 'W'},
+        {"stale-if-error", required_argument, NULL, 'E'},
+        {"negative-ttl", required_argument, NULL, 'N'},
+        {"workers", required_argument, NULL, 'w'},
+        {"pin-workers", no_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0}
+    };
+
+    options->url = NULL;
+    options->open_browser = 0;
+    options->ranges = 1;
+    options->output = OUTPUT_FULL;
+    options->output_fd = STDOUT_FILENO;
+    options->listen_port = 0;
+    options->workers = 1;
+    options->pin_workers = 0;
+    options->batch_list = NULL;
+    options->jobs = DEFAULT_BATCH_JOBS;
+    options->max_host_connections = DEFAULT_MAX_HOST_CONNECTIONS;
+    options->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    options->buffer_size = DEFAULT_SPLICE_BUFFER_SIZE;
+    options->dns_ttl = DEFAULT_DNS_TTL;
+    options->io_engine = IO_ENGINE_EPOLL;
+    options->memory_cache_size = DEFAULT_MEMORY_CACHE_SIZE;
+    options->cache_size = 0;
+    options->cache_objects = 0;
+    options->prefetch = 0;
+    options->prefetch_depth = DEFAULT_PREFETCH_DEPTH;
+    options->stale_while_revalidate = 0;
+    options->stale_if_error = 0;
+    options->negative_ttl = 0;
+    options->timing = TIMING_OFF;
+    options->timing_file = NULL;
+
+    int option;
+    while ((option = getopt_long(argc, argv, "s", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+            case 's':
+                options->open_browser = 1;
+                break;
+
+            case 'l':
+                options->listen_port = parse_positive_number(optarg, 65535);
+                if (options->listen_port == -1)
+                {
+                    printf("Invalid port number. Port number should be between 1 and 65535.\n");
+                    return -1;
+                }
+                break;
+
+            case 'w':
+                // 0 starts one worker per CPU
+                options->workers = strcmp(optarg, "0") == 0 ? 0 : parse_positive_number(optarg, 1024);
+                if (options->workers == -1)
+                {
+                    printf("Invalid number of workers. It should be between 0 and 1024.\n");
+                    return -1;
+                }
+                break;
+
+            case 'P':
+                options->pin_workers = 1;
+                break;
+
+            case 'b':
+                options->batch_list = optarg;
+                break;
+
+            case 'j':
+                options->jobs = parse_positive_number(optarg, INT_MAX);
+                if (options->jobs == -1)
+                {
+                    printf("Invalid number of jobs.\n");
+                    return -1;
+                }
+                break;
+
+            case 'm':
+                options->max_host_connections = parse_positive_number(optarg, INT_MAX);
+                if (options->max_host_connections == -1)
+                {
+                    printf("Invalid number of connections per host.\n");
+                    return -1;
+                }
+                break;
+
+            case 't':
+                // 0 disables keeping idle sockets
+                options->idle_timeout = strcmp(optarg, "0") == 0 ? 0 : parse_positive_number(optarg, INT_MAX);
+                if (options->idle_timeout == -1)
+                {
+                    printf("Invalid idle timeout.\n");
+                    return -1;
+                }
+                break;
+
+            case 'z':
+            {
+                int buffer_size = parse_positive_number(optarg, INT_MAX);
+                if (buffer_size == -1)
+                {
+                    printf("Invalid buffer size.\n");
+                    return -1;
+                }
+                options->buffer_size = buffer_size;
+                break;
+            }
+
+            case 'd':
+                // 0 disables caching resolved hosts
+                options->dns_ttl = strcmp(optarg, "0") == 0 ? 0 : parse_positive_number(optarg, INT_MAX);
+                if (options->dns_ttl == -1)
+                {
+                    printf("Invalid DNS TTL.\n");
+                    return -1;
+                }
+                break;
+
+            case 'c':
+            {
+                // 0 disables the memory cache
+                int memory_cache_size = strcmp(optarg, "0") == 0 ? 0 : parse_positive_number(optarg, INT_MAX);
+                if (memory_cache_size == -1)
+                {
+                    printf("Invalid memory cache size.\n");
+                    return -1;
+                }
+                options->memory_cache_size = memory_cache_size;
+                break;
+            }
+
+            case 'e':
+                options->io_engine = parse_io_engine(optarg);
+                if (options->io_engine == -1)
+                {
+                    printf("Invalid I/O engine. It should be epoll or io_uring.\n");
+                    return -1;
+                }
+                break;
+
+            case 'r':
+                options->ranges = parse_positive_number(optarg, MAX_RANGE_CONNECTIONS);
+                if (options->ranges == -1)
+                {
+                    printf("Invalid number of ranges. It should be between 1 and %d.\n", MAX_RANGE_CONNECTIONS);
+                    return -1;
+                }
+                break;
+
+            case 'T':
+                options->timing = parse_timing_format(optarg);
+                if (options->timing == -1)
+                {
+                    printf("Invalid timing format. It should be json or prometheus.\n");
+                    return -1;
+                }
+                break;
+
+            case 'F':
+                options->timing_file = optarg;
+                break;
+
+            case 'o':
+            {
+                static const char* const output_names[] = {"full", "headers", "body", "quiet"};
+                int mode = 0;
+                while (mode <= OUTPUT_QUIET && strcmp(optarg, output_names[mode]) != 0)
+                    mode++;
+                if (mode > OUTPUT_QUIET)
+                {
+                    printf("Invalid output mode. It should be full, headers, body or quiet.\n");
+                    return -1;
+                }
+                options->output = (output_mode)mode;
+                break;
+            }
+
+            case 'O':
+                options->output_fd = parse_positive_number(optarg, INT_MAX);
+                if (options->output_fd == -1 || fcntl(options->output_fd, F_GETFL) == -1)
+                {
+                    printf("Invalid output descriptor. It should be open for writing.\n");
+                    return -1;
+                }
+                break;
+
+            case 'C':
+                // 0 leaves the disk cache unbounded
+                if (parse_size(optarg, &options->cache_size) == -1)
+                {
+                    printf("Invalid cache size.\n");
+                    return -1;
+                }
+                break;
+
+            case 'n':
+                if (parse_size(optarg, &options->cache_objects) == -1)
+                {
+                    printf("Invalid number of cached objects.\n");
+                    return -1;
+                }
+                break;
+
+            case 'p':
+                // 0 disables prefetching
+                options->prefetch = strcmp(optarg, "0") == 0 ? 0 : parse_positive_number(optarg, INT_MAX);
+                if (options->prefetch == -1)
+                {
+                    printf("Invalid number of prefetched links.\n");
+                    return -1;
+                }
+                break;
+
+            case 'D':
+                options->prefetch_depth = parse_positive_number(optarg, INT_MAX);
+                if (options->prefetch_depth == -1)
+                {
+                    printf("Invalid prefetch depth.\n");
+                    return -1;
+                }
+                break;
+
+            case 'W':
+                // 0 revalidates stale objects before serving them
+                options->stale_while_revalidate = strcmp(optarg, "0") == 0 ? 0 : parse_positive_number(optarg, INT_MAX);
+                if (options->stale_while_revalidate == -1)
+                {
+                    printf("Invalid stale-while-revalidate window.\n");
+                    return -1;
+                }
+                break;
+
+            case 'E':
+                // 0 reports origin failures instead of serving stale objects
+                options->stale_if_error = strcmp(optarg, "0") == 0 ? 0 : parse_positive_number(optarg, INT_MAX);
+                if (options->stale_if_error == -1)
+                {
+                    printf("Invalid stale-if-error window.\n");
+                    return -1;
+                }
+                break;
+
+            case 'N':
+                // 0 asks the origin again for every failed request
+                options->negative_ttl = strcmp(optarg, "0") == 0 ? 0 : parse_positive_number(optarg, INT_MAX);
+                if (options->negative_ttl == -1)
+                {
+                    printf("Invalid negative TTL.\n");
+                    return -1;
+                }
+                break;
+
+            default:
+                return -1;
+        }
+    }
+
+    // The URL is the only positional argument
+    if (argc - optind > 1)
+        return -1;
+    if (argc - optind == 1)
+        options->url = argv[optind];
+
+    // Exactly one mode
+    int modes = (options->url != NULL) + (options->listen_port != 0) + (options->batch_list != NULL);
+    if (modes != 1)
+        return -1;
+
+    return 0;
+}
+
+
 int main(int argc, char* argv[])
 {
 
-    // Verify the correct number of command-line arguments
-    if (argc < 2 || argc > 3)
+    // Parse the command-line arguments into the global options
+    if (parse_options(argc, argv, &options) == -1)
     {
-        printf("Usage: cproxy <URL> [-s]");
+        printf(USAGE);
         exit(EXIT_FAILURE);
     }
 
-    char* input_string = argv[1]; // Assign the first argument as the input URL
-    char* flag = ""; // Initialize a default flag
-    int is_saved = 1;
+    // Serve client requests until stopped by a signal
+    if (options.listen_port != 0)
+    {
+        int server_result = run_server(&options);
+        exit(server_result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-    // If there are three arguments, use the third one as the flag
-    if (argc == 3)
-        flag = argv[2];
+    if (options.batch_list != NULL)
+    {
+        int batch_result = run_batch(&options);
+        exit(batch_result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    char* input_string = options.url; // The positional argument is the input URL
+    char* flag = options.open_browser ? "-s" : ""; // The flag as given on the command line
+    int is_saved = 1;
 
     // Validate the URL and flag, if not legal, print usage and exit
     if (!is_legal_URL(input_string, flag))
     {
-        printf("Usage: cproxy <URL> [-s]\n");
+        printf(USAGE);
         exit(EXIT_FAILURE);
     }
 
-    full_URL* my_url = initialize_full_URL();
+    full_URL* my_url = parse_URL(input_string);
     if (my_url == NULL)
+    {
+        fprintf(stderr, "URL format is invalid.\n");
         exit(EXIT_FAILURE);
+    }
 
-    if (get_host(input_string, my_url) == -1)
-        exit_program(my_url);
-
-    if (get_port(input_string, my_url) == -1)
-        exit_program(my_url);
-
-    if (get_path(input_string, my_url) == -1)
-        exit_program(my_url);
 
+    const char* timing_result = "HIT"; // Outcome of the request, as written with its phases
+    phase_timer_start(&request_timing);
 
     // Check if the file is accessible, if not, establish a connection to the host
     if (open_file(my_url) == -1)
     {
-        int sd = set_connection(my_url); // Set up the connection to the specified host and port
-        // Check for a successful connection
-        if (sd == -1)
+        int failed_status = cache_store_lookup_failure(my_url);
+
+        // The URL failed moments ago, the origin is not asked again before the negative entry expires
+        if (failed_status == CACHE_UNREACHABLE)
+        {
+            fprintf(stderr, "The origin was unreachable less than %d seconds ago.\n", options.negative_ttl);
             exit_program(my_url);
+        }
+        else if (failed_status != 0)
+        {
+            print_failure(failed_status);
+            is_saved = 0;
+            timing_result = "NEGATIVE";
+        }
+        // A large object that is not cached at all may be downloaded over several connections
+        else if (options.ranges > 1 && !cache_store_lookup(my_url, NULL, NULL) &&
+            range_fetch_download(my_url, options.ranges) == 1)
+        {
+            // The connections overlap, so the whole download counts as the transfer
+            phase_timer_end(&request_timing, PHASE_TRANSFER);
+            is_saved = print_saved_object(my_url);
+            phase_timer_end(&request_timing, PHASE_CACHE_READ);
+            timing_result = "SAVED";
+        }
+        else
+        {
+            int sd = set_connection(my_url); // Set up the connection to the specified host and port
+            // Check for a successful connection, an unreachable origin may be answered with a stale copy
+            if (sd == -1)
+            {
+                if (print_stale_object(my_url) != 1)
+                    exit_program(my_url);
+                timing_result = "STALE";
+            }
+            else
+            {
+                // Send the request to the connection
+                write_to_connection(sd, my_url);
+                // Read the response from the connection
+                is_saved = read_from_connection(sd, my_url);
+                // Close the socket descriptor
+                close(sd);
+                timing_result = is_saved == 1 ? "SAVED" : "NOT_SAVED";
+            }
+        }
+    }
 
-        // Send the request to the connection
-        write_to_connection(sd, my_url);
-        // Read the response from the connection
-        is_saved = read_from_connection(sd, my_url);
-        // Close the socket descriptor
-        close(sd);
+    if (options.timing != TIMING_OFF)
+    {
+        FILE* timing_stream = open_timing_stream(options.timing_file);
+        if (timing_stream != NULL)
+        {
+            phase_timer_write(timing_stream, &request_timing, input_string, timing_result, options.timing);
+            if (timing_stream != stderr)
+                fclose(timing_stream);
+        }
     }
 
 
     // If the "-s" flag is set, use the system call to open the URL in the default web browser
     if (strcmp(flag, "-s") == 0 && is_saved == 1)
     {
-        // Allocate memory for the command string to be used with system call
-        char* copy_str = (char*) malloc( strlen(my_url->host) + strlen(my_url->path) + 50);
+        // The URL as given keeps the brackets of an IPv6 host and the port. It is single-quoted for the shell, every
+        // quote in it written as '\'' and so at most four bytes per byte of the URL
+        char* copy_str = (char*) malloc(strlen("xdg-open ''") + 4 * strlen(my_url->url) + 1);
         if (copy_str == NULL)
         {
             fprintf(stderr, "Malloc failed\n");
             exit_program(my_url);
         }
 
-        strcpy(copy_str, "xdg-open ");
-        strcat(copy_str, "http://");
-        strcat(copy_str, my_url->host);
-        strcat(copy_str, my_url->path);
+        char* command_end = copy_str + sprintf(copy_str, "xdg-open '");
+        for (const char* c = my_url->url; *c != '\0'; c++)
+        {
+            if (*c == '\'')
+                command_end += sprintf(command_end, "'\\''");
+            else
+                *command_end++ = *c;
+        }
+        strcpy(command_end, "'");
         system(copy_str);
         free(copy_str);
     }
@@ -1,6 +1,9 @@
 #ifndef CPROXY_CPROXY_H
 #define CPROXY_CPROXY_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memmem, accept4 and friends
+#endif
 
 // Include necessary header files
 #include <stdio.h>
@@ -8,23 +11,88 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <sys/uio.h>
 
 
 #define READ_BUFFER_SIZE 4096 // Define the size of the read buffer
 #define DEFAULT_PATH "index.html"
 #define PATH_EXISTS 1
+#define DEFAULT_SPLICE_BUFFER_SIZE (1024 * 1024) // Default bytes moved per splice() when filling the cache
+#define USAGE "Usage: cproxy <URL> [-s] [--buffer-size <bytes>] [--ranges <n>] [output options] [timing options]\n" \
+              "       cproxy --listen <port> [--memory-cache <bytes>] [--workers <n>] [--pin-workers] [connection options]\n" \
+              "              [--timing json|prometheus]\n" \
+              "       cproxy --batch <file|-> [--jobs <n>] [--buffer-size <bytes>] [connection options] [timing options]\n" \
+              "Connection options: [--max-host-connections <n>] [--idle-timeout <seconds>] [--dns-ttl <seconds>]\n" \
+              "                    [--io-engine epoll|io_uring]\n" \
+              "Cache options (every mode): [--cache-size <bytes>[K|M|G]] [--cache-objects <n>[K|M|G]]\n" \
+              "                            [--prefetch <n>] [--prefetch-depth <n>]\n" \
+              "                            [--stale-while-revalidate <seconds>] [--stale-if-error <seconds>]\n" \
+              "                            [--negative-ttl <seconds>]\n" \
+              "Output options: [--output full|headers|body|quiet] [--output-fd <fd>]\n" \
+              "Timing options: [--timing json|prometheus] [--timing-file <path>]\n"
 
 typedef struct{
-    char* host; // URL host
-    char* path; // URL path
+    char* url; // The URL as given
+    char* host; // URL host, without the brackets of an IPv6 literal
+    char* path; // URL path and query string, without the fragment
     int is_legal_path; // 1 if path exists, else 0
     int port; // URL port
+    char* host_header; // Value of the Host header: the host as written, and the port unless it is 80
+    char* key; // Cache key: lowercase host as written, explicit port and path
+    size_t key_length; // Length of key
+    uint64_t key_hash; // Hash of key, see cache_key_hash
+    char* request_head; // Request line and Host header of a GET request for the URL
+    size_t request_head_length; // Length of request_head
 } full_URL;
 
+typedef enum{
+    OUTPUT_FULL, // The request, the response as received with compressed bodies decoded, and the byte counts
+    OUTPUT_HEADERS, // Only the response header
+    OUTPUT_BODY, // Only the response body, without its transfer framing and decoded
+    OUTPUT_QUIET // Nothing, the response is only saved to the cache
+} output_mode;
+
+typedef struct{
+    char* url; // URL of the single fetch mode, or NULL
+    int open_browser; // 1 if the '-s' flag was given
+    int ranges; // Connections a large object of the single fetch mode is downloaded over, 1 for a single stream
+    output_mode output; // What the single fetch mode prints
+    int output_fd; // Descriptor the single fetch mode prints to
+    int listen_port; // Port of the server mode, or 0
+    int workers; // Worker processes of the server mode, 0 for one per CPU
+    int pin_workers; // 1 if each worker is pinned to its own CPU
+    char* batch_list; // URL list of the batch mode ("-" for stdin), or NULL
+    int jobs; // Maximum number of concurrent fetches in batch mode
+    int max_host_connections; // Maximum number of sockets per origin
+    int idle_timeout; // Seconds an idle keep-alive socket is kept open
+    size_t buffer_size; // Bytes moved per splice() when filling the cache
+    int dns_ttl; // Seconds a resolved host is cached
+    int io_engine; // How the server and batch modes wait for their descriptors (an io_engine), see event_loop.h
+    size_t memory_cache_size; // Byte budget of the in-memory response cache of the server mode
+    size_t cache_size; // Byte budget of the disk cache, 0 for no limit
+    size_t cache_objects; // Maximum number of objects in the disk cache, 0 for no limit
+    int prefetch; // Subresources fetched ahead from each saved HTML page, 0 to not prefetch
+    int prefetch_depth; // Link levels followed from a page that was asked for
+    int stale_while_revalidate; // Seconds a stale object is served while it is refreshed behind it, 0 to not
+    int stale_if_error; // Seconds a stale object is served when its origin fails or answers 5xx, 0 to not
+    int negative_ttl; // Seconds a 404, 410 or 5xx response or an unreachable origin is remembered, 0 to not
+    int timing; // Export format of the per-phase latencies (a timing_format), TIMING_OFF (0) to not measure them
+    char* timing_file; // File the latencies of the single fetch and batch modes are written to, or NULL for stderr
+} proxy_options;
+
+extern proxy_options options; // Command-line options of the running process
+
+struct phase_timer; // Time spent in each phase of a request, see latency_stats.h
+
 // Function prototypes
 
 
@@ -37,49 +105,61 @@ typedef struct{
 int create_directories(char*);
 
 /**
- * Extracts the host part from a given URL and stores it in the provided 'my_url' structure.
+ * Parses a URL in a single pass. The structure and all its strings are one allocation.
+ * Userinfo is skipped, IPv6 literals are written in brackets and the fragment is dropped.
  *
- * @param str: A pointer to a string containing the URL.
- * @param my_url: A pointer to a 'full_URL' structure where the host part will be stored.
- * @return
- *   - 0 if the host part is successfully extracted and stored in 'my_url'.
- *   - -1 if there are invalid inputs (e.g., NULL pointers) or if 'str' does not contain 'http://'.
+ * @param url: A string starting with 'http://'.
+ * @return A pointer to the newly allocated 'full_URL' structure, or NULL if the URL is invalid or memory
+ *         allocation fails.
  */
-int get_host(const char*, full_URL*);
+full_URL* parse_URL(const char*);
+
 
 /**
- * Determines the port number from a given URL and stores it in the provided 'my_url' structure.
+ * Establishes a TCP connection to the specified host and port.
  *
- * @param str: A pointer to a string containing the URL.
- * @param my_url: A pointer to a 'full_URL' structure where the port number will be stored.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name and port to connect to.
  * @return
- *   - 0 if the port number is successfully extracted and stored in 'my_url'.
- *   - -1 if there are invalid inputs (e.g., NULL pointers) or if 'str' does not contain 'http://'.
- *   - -1 if the port number is out of range (not between 0 and 65535) or if it cannot be extracted.
+ *   - The socket descriptor for the established connection if successful.
+ *   - -1 if the connection fails. In case of failure, the function also prints an error message and records the
+ *     origin as unreachable in the negative cache.
  */
-int get_port(const char*, full_URL*);
+int set_connection(full_URL*);
 
 /**
- * Extracts and sets the path part from a given URL in a 'full_URL' structure.
+ * Resolves the specified host and starts connecting a TCP socket to it, trying its IPv4 and IPv6 addresses in order.
  *
- * @param str: A string containing the URL.
- * @param my_url: A pointer to a 'full_URL' structure to store the extracted path.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name and port to connect to.
+ * @param nonblocking: 1 to create a non-blocking socket whose connect may still be in progress, 0 to block until connected.
+ * @param timing: A pointer to the 'phase_timer' structure the DNS and connect phases are added to, or NULL.
  * @return
- *   - 0 if the path is successfully extracted and set.
- *   - -1 if memory allocation fails or if the URL is invalid.
+ *   - The socket descriptor if the connection was established or is in progress.
+ *   - -1 if the connection fails. In case of failure, the function also prints an error message.
  */
-int get_path(const char*, full_URL*);
+int start_connection(full_URL*, int, struct phase_timer*);
 
+/**
+ * Creates a TCP socket and starts connecting it to one address.
+ *
+ * @param address: The IPv4 or IPv6 address to connect to. Its port is set by the function.
+ * @param length: The length of the address.
+ * @param port: The port to connect to, in host byte order.
+ * @param nonblocking: 1 to create a non-blocking socket whose connect may still be in progress, 0 to block until connected.
+ * @return The socket descriptor if the connection was established or is in progress, or -1 if it failed.
+ */
+int connect_to_address(struct sockaddr_storage*, socklen_t, int, int);
 
 /**
- * Establishes a TCP connection to the specified host and port.
+ * Builds the HTTP GET request for the given URL.
+ * If the cache holds a stale copy of the URL, the request is made conditional on its ETag and Last-Modified.
  *
- * @param my_url: A pointer to a 'full_URL' structure containing the host name and port to connect to.
- * @return
- *   - The socket descriptor for the established connection if successful.
- *   - -1 if the connection fails. In case of failure, the function also prints an error message.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name and path.
+ * @param keep_alive: 1 to ask the origin to keep the connection open after the response, else 0.
+ * @param extra_headers: More header lines, each ending with CRLF, such as a Range header. It can be NULL.
+ * @param length: Set to the length of the request, excluding the null terminator.
+ * @return A pointer to a dynamically allocated string containing the request, or NULL if memory allocation fails.
  */
-int set_connection(full_URL*);
+char* build_request(full_URL*, int, const char*, size_t*);
 
 
 /**
@@ -97,7 +177,8 @@ size_t write_to_connection(int, full_URL*);
  *
  * @param sd: The socket descriptor of the established connection.
  * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
- * @return 1 if a file was saved, else return 0.
+ * @return 1 if a file was saved, or if the origin answered 304 Not Modified and the cached copy was printed, or if it
+ *         failed and a stale copy within the '--stale-if-error' window was printed instead, else return 0.
  *
  * @note
  *   - This function handles the HTTP response, including header parsing and content saving.
@@ -114,31 +195,36 @@ int read_from_connection(int, full_URL*);
 int starts_with_http(const char*);
 
 /**
- * Constructs the full file path from a given URL path and directories path.
- * The function identifies the last segment of the URL path and appends it to the directories path.
- * If the URL path is not considered legal (is_legal_path is 0), a default path is also appended.
+ * Writes a buffer to a descriptor, retrying partial writes.
  *
- * @param my_url: A pointer to a structure representing the URL, including the URL path, and flags indicating the legality of the path.
- * @param directories_path: A string representing the base directory path to which the URL path will be appended.
- * @return A pointer to a dynamically allocated string containing the full file path, or NULL if memory allocation fails.
+ * @param fd: The descriptor to write to.
+ * @param data: The bytes to write.
+ * @param length: The number of bytes to write.
+ * @return The number of bytes written, which is length on success, or -1 if writing failed.
  */
-char* get_file_full_path(full_URL*, const char*);
+ssize_t write_all(int, const char*, size_t);
 
 /**
- * Opens a file for writing.
+ * Writes several buffers to a descriptor with writev(), retrying partial writes.
  *
- * @param full_path: The full path to the file to be opened.
- * @return A file pointer to the opened file, or NULL if the file could not be opened.
+ * @param fd: The descriptor to write to.
+ * @param parts: The buffers to write. They are advanced past the written bytes.
+ * @param count: The number of buffers.
+ * @return The number of bytes written, or -1 if writing failed.
  */
-FILE* get_file(char*);
+ssize_t writev_all(int, struct iovec*, int);
 
 /**
- * Constructs the full path for the directories based on the given path and host.
+ * Sends a range of a file to a descriptor without copying it through user space when possible.
+ * Uses sendfile(), falling back to pread/write for outputs sendfile does not support.
  *
- * @param my_url: A pointer to a 'full_URL' structure containing the path and host parts of the URL.
- * @return A pointer to a string containing the full path for the directories, or NULL if memory allocation fails.
+ * @param out_fd: The descriptor to write to.
+ * @param in_fd: The descriptor of the regular file to send.
+ * @param start: The offset in the file of the first byte to send.
+ * @param count: The number of bytes to send.
+ * @return The number of bytes sent, which is less than count if the file is shorter, or -1 if sending failed.
  */
-char* get_directories_path(full_URL*);
+ssize_t send_file_contents(int, int, off_t, size_t);
 
 /**
  * Opens a file if it exists in the local file system and sends its contents as an HTTP response.
@@ -146,11 +232,13 @@ char* get_directories_path(full_URL*);
  * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
  * @return
  *   - 1 if the file exists and its contents were successfully sent as an HTTP response.
- *   - -1 if the file doesn't exist or if there was an error in the process.
+ *   - -1 if the file doesn't exist, is stale and must be revalidated, or if there was an error in the process.
+ *     An object stale for less than the '--stale-while-revalidate' window is printed and refreshed in the background.
  *
  * @note
- *   - This function is responsible for checking the existence of a file, opening it, and sending its contents as an HTTP response.
+ *   - This function looks the URL up in the cache index, opens the cached object, and sends its contents as an HTTP response.
  *   - It prepares an HTTP header with the correct Content-Length before sending the file contents.
+ *   - The contents are written to the standard output with sendfile(), bypassing stdio.
  */
 int open_file(full_URL*);
 
@@ -164,7 +252,26 @@ int open_file(full_URL*);
 int is_legal_URL(char*, char*);
 
 /**
- * Frees the memory allocated for a 'full_URL' structure, including its host and path.
+ * Parses a positive number given to an option, such as the '--listen' port.
+ *
+ * @param str: A string containing the number.
+ * @param max: The largest allowed value.
+ * @return The number, or -1 if it is not a number between 1 and max.
+ */
+int parse_positive_number(const char*, long);
+
+/**
+ * Parses the command-line arguments: a URL with its options, or the options of the server or batch mode.
+ *
+ * @param argc: The number of command-line arguments.
+ * @param argv: The command-line arguments.
+ * @param options: A pointer to a 'proxy_options' structure to fill.
+ * @return 0 if the options are legal and select exactly one mode, else -1.
+ */
+int parse_options(int, char**, proxy_options*);
+
+/**
+ * Frees the memory allocated for a 'full_URL' structure, including its strings.
  *
  * @param my_url: A pointer to a 'full_URL' structure to be freed. It can be NULL.
  */
@@ -179,11 +286,12 @@ void exit_program(full_URL*);
 
 
 /**
- * Initializes a 'full_URL' structure and allocates memory for it.
+ * Copies a 'full_URL' structure, including its strings.
  *
- * @return A pointer to the newly initialized 'full_URL' structure, or NULL if memory allocation fails.
+ * @param my_url: A pointer to the 'full_URL' structure to copy.
+ * @return A pointer to the newly allocated copy, or NULL if memory allocation fails.
  */
-full_URL* initialize_full_URL();
+full_URL* duplicate_full_URL(const full_URL*);
 
 
 
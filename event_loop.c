@@ -0,0 +1,420 @@
+#include "cproxy.h"
+#include "event_loop.h"
+
+
+
+int parse_io_engine(const char* str)
+{
+    if (strcmp(str, "epoll") == 0)
+        return IO_ENGINE_EPOLL;
+    if (strcmp(str, "io_uring") == 0)
+        return IO_ENGINE_IO_URING;
+
+    return -1;
+}
+
+
+int event_loop_init(event_loop* loop)
+{
+    loop->epoll_fd = -1;
+    loop->ring.fd = -1;
+    loop->polls = NULL;
+    loop->poll_count = 0;
+    loop->poll_capacity = 0;
+    loop->free_poll = 0;
+    loop->running = 0;
+    loop->released = NULL;
+    loop->released_count = 0;
+    loop->released_capacity = 0;
+
+    if (options.io_engine == IO_ENGINE_IO_URING)
+    {
+        if (io_ring_init(&loop->ring, IO_RING_ENTRIES) == 0)
+            return 0;
+
+        // Kernels without io_uring, or sandboxes that forbid it, still get the epoll engine
+        fprintf(stderr, "io_uring is not available (%s), using epoll\n", strerror(errno));
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1)
+    {
+        perror("epoll_create1\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void event_watcher_init(event_watcher* watcher, int fd, event_handler handler, void* ctx)
+{
+    watcher->fd = fd;
+    watcher->handler = handler;
+    watcher->ctx = ctx;
+    watcher->events = 0;
+    watcher->poll_slot = 0;
+    watcher->armed = 0;
+}
+
+
+static uint64_t poll_user_data(event_loop* loop, uint32_t slot)
+{
+    // 0 is left for completions nothing waits for
+    return ((uint64_t)loop->polls[slot].generation << 32) | (slot + 1);
+}
+
+
+static int arm_poll(event_loop* loop, event_watcher* watcher)
+{
+    struct io_uring_sqe* sqe = io_ring_get_sqe(&loop->ring);
+    if (sqe == NULL)
+    {
+        fprintf(stderr, "io_uring submission queue is full\n");
+        return -1;
+    }
+
+    // One-shot polls re-armed after every dispatch behave like level-triggered epoll, which reports errors and
+    // hang-ups whatever the mask, so a watcher with an empty one is still polled for them
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watcher->fd;
+    sqe->poll32_events = watcher->events | EPOLLERR | EPOLLHUP;
+    sqe->user_data = poll_user_data(loop, watcher->poll_slot);
+    watcher->armed = 1;
+    return 0;
+}
+
+
+static void cancel_poll(event_loop* loop, event_watcher* watcher)
+{
+    if (!watcher->armed)
+        return;
+
+    // The cancelled poll completes later, under a generation the slot no longer has
+    struct io_uring_sqe* sqe = io_ring_get_sqe(&loop->ring);
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = poll_user_data(loop, watcher->poll_slot);
+    }
+
+    loop->polls[watcher->poll_slot].generation++;
+    watcher->armed = 0;
+}
+
+
+static int add_poll(event_loop* loop, event_watcher* watcher, uint32_t events)
+{
+    uint32_t slot = loop->free_poll - 1;
+    if (loop->free_poll != 0)
+        loop->free_poll = loop->polls[slot].next_free;
+    else
+    {
+        if (loop->poll_count == loop->poll_capacity)
+        {
+            uint32_t new_capacity = loop->poll_capacity == 0 ? 64 : loop->poll_capacity * 2;
+            poll_slot* new_polls = (poll_slot*)realloc(loop->polls, new_capacity * sizeof(poll_slot));
+            if (new_polls == NULL)
+            {
+                fprintf(stderr, "Malloc failed\n");
+                return -1;
+            }
+
+            loop->polls = new_polls;
+            loop->poll_capacity = new_capacity;
+        }
+
+        slot = loop->poll_count++;
+        loop->polls[slot].generation = 0;
+    }
+
+    loop->polls[slot].watcher = watcher;
+    watcher->poll_slot = slot;
+    watcher->events = events;
+    watcher->armed = 0;
+
+    if (arm_poll(loop, watcher) == -1)
+    {
+        loop->polls[slot].watcher = NULL;
+        loop->polls[slot].next_free = loop->free_poll;
+        loop->free_poll = slot + 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int event_loop_add(event_loop* loop, event_watcher* watcher, uint32_t events)
+{
+    if (loop->ring.fd != -1)
+        return add_poll(loop, watcher, events);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = watcher;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, watcher->fd, &event) == -1)
+    {
+        perror("epoll_ctl\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int event_loop_modify(event_loop* loop, event_watcher* watcher, uint32_t events)
+{
+    if (loop->ring.fd != -1)
+    {
+        // A pending poll is replaced, one that already completed is re-armed after its handler returns
+        if (watcher->armed && watcher->events == events)
+            return 0;
+
+        cancel_poll(loop, watcher);
+        watcher->events = events;
+        return arm_poll(loop, watcher);
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = watcher;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watcher->fd, &event) == -1)
+    {
+        perror("epoll_ctl\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void event_loop_remove(event_loop* loop, event_watcher* watcher)
+{
+    if (watcher->fd == -1)
+        return;
+
+    if (loop->ring.fd != -1)
+    {
+        cancel_poll(loop, watcher);
+
+        poll_slot* slot = &loop->polls[watcher->poll_slot];
+        slot->watcher = NULL;
+        slot->generation++;
+        slot->next_free = loop->free_poll;
+        loop->free_poll = watcher->poll_slot + 1;
+    }
+    else
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watcher->fd, NULL);
+
+    watcher->fd = -1; // Skip events of the current batch that are still pending for it
+}
+
+
+static void handle_timer_event(event_loop* loop, uint32_t events, void* ctx)
+{
+    (void)events;
+    event_timer* timer = (event_timer*)ctx;
+    uint64_t expirations;
+
+    // Reading the expiration count re-arms the descriptor
+    if (read(timer->watcher.fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    timer->handler(loop, timer->ctx);
+}
+
+
+int event_timer_start(event_loop* loop, event_timer* timer, long interval_ms, timer_handler handler, void* ctx)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("timerfd_create\n");
+        return -1;
+    }
+
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = interval_ms / 1000;
+    interval.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    interval.it_value = interval.it_interval;
+
+    if (timerfd_settime(fd, 0, &interval, NULL) == -1)
+    {
+        perror("timerfd_settime\n");
+        close(fd);
+        return -1;
+    }
+
+    timer->handler = handler;
+    timer->ctx = ctx;
+    event_watcher_init(&timer->watcher, fd, handle_timer_event, timer);
+
+    if (event_loop_add(loop, &timer->watcher, EPOLLIN) == -1)
+    {
+        close(fd);
+        timer->watcher.fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void event_timer_stop(event_loop* loop, event_timer* timer)
+{
+    int fd = timer->watcher.fd;
+    if (fd == -1)
+        return;
+
+    event_loop_remove(loop, &timer->watcher);
+    close(fd);
+}
+
+
+void event_loop_release(event_loop* loop, void* ptr)
+{
+    if (loop->released_count == loop->released_capacity)
+    {
+        size_t new_capacity = loop->released_capacity == 0 ? 16 : loop->released_capacity * 2;
+        void** new_released = (void**)realloc(loop->released, new_capacity * sizeof(void*));
+        if (new_released == NULL)
+        {
+            // Leaking is safer than freeing memory a pending event may still point to
+            fprintf(stderr, "Malloc failed\n");
+            return;
+        }
+
+        loop->released = new_released;
+        loop->released_capacity = new_capacity;
+    }
+
+    loop->released[loop->released_count++] = ptr;
+}
+
+
+static void free_released(event_loop* loop)
+{
+    for (size_t i = 0; i < loop->released_count; i++)
+        free(loop->released[i]);
+
+    loop->released_count = 0;
+}
+
+
+static int run_io_uring(event_loop* loop)
+{
+    struct io_uring_cqe completions[MAX_EVENTS];
+
+    loop->running = 1;
+    while (loop->running)
+    {
+        // The polls and cancellations queued by the handlers go to the kernel with the wait
+        if (io_ring_submit(&loop->ring, 1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("io_uring_enter\n");
+            return -1;
+        }
+
+        int ready = 0;
+        while (ready < MAX_EVENTS && io_ring_next_completion(&loop->ring, &completions[ready]))
+            ready++;
+
+        for (int i = 0; i < ready; i++)
+        {
+            uint32_t slot = (uint32_t)completions[i].user_data - 1;
+            uint32_t generation = (uint32_t)(completions[i].user_data >> 32);
+
+            // Cancellations, and polls of watchers removed or changed since they were queued
+            if (completions[i].user_data == 0 || loop->polls[slot].generation != generation ||
+                loop->polls[slot].watcher == NULL)
+                continue;
+
+            event_watcher* watcher = loop->polls[slot].watcher;
+            watcher->armed = 0;
+
+            // A descriptor the kernel could not poll is reported like an epoll error
+            uint32_t events = completions[i].res < 0 ? EPOLLERR : (uint32_t)completions[i].res;
+            watcher->handler(loop, events, watcher->ctx);
+
+            // Wait again unless the handler removed the watcher or re-armed it
+            if (loop->polls[slot].generation == generation && loop->polls[slot].watcher == watcher &&
+                !watcher->armed)
+                arm_poll(loop, watcher);
+        }
+
+        free_released(loop);
+    }
+
+    return 0;
+}
+
+
+int event_loop_run(event_loop* loop)
+{
+    if (loop->ring.fd != -1)
+        return run_io_uring(loop);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    loop->running = 1;
+    while (loop->running)
+    {
+        int ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("epoll_wait\n");
+            return -1;
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            event_watcher* watcher = (event_watcher*)events[i].data.ptr;
+
+            // The watcher was removed by a handler earlier in this batch
+            if (watcher->fd == -1)
+                continue;
+
+            watcher->handler(loop, events[i].events, watcher->ctx);
+        }
+
+        free_released(loop);
+    }
+
+    return 0;
+}
+
+
+void event_loop_stop(event_loop* loop)
+{
+    loop->running = 0;
+}
+
+
+void event_loop_close(event_loop* loop)
+{
+    free_released(loop);
+    free(loop->released);
+    loop->released = NULL;
+    loop->released_capacity = 0;
+
+    if (loop->epoll_fd != -1)
+        close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+
+    io_ring_close(&loop->ring);
+    free(loop->polls);
+    loop->polls = NULL;
+    loop->poll_count = 0;
+    loop->poll_capacity = 0;
+}
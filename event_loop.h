@@ -0,0 +1,168 @@
+#ifndef CPROXY_EVENT_LOOP_H
+#define CPROXY_EVENT_LOOP_H
+
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "io_ring.h"
+
+
+#define MAX_EVENTS 256 // Maximum number of events handled per epoll_wait call
+
+typedef enum{
+    IO_ENGINE_EPOLL, // Descriptors are watched with epoll, every change is an epoll_ctl call
+    IO_ENGINE_IO_URING // Descriptors are polled through io_uring, changes are queued and submitted with the wait
+} io_engine;
+
+typedef struct event_loop event_loop;
+
+// Called when the watched descriptor is ready, with the ready epoll events
+typedef void (*event_handler)(event_loop*, uint32_t, void*);
+
+typedef struct{
+    int fd; // Watched descriptor, -1 once removed from the loop
+    event_handler handler; // Function called when the descriptor is ready
+    void* ctx; // Context passed to the handler
+    uint32_t events; // Events waited for, used by the io_uring engine
+    uint32_t poll_slot; // Entry of the loop's poll table, used by the io_uring engine
+    int armed; // 1 while an io_uring poll of the descriptor is pending
+} event_watcher;
+
+// Called every time a periodic timer expires
+typedef void (*timer_handler)(event_loop*, void*);
+
+typedef struct{
+    event_watcher watcher; // Watcher of the timer descriptor
+    timer_handler handler; // Function called when the timer expires
+    void* ctx; // Context passed to the handler
+} event_timer;
+
+typedef struct{
+    event_watcher* watcher; // Watcher using the slot, or NULL if free
+    uint32_t generation; // Changes whenever a poll of the slot is cancelled, so its late completion is ignored
+    uint32_t next_free; // Next free slot plus one, 0 ends the list
+} poll_slot;
+
+struct event_loop{
+    int epoll_fd; // epoll instance, -1 with the io_uring engine
+    io_ring ring; // io_uring instance of the io_uring engine, its fd is -1 with the epoll engine
+    poll_slot* polls; // Watchers added to the io_uring engine, completions name them by slot and generation
+    uint32_t poll_count; // Number of slots in use or freed
+    uint32_t poll_capacity; // Allocated size of polls
+    uint32_t free_poll; // First free slot plus one, 0 if none
+    int running; // 1 while event_loop_run should keep going
+    void** released; // Memory to free once the current batch of events was dispatched
+    size_t released_count; // Number of entries in released
+    size_t released_capacity; // Allocated size of released
+};
+
+
+/**
+ * Initializes an event loop on the engine chosen with '--io-engine'. If io_uring was chosen but the kernel does not
+ * offer it, the loop falls back to epoll.
+ *
+ * @param loop: A pointer to the 'event_loop' structure to initialize.
+ * @return 0 on success, or -1 on failure.
+ */
+int event_loop_init(event_loop*);
+
+/**
+ * Parses the value of the '--io-engine' option.
+ *
+ * @param str: "epoll" or "io_uring".
+ * @return The engine, or -1 if it is neither.
+ */
+int parse_io_engine(const char*);
+
+/**
+ * Sets up a watcher for a descriptor.
+ *
+ * @param watcher: A pointer to the 'event_watcher' structure to set up.
+ * @param fd: The descriptor to watch.
+ * @param handler: The function called when the descriptor is ready.
+ * @param ctx: The context passed to the handler.
+ */
+void event_watcher_init(event_watcher*, int, event_handler, void*);
+
+/**
+ * Starts watching a descriptor for the given epoll events.
+ *
+ * @param loop: A pointer to an initialized 'event_loop' structure.
+ * @param watcher: A pointer to a set up 'event_watcher' structure. It must stay valid until removed.
+ * @param events: The epoll events to wait for (EPOLLIN, EPOLLOUT, ...).
+ * @return 0 on success, or -1 on failure.
+ */
+int event_loop_add(event_loop*, event_watcher*, uint32_t);
+
+/**
+ * Changes the epoll events a watched descriptor waits for.
+ *
+ * @param loop: A pointer to an initialized 'event_loop' structure.
+ * @param watcher: A pointer to a watcher previously added to the loop.
+ * @param events: The epoll events to wait for. 0 keeps the descriptor registered but quiet, apart from the
+ *                EPOLLERR and EPOLLHUP that both engines always report.
+ * @return 0 on success, or -1 on failure.
+ */
+int event_loop_modify(event_loop*, event_watcher*, uint32_t);
+
+/**
+ * Stops watching a descriptor. Pending events of the current batch are no longer dispatched to it.
+ *
+ * @param loop: A pointer to an initialized 'event_loop' structure.
+ * @param watcher: A pointer to a watcher previously added to the loop.
+ */
+void event_loop_remove(event_loop*, event_watcher*);
+
+/**
+ * Starts a periodic timer on the event loop.
+ *
+ * @param loop: A pointer to an initialized 'event_loop' structure.
+ * @param timer: A pointer to the 'event_timer' structure to start. It must stay valid until stopped.
+ * @param interval_ms: The interval between expirations, in milliseconds.
+ * @param handler: The function called on every expiration.
+ * @param ctx: The context passed to the handler.
+ * @return 0 on success, or -1 on failure.
+ */
+int event_timer_start(event_loop*, event_timer*, long, timer_handler, void*);
+
+/**
+ * Stops a timer started with event_timer_start.
+ *
+ * @param loop: A pointer to an initialized 'event_loop' structure.
+ * @param timer: A pointer to a started 'event_timer' structure.
+ */
+void event_timer_stop(event_loop*, event_timer*);
+
+/**
+ * Frees memory once the current batch of events was dispatched, so watchers it holds stay valid until then.
+ *
+ * @param loop: A pointer to an initialized 'event_loop' structure.
+ * @param ptr: The memory to free.
+ */
+void event_loop_release(event_loop*, void*);
+
+/**
+ * Runs the event loop until event_loop_stop is called.
+ *
+ * @param loop: A pointer to an initialized 'event_loop' structure.
+ * @return 0 when stopped, or -1 if waiting for events failed.
+ */
+int event_loop_run(event_loop*);
+
+/**
+ * Makes event_loop_run return after the current batch of events.
+ *
+ * @param loop: A pointer to an initialized 'event_loop' structure.
+ */
+void event_loop_stop(event_loop*);
+
+/**
+ * Releases the resources of an event loop.
+ *
+ * @param loop: A pointer to an initialized 'event_loop' structure.
+ */
+void event_loop_close(event_loop*);
+
+
+#endif //CPROXY_EVENT_LOOP_H
@@ -0,0 +1,473 @@
+#include "fetch.h"
+
+
+
+static void release_socket(fetch* my_fetch, int reusable)
+{
+    int sd = my_fetch->watcher.fd;
+    if (sd != -1)
+        event_loop_remove(my_fetch->loop, &my_fetch->watcher);
+
+    if (my_fetch->pool != NULL && my_fetch->holds_slot)
+    {
+        my_fetch->holds_slot = 0;
+        conn_pool_release(my_fetch->pool, my_fetch->url, sd, reusable);
+    }
+    else if (sd != -1)
+        close(sd);
+}
+
+
+static void drop_socket(fetch* my_fetch)
+{
+    int sd = my_fetch->watcher.fd;
+    if (sd == -1)
+        return;
+
+    event_loop_remove(my_fetch->loop, &my_fetch->watcher);
+    close(sd);
+}
+
+
+static void close_fetch(fetch* my_fetch, int reusable)
+{
+    if (my_fetch->state == FETCH_WAITING)
+        conn_pool_cancel_wait(my_fetch->pool, my_fetch->url, &my_fetch->waiter);
+
+    if (my_fetch->state == FETCH_RESOLVING && my_fetch->env->dns != NULL)
+        resolver_cancel(my_fetch->env->dns, &my_fetch->query);
+
+    my_fetch->state = FETCH_DONE;
+    release_socket(my_fetch, reusable);
+
+    if (my_fetch->pipe_fds[0] != -1)
+    {
+        close(my_fetch->pipe_fds[0]);
+        close(my_fetch->pipe_fds[1]);
+        my_fetch->pipe_fds[0] = -1;
+        my_fetch->pipe_fds[1] = -1;
+    }
+
+    free(my_fetch->request);
+    my_fetch->request = NULL;
+}
+
+
+static void note_unreachable(fetch* my_fetch)
+{
+    // Failing before any connection was made means the origin is down or does not exist
+    if (my_fetch->state == FETCH_RESOLVING || my_fetch->state == FETCH_CONNECTING)
+        cache_store_record_failure(my_fetch->url, CACHE_UNREACHABLE);
+}
+
+
+static void finish_fetch(fetch* my_fetch, int result)
+{
+    int reusable = 0;
+
+    // Saving the object is timed apart from the transfer
+    if (my_fetch->response.total_bytes > 0)
+        phase_timer_end(&my_fetch->timing, PHASE_TRANSFER);
+
+    if (result == -1)
+    {
+        note_unreachable(my_fetch);
+        response_abort(&my_fetch->response);
+    }
+    else
+    {
+        reusable = response_reusable(&my_fetch->response);
+        result = response_finish(&my_fetch->response);
+    }
+
+    close_fetch(my_fetch, reusable);
+    my_fetch->on_done(my_fetch, result, my_fetch->ctx);
+}
+
+
+static int watch_socket(fetch* my_fetch, int sd)
+{
+    // Writability reports both the connect completion and room for the request
+    event_watcher_init(&my_fetch->watcher, sd, my_fetch->watcher.handler, my_fetch);
+    return event_loop_add(my_fetch->loop, &my_fetch->watcher, EPOLLOUT);
+}
+
+
+static int connect_next_address(fetch* my_fetch)
+{
+    // Try the addresses in order until one connect gets under way
+    while (my_fetch->next_address < my_fetch->addresses.count)
+    {
+        int index = my_fetch->next_address++;
+        int sd = connect_to_address(&my_fetch->addresses.addresses[index], my_fetch->addresses.lengths[index],
+                                    my_fetch->url->port, 1);
+        if (sd != -1)
+        {
+            my_fetch->state = FETCH_CONNECTING;
+            return watch_socket(my_fetch, sd);
+        }
+    }
+
+    return -1;
+}
+
+
+static void handle_resolved_addresses(resolve_query* query, int status, const resolved_addresses* result)
+{
+    fetch* my_fetch = (fetch*)((char*)query - offsetof(fetch, query));
+
+    if (status != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        finish_fetch(my_fetch, -1);
+        return;
+    }
+
+    phase_timer_end(&my_fetch->timing, PHASE_DNS);
+    my_fetch->addresses = *result;
+    my_fetch->next_address = 0;
+    if (connect_next_address(my_fetch) == -1)
+        finish_fetch(my_fetch, -1);
+}
+
+
+static int resolve_origin(fetch* my_fetch)
+{
+    my_fetch->state = FETCH_RESOLVING;
+    my_fetch->next_address = 0;
+
+    // Without a resolver the lookup blocks the loop
+    if (my_fetch->env->dns == NULL)
+    {
+        int status = resolve_host(my_fetch->url->host, &my_fetch->addresses);
+        if (status != 0)
+        {
+            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+            return -1;
+        }
+        phase_timer_end(&my_fetch->timing, PHASE_DNS);
+        return connect_next_address(my_fetch);
+    }
+
+    switch (resolver_lookup(my_fetch->env->dns, my_fetch->url->host, &my_fetch->query))
+    {
+        case RESOLVE_DONE:
+            phase_timer_end(&my_fetch->timing, PHASE_DNS);
+            my_fetch->addresses = my_fetch->query.result;
+            return connect_next_address(my_fetch);
+
+        case RESOLVE_PENDING:
+            return 0; // Continued by handle_resolved_addresses
+
+        default:
+            return -1;
+    }
+}
+
+
+static int open_socket(fetch* my_fetch)
+{
+    int sd = -1;
+
+    if (my_fetch->pool != NULL)
+    {
+        switch (conn_pool_acquire(my_fetch->pool, my_fetch->url, &sd))
+        {
+            case POOL_REUSED:
+                phase_timer_end(&my_fetch->timing, PHASE_QUEUE);
+                my_fetch->holds_slot = 1;
+                my_fetch->reused = 1;
+                my_fetch->state = FETCH_SENDING;
+                return watch_socket(my_fetch, sd);
+
+            case POOL_FULL:
+                // Continue once another fetch to the same origin released its socket
+                my_fetch->state = FETCH_WAITING;
+                conn_pool_wait(my_fetch->pool, my_fetch->url, &my_fetch->waiter);
+                return 0;
+
+            case POOL_ERROR:
+                return -1;
+
+            case POOL_NEW:
+                phase_timer_end(&my_fetch->timing, PHASE_QUEUE);
+                my_fetch->holds_slot = 1;
+                break;
+        }
+    }
+
+    my_fetch->reused = 0;
+    return resolve_origin(my_fetch);
+}
+
+
+static int retry_fetch(fetch* my_fetch)
+{
+    // An idle socket closed by the origin fails before any response byte arrives; try once more on a new one
+    if (!my_fetch->reused || my_fetch->retried || my_fetch->response.total_bytes > 0)
+        return 0;
+
+    my_fetch->retried = 1;
+    release_socket(my_fetch, 0);
+
+    my_fetch->request_sent = 0;
+    response_init(&my_fetch->response, my_fetch->url);
+    my_fetch->response.timing = &my_fetch->timing;
+
+    if (open_socket(my_fetch) == -1)
+        finish_fetch(my_fetch, -1);
+    return 1;
+}
+
+
+static void handle_pool_ready(pool_waiter* waiter)
+{
+    fetch* my_fetch = (fetch*)((char*)waiter - offsetof(fetch, waiter));
+
+    if (my_fetch->state != FETCH_WAITING)
+        return;
+
+    if (open_socket(my_fetch) == -1)
+        finish_fetch(my_fetch, -1);
+}
+
+
+static void handle_connecting(fetch* my_fetch)
+{
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+
+    // The outcome of a non-blocking connect is reported through SO_ERROR
+    if (getsockopt(my_fetch->watcher.fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0)
+    {
+        fprintf(stderr, "connect: %s\n", strerror(error != 0 ? error : errno));
+
+        // Fall back to the next address of the origin
+        drop_socket(my_fetch);
+        if (connect_next_address(my_fetch) == -1)
+            finish_fetch(my_fetch, -1);
+        return;
+    }
+
+    phase_timer_end(&my_fetch->timing, PHASE_CONNECT);
+    my_fetch->state = FETCH_SENDING;
+}
+
+
+static void handle_sending(fetch* my_fetch)
+{
+    while (my_fetch->request_sent < my_fetch->request_length)
+    {
+        ssize_t wrote_bytes = write(my_fetch->watcher.fd, my_fetch->request + my_fetch->request_sent,
+                                    my_fetch->request_length - my_fetch->request_sent);
+        if (wrote_bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // Wait for the socket to become writable again
+
+            if (retry_fetch(my_fetch))
+                return;
+
+            perror("write\n");
+            finish_fetch(my_fetch, -1);
+            return;
+        }
+
+        my_fetch->request_sent += wrote_bytes;
+    }
+
+    // The whole request was sent, wait for the response
+    my_fetch->state = FETCH_RECEIVING;
+    if (event_loop_modify(my_fetch->loop, &my_fetch->watcher, my_fetch->paused ? 0 : EPOLLIN) == -1)
+        finish_fetch(my_fetch, -1);
+}
+
+
+static int splice_body(fetch* my_fetch)
+{
+    if (my_fetch->pipe_fds[0] == -1 && create_splice_pipe(my_fetch->pipe_fds, options.buffer_size) == -1)
+    {
+        my_fetch->splice_enabled = 0;
+        return 1;
+    }
+
+    size_t body_bytes = my_fetch->response.body_bytes;
+    ssize_t moved = response_splice_body(&my_fetch->response, my_fetch->watcher.fd, my_fetch->pipe_fds, -1,
+                                         options.buffer_size, 1);
+    if (moved > 0)
+    {
+        if (my_fetch->response.complete)
+            finish_fetch(my_fetch, 0);
+        return 1;
+    }
+
+    if (moved == 0)
+    {
+        finish_fetch(my_fetch, 0);
+        return 1;
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+
+    // Nothing was moved, so the body can still be read the usual way
+    if (errno == EINVAL && my_fetch->response.body_bytes == body_bytes)
+    {
+        my_fetch->splice_enabled = 0;
+        return 1;
+    }
+
+    perror("splice\n");
+    finish_fetch(my_fetch, -1);
+    return 1;
+}
+
+
+static void handle_receiving(fetch* my_fetch)
+{
+    // Stop after one buffer when the owner paused the fetch from its data handler
+    while (!my_fetch->paused && my_fetch->state == FETCH_RECEIVING)
+    {
+        // Nobody needs the bytes in user space, move the body to the cache file inside the kernel
+        if (my_fetch->on_data == NULL && my_fetch->splice_enabled && response_can_splice(&my_fetch->response))
+        {
+            if (splice_body(my_fetch) == 0)
+                return; // Wait for more data
+            continue;
+        }
+
+        ssize_t read_bytes = read(my_fetch->watcher.fd, my_fetch->buffer, sizeof(my_fetch->buffer));
+        if (read_bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+
+            if (retry_fetch(my_fetch))
+                return;
+
+            perror("Failed to read from file descriptor\n");
+            finish_fetch(my_fetch, -1);
+            return;
+        }
+
+        // The origin closed the connection: the end of a close-delimited body, or a framed body cut short
+        if (read_bytes == 0)
+        {
+            if (!retry_fetch(my_fetch))
+                finish_fetch(my_fetch, 0);
+            return;
+        }
+
+        if (my_fetch->response.total_bytes == 0)
+            phase_timer_end(&my_fetch->timing, PHASE_FIRST_BYTE);
+
+        if (response_feed(&my_fetch->response, my_fetch->buffer, read_bytes) == -1)
+        {
+            finish_fetch(my_fetch, -1);
+            return;
+        }
+
+        if (my_fetch->on_data != NULL)
+            my_fetch->on_data(my_fetch, my_fetch->buffer, read_bytes, my_fetch->ctx);
+
+        // The body length is known and was fully received, the socket may serve the next request
+        if (my_fetch->state == FETCH_RECEIVING && my_fetch->response.complete)
+            finish_fetch(my_fetch, 0);
+    }
+}
+
+
+static void handle_fetch_event(event_loop* loop, uint32_t events, void* ctx)
+{
+    (void)loop;
+    (void)events;
+    fetch* my_fetch = (fetch*)ctx;
+
+    if (my_fetch->state == FETCH_CONNECTING)
+        handle_connecting(my_fetch);
+
+    if (my_fetch->state == FETCH_SENDING)
+        handle_sending(my_fetch);
+    else if (my_fetch->state == FETCH_RECEIVING)
+        handle_receiving(my_fetch);
+}
+
+
+int fetch_start(fetch* my_fetch, fetch_env* env, full_URL* my_url,
+                fetch_data_handler on_data, fetch_done_handler on_done, void* ctx)
+{
+    my_fetch->env = env;
+    my_fetch->loop = env->loop;
+    my_fetch->url = my_url;
+    my_fetch->state = FETCH_CONNECTING;
+    my_fetch->pool = env->pool;
+    my_fetch->waiter.ready = handle_pool_ready;
+    my_fetch->waiter.next = NULL;
+    my_fetch->holds_slot = 0;
+    my_fetch->reused = 0;
+    my_fetch->retried = 0;
+    my_fetch->query.handler = handle_resolved_addresses;
+    my_fetch->query.job = NULL;
+    my_fetch->addresses.count = 0;
+    my_fetch->next_address = 0;
+    my_fetch->pipe_fds[0] = -1;
+    my_fetch->pipe_fds[1] = -1;
+    my_fetch->splice_enabled = 1;
+    my_fetch->paused = 0;
+    my_fetch->request_sent = 0;
+    my_fetch->on_data = on_data;
+    my_fetch->on_done = on_done;
+    my_fetch->ctx = ctx;
+    event_watcher_init(&my_fetch->watcher, -1, handle_fetch_event, my_fetch);
+    response_init(&my_fetch->response, my_url);
+    my_fetch->response.timing = &my_fetch->timing;
+    phase_timer_start(&my_fetch->timing);
+
+    // Keep-alive is only asked for when there is a pool to keep the socket in
+    my_fetch->request = build_request(my_url, my_fetch->pool != NULL, NULL, &my_fetch->request_length);
+    if (my_fetch->request == NULL)
+        return -1;
+
+    // Only a failed lookup or connect leaves the fetch resolving, the starting state is not a connect that failed
+    if (open_socket(my_fetch) == -1)
+    {
+        if (my_fetch->state == FETCH_RESOLVING)
+            note_unreachable(my_fetch);
+        close_fetch(my_fetch, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void fetch_pause(fetch* my_fetch)
+{
+    if (my_fetch->paused || my_fetch->state == FETCH_DONE)
+        return;
+
+    my_fetch->paused = 1;
+    if (my_fetch->state == FETCH_RECEIVING)
+        event_loop_modify(my_fetch->loop, &my_fetch->watcher, 0);
+}
+
+
+void fetch_resume(fetch* my_fetch)
+{
+    if (!my_fetch->paused || my_fetch->state == FETCH_DONE)
+        return;
+
+    my_fetch->paused = 0;
+    if (my_fetch->state == FETCH_RECEIVING)
+        event_loop_modify(my_fetch->loop, &my_fetch->watcher, EPOLLIN);
+}
+
+
+void fetch_cancel(fetch* my_fetch)
+{
+    if (my_fetch->state == FETCH_DONE)
+        return;
+
+    response_abort(&my_fetch->response);
+    close_fetch(my_fetch, 0);
+}
@@ -0,0 +1,100 @@
+#ifndef CPROXY_FETCH_H
+#define CPROXY_FETCH_H
+
+
+#include "cproxy.h"
+#include <stddef.h>
+#include "event_loop.h"
+#include "response.h"
+#include "conn_pool.h"
+#include "resolver.h"
+
+
+typedef enum{
+    FETCH_WAITING, // Waiting for a free socket to the origin
+    FETCH_RESOLVING, // Waiting for the addresses of the origin
+    FETCH_CONNECTING, // Waiting for the non-blocking connect to complete
+    FETCH_SENDING, // Writing the request
+    FETCH_RECEIVING, // Reading the response
+    FETCH_DONE // Finished, the socket is closed
+} fetch_state;
+
+typedef struct fetch fetch;
+
+typedef struct{
+    event_loop* loop; // Loop driving the fetches
+    conn_pool* pool; // Keep-alive sockets to the origins, or NULL for one connection per fetch
+    resolver* dns; // Asynchronous caching resolver, or NULL to resolve while blocking
+} fetch_env;
+
+// Called with every chunk of the response, as read from the origin
+typedef void (*fetch_data_handler)(fetch*, const char*, size_t, void*);
+// Called once the fetch finished, with the result of response_finish or -1 on failure
+typedef void (*fetch_done_handler)(fetch*, int, void*);
+
+struct fetch{
+    fetch_env* env; // Loop, pool and resolver the fetch uses
+    event_loop* loop; // Loop driving the fetch
+    event_watcher watcher; // Watcher of the origin socket
+    full_URL* url; // URL being fetched
+    fetch_state state; // Current state
+    conn_pool* pool; // Pool the socket comes from, or NULL
+    pool_waiter waiter; // Queue entry while waiting for a socket
+    int holds_slot; // 1 while a socket or slot of the pool is held
+    int reused; // 1 if the socket was reused from the pool
+    int retried; // 1 once the request was retried on a new socket
+    resolve_query query; // Lookup of the origin addresses
+    resolved_addresses addresses; // Addresses of the origin
+    int next_address; // Index of the next address to try connecting to
+    int paused; // 1 while the owner does not accept more data
+    char* request; // HTTP request sent to the origin
+    size_t request_length; // Length of request
+    size_t request_sent; // Bytes of request written so far
+    http_response response; // Header and cache state of the response
+    int pipe_fds[2]; // Pipe the body is spliced through when there is no data handler, or -1
+    int splice_enabled; // Cleared if the socket does not support splice()
+    char buffer[READ_BUFFER_SIZE]; // Buffer the response is read into
+    fetch_data_handler on_data; // Data handler
+    fetch_done_handler on_done; // Completion handler
+    void* ctx; // Context passed to the handlers
+    phase_timer timing; // Time spent in each phase, measured when timing is on
+};
+
+
+/**
+ * Starts fetching a URL from its origin on the given event loop, saving a 200 response to the cache.
+ *
+ * @param my_fetch: A pointer to the 'fetch' structure to use. It must stay valid until the done handler is called.
+ * @param env: The event loop driving the fetch, with the connection pool and resolver to use.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param on_data: Called with every chunk of the response. It may pause the fetch.
+ *                 NULL if the owner only needs the cache filled, which lets the body be spliced to the cache file.
+ * @param on_done: Called once when the fetch finished or failed.
+ * @param ctx: The context passed to the handlers.
+ * @return 0 if the fetch was started, or -1 if it failed right away. The done handler is not called on -1.
+ */
+int fetch_start(fetch*, fetch_env*, full_URL*, fetch_data_handler, fetch_done_handler, void*);
+
+/**
+ * Stops reading from the origin until fetch_resume is called.
+ *
+ * @param my_fetch: A pointer to a started 'fetch' structure.
+ */
+void fetch_pause(fetch*);
+
+/**
+ * Resumes reading from the origin after fetch_pause.
+ *
+ * @param my_fetch: A pointer to a started 'fetch' structure.
+ */
+void fetch_resume(fetch*);
+
+/**
+ * Cancels a fetch without calling its done handler. Nothing is saved to the cache.
+ *
+ * @param my_fetch: A pointer to a started 'fetch' structure.
+ */
+void fetch_cancel(fetch*);
+
+
+#endif //CPROXY_FETCH_H
@@ -0,0 +1,156 @@
+#include "io_ring.h"
+
+
+
+static int ring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+int io_ring_init(io_ring* ring, unsigned entries)
+{
+    memset(ring, 0, sizeof(io_ring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = ring_setup(entries, &params);
+    if (fd == -1)
+        return -1;
+
+    // Completions must never be dropped: a lost poll completion would leave its descriptor unwatched
+    if (!(params.features & IORING_FEAT_NODROP))
+    {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Recent kernels map both rings at once
+    int single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map && ring->cq_map_size > ring->sq_map_size)
+        ring->sq_map_size = ring->cq_map_size;
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    ring->cq_map = ring->sq_map;
+    if (!single_map)
+    {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED)
+        {
+            munmap(ring->sq_map, ring->sq_map_size);
+            close(fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (!single_map)
+            munmap(ring->cq_map, ring->cq_map_size);
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(fd);
+        return -1;
+    }
+
+    char* sq = (char*)ring->sq_map;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char* cq = (char*)ring->cq_map;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    ring->entries = params.sq_entries;
+    ring->fd = fd;
+    return 0;
+}
+
+
+struct io_uring_sqe* io_ring_get_sqe(io_ring* ring)
+{
+    // Handlers may queue more than fits between two waits, the kernel takes the queued ones to make room
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries &&
+        (io_ring_submit(ring, 0) == -1 ||
+         ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries))
+        return NULL;
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+
+int io_ring_submit(io_ring* ring, unsigned wait_count)
+{
+    // The kernel reads the entries once it sees the new tail
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (to_submit == 0 && wait_count == 0)
+        return 0;
+
+    if (ring_enter(ring->fd, to_submit, wait_count, wait_count > 0 ? IORING_ENTER_GETEVENTS : 0) == -1)
+        return -1;
+
+    return 0;
+}
+
+
+int io_ring_next_completion(io_ring* ring, struct io_uring_cqe* completion)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    *completion = ring->cqes[head & *ring->cq_mask];
+
+    // The kernel may reuse the entry once the head moved past it
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+void io_ring_close(io_ring* ring)
+{
+    if (ring->fd == -1)
+        return;
+
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
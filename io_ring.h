@@ -0,0 +1,77 @@
+#ifndef CPROXY_IO_RING_H
+#define CPROXY_IO_RING_H
+
+
+#include "cproxy.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+#define IO_RING_ENTRIES 256 // Submission queue size, the completion queue gets twice as many
+
+typedef struct{
+    int fd; // io_uring instance, -1 if not set up
+    unsigned entries; // Number of submission queue entries
+    unsigned* sq_head; // Next entry the kernel consumes
+    unsigned* sq_tail; // Next entry to fill, published to the kernel on submission
+    unsigned* sq_mask; // Index mask of the submission queue
+    unsigned* sq_array; // Indexes of the filled entries, in submission order
+    struct io_uring_sqe* sqes; // Submission queue entries
+    unsigned sq_local_tail; // Tail including the entries filled since the last submission
+    unsigned* cq_head; // Next completion to consume
+    unsigned* cq_tail; // Next completion the kernel posts
+    unsigned* cq_mask; // Index mask of the completion queue
+    struct io_uring_cqe* cqes; // Completion queue entries
+    void* sq_map; // Mapping of the submission queue ring, shared with the completion queue on recent kernels
+    size_t sq_map_size; // Size of sq_map
+    void* cq_map; // Mapping of the completion queue ring, sq_map if shared
+    size_t cq_map_size; // Size of cq_map
+    size_t sqes_size; // Size of the mapping of sqes
+} io_ring;
+
+
+/**
+ * Sets up an io_uring instance with the raw system calls, without liburing.
+ *
+ * @param ring: A pointer to the 'io_ring' structure to initialize. Its fd is -1 on failure.
+ * @param entries: The number of submission queue entries, a power of two.
+ * @return 0 on success, or -1 if the kernel does not offer io_uring (errno tells why).
+ */
+int io_ring_init(io_ring*, unsigned);
+
+/**
+ * Gets a cleared submission queue entry to fill. A full queue is submitted first.
+ *
+ * @param ring: A pointer to an initialized 'io_ring' structure.
+ * @return The entry, queued with the next submission, or NULL if the queue stays full.
+ */
+struct io_uring_sqe* io_ring_get_sqe(io_ring*);
+
+/**
+ * Submits the queued entries and waits for completions, in a single system call.
+ *
+ * @param ring: A pointer to an initialized 'io_ring' structure.
+ * @param wait_count: The number of completions to wait for, 0 to only submit.
+ * @return 0 on success, or -1 on failure (errno is EINTR if a signal interrupted the wait).
+ */
+int io_ring_submit(io_ring*, unsigned);
+
+/**
+ * Takes the oldest completion off the completion queue.
+ *
+ * @param ring: A pointer to an initialized 'io_ring' structure.
+ * @param completion: Set to a copy of the completion.
+ * @return 1 if there was a completion, else 0.
+ */
+int io_ring_next_completion(io_ring*, struct io_uring_cqe*);
+
+/**
+ * Releases an io_uring instance. Operations still pending are cancelled.
+ *
+ * @param ring: A pointer to an 'io_ring' structure, initialized or not.
+ */
+void io_ring_close(io_ring*);
+
+
+#endif //CPROXY_IO_RING_H
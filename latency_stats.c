@@ -0,0 +1,268 @@
+#include "latency_stats.h"
+
+
+// Upper bounds of the finite buckets, from 100 us to 10 s
+static const double bucket_bounds_ms[LATENCY_BUCKETS] = {
+    0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static const char* const phase_names[PHASE_COUNT] = {
+    "queue", "dns", "connect", "first_byte", "transfer", "cache_write", "cache_read"
+};
+
+
+
+int parse_timing_format(const char* str)
+{
+    if (strcmp(str, "json") == 0)
+        return TIMING_JSON;
+    if (strcmp(str, "prometheus") == 0)
+        return TIMING_PROMETHEUS;
+
+    return -1;
+}
+
+
+double timing_now()
+{
+    if (options.timing == TIMING_OFF)
+        return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+void phase_timer_start(phase_timer* timer)
+{
+    timer->phases = 0;
+    if (options.timing == TIMING_OFF)
+        return;
+
+    memset(timer, 0, sizeof(phase_timer));
+    timer->mark_ms = timing_now();
+}
+
+
+void phase_timer_end(phase_timer* timer, latency_phase phase)
+{
+    if (options.timing == TIMING_OFF || timer == NULL)
+        return;
+
+    double now = timing_now();
+    timer->phase_ms[phase] += now - timer->mark_ms;
+    timer->phases |= 1u << phase;
+    timer->mark_ms = now;
+}
+
+
+void phase_timer_add(phase_timer* timer, latency_phase phase, double started)
+{
+    if (options.timing == TIMING_OFF || timer == NULL)
+        return;
+
+    double elapsed = timing_now() - started;
+    timer->phase_ms[phase] += elapsed;
+    timer->phases |= 1u << phase;
+
+    // The enclosing phase ends up without it
+    timer->mark_ms += elapsed;
+}
+
+
+void phase_timer_merge(phase_timer* timer, const phase_timer* other)
+{
+    if (options.timing == TIMING_OFF)
+        return;
+
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+        timer->phase_ms[phase] += other->phase_ms[phase];
+    timer->phases |= other->phases;
+}
+
+
+FILE* open_timing_stream(const char* path)
+{
+    if (path == NULL)
+        return stderr;
+
+    FILE* stream = fopen(path, "w");
+    if (stream == NULL)
+        fprintf(stderr, "Error opening file %s for writing.\n", path);
+
+    return stream;
+}
+
+
+void latency_stats_init(latency_stats* stats)
+{
+    memset(stats, 0, sizeof(latency_stats));
+}
+
+
+static void observe(latency_histogram* histogram, double value_ms)
+{
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS && value_ms > bucket_bounds_ms[bucket])
+        bucket++;
+
+    histogram->counts[bucket]++;
+    histogram->count++;
+    histogram->sum_ms += value_ms;
+}
+
+
+void latency_stats_record(latency_stats* stats, const phase_timer* timer)
+{
+    if (timer->phases == 0)
+        return;
+
+    double total_ms = 0;
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        if (!(timer->phases & (1u << phase)))
+            continue;
+
+        observe(&stats->phases[phase], timer->phase_ms[phase]);
+        total_ms += timer->phase_ms[phase];
+    }
+
+    observe(&stats->total, total_ms);
+}
+
+
+static void add_histogram(latency_histogram* sum, const latency_histogram* other)
+{
+    for (int bucket = 0; bucket <= LATENCY_BUCKETS; bucket++)
+        sum->counts[bucket] += other->counts[bucket];
+    sum->count += other->count;
+    sum->sum_ms += other->sum_ms;
+}
+
+
+void latency_stats_add(latency_stats* sum, const latency_stats* other)
+{
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+        add_histogram(&sum->phases[phase], &other->phases[phase]);
+    add_histogram(&sum->total, &other->total);
+}
+
+
+static void write_escaped(FILE* stream, const char* str)
+{
+    // Both JSON strings and Prometheus label values escape backslashes, quotes and line breaks
+    for (; *str != '\0'; str++)
+    {
+        if (*str == '\\' || *str == '"')
+            fprintf(stream, "\\%c", *str);
+        else if (*str == '\n')
+            fputs("\\n", stream);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(stream, "\\u%04x", (unsigned char)*str);
+        else
+            fputc(*str, stream);
+    }
+}
+
+
+static void write_json_histogram(FILE* stream, const char* name, const latency_histogram* histogram)
+{
+    fprintf(stream, "\"%s\":{\"count\":%lu,\"sum_ms\":%.3f,\"buckets\":[", name, histogram->count, histogram->sum_ms);
+
+    unsigned long cumulative = 0;
+    for (int bucket = 0; bucket <= LATENCY_BUCKETS; bucket++)
+    {
+        cumulative += histogram->counts[bucket];
+        if (bucket < LATENCY_BUCKETS)
+            fprintf(stream, "{\"le_ms\":%g,\"count\":%lu},", bucket_bounds_ms[bucket], cumulative);
+        else
+            fprintf(stream, "{\"le_ms\":\"+Inf\",\"count\":%lu}", cumulative);
+    }
+
+    fputs("]}", stream);
+}
+
+
+static void write_prometheus_histogram(FILE* stream, const char* name, const latency_histogram* histogram)
+{
+    unsigned long cumulative = 0;
+    for (int bucket = 0; bucket <= LATENCY_BUCKETS; bucket++)
+    {
+        cumulative += histogram->counts[bucket];
+        if (bucket < LATENCY_BUCKETS)
+            fprintf(stream, "cproxy_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n", name,
+                    bucket_bounds_ms[bucket] / 1000.0, cumulative);
+        else
+            fprintf(stream, "cproxy_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", name, cumulative);
+    }
+
+    fprintf(stream, "cproxy_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n", name, histogram->sum_ms / 1000.0);
+    fprintf(stream, "cproxy_phase_duration_seconds_count{phase=\"%s\"} %lu\n", name, histogram->count);
+}
+
+
+void latency_stats_write(FILE* stream, const latency_stats* stats, timing_format format)
+{
+    if (format == TIMING_JSON)
+    {
+        fputs("{\"phases\":{", stream);
+        for (int phase = 0; phase < PHASE_COUNT; phase++)
+        {
+            write_json_histogram(stream, phase_names[phase], &stats->phases[phase]);
+            fputc(',', stream);
+        }
+        write_json_histogram(stream, "total", &stats->total);
+        fputs("}}\n", stream);
+        return;
+    }
+
+    fputs("# HELP cproxy_phase_duration_seconds Time requests spent in each phase of a fetch.\n"
+          "# TYPE cproxy_phase_duration_seconds histogram\n", stream);
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+        write_prometheus_histogram(stream, phase_names[phase], &stats->phases[phase]);
+    write_prometheus_histogram(stream, "total", &stats->total);
+}
+
+
+void phase_timer_write(FILE* stream, const phase_timer* timer, const char* url, const char* result,
+                       timing_format format)
+{
+    double total_ms = 0;
+
+    if (format == TIMING_JSON)
+    {
+        fputs("{\"url\":\"", stream);
+        write_escaped(stream, url);
+        fprintf(stream, "\",\"result\":\"%s\",\"phases_ms\":{", result);
+
+        const char* separator = "";
+        for (int phase = 0; phase < PHASE_COUNT; phase++)
+        {
+            if (!(timer->phases & (1u << phase)))
+                continue;
+
+            fprintf(stream, "%s\"%s\":%.3f", separator, phase_names[phase], timer->phase_ms[phase]);
+            total_ms += timer->phase_ms[phase];
+            separator = ",";
+        }
+
+        fprintf(stream, "},\"total_ms\":%.3f}\n", total_ms);
+        return;
+    }
+
+    for (int phase = 0; phase <= PHASE_COUNT; phase++)
+    {
+        // The last sample is the sum of the others
+        if (phase < PHASE_COUNT && !(timer->phases & (1u << phase)))
+            continue;
+
+        double value_ms = phase < PHASE_COUNT ? timer->phase_ms[phase] : total_ms;
+        total_ms += phase < PHASE_COUNT ? value_ms : 0;
+
+        fputs("cproxy_request_phase_seconds{url=\"", stream);
+        write_escaped(stream, url);
+        fprintf(stream, "\",result=\"%s\",phase=\"%s\"} %.6f\n", result,
+                phase < PHASE_COUNT ? phase_names[phase] : "total", value_ms / 1000.0);
+    }
+}
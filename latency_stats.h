@@ -0,0 +1,147 @@
+#ifndef CPROXY_LATENCY_STATS_H
+#define CPROXY_LATENCY_STATS_H
+
+
+#include "cproxy.h"
+#include <time.h>
+
+
+#define LATENCY_BUCKETS 16 // Number of finite histogram buckets, a last one counts everything slower
+#define METRICS_PATH "/cproxy/metrics" // Path the server mode answers with the latency histograms
+
+typedef enum{
+    TIMING_OFF, // Phases are not measured
+    TIMING_JSON, // Exported as JSON
+    TIMING_PROMETHEUS // Exported in the Prometheus text format
+} timing_format;
+
+typedef enum{
+    PHASE_QUEUE, // Waiting for a free socket to the origin
+    PHASE_DNS, // Resolving the host name of the origin
+    PHASE_CONNECT, // Establishing the TCP connection
+    PHASE_FIRST_BYTE, // From sending the request to the first response byte
+    PHASE_TRANSFER, // Receiving the rest of the response, without the cache writes
+    PHASE_CACHE_WRITE, // Creating the cache file, writing the body to it and committing it to the index
+    PHASE_CACHE_READ, // Looking the URL up in the cache and reading a hit
+    PHASE_COUNT // Number of phases
+} latency_phase;
+
+typedef struct phase_timer{
+    double mark_ms; // When the phase being timed started, in milliseconds of CLOCK_MONOTONIC
+    double phase_ms[PHASE_COUNT]; // Time spent in every phase
+    unsigned phases; // Bit (1 << phase) set for every phase that was timed
+} phase_timer;
+
+typedef struct{
+    unsigned long counts[LATENCY_BUCKETS + 1]; // Observations per bucket, not cumulative
+    unsigned long count; // Number of observations
+    double sum_ms; // Sum of the observations
+} latency_histogram;
+
+typedef struct{
+    latency_histogram phases[PHASE_COUNT]; // Histogram of every phase, over the requests that went through it
+    latency_histogram total; // Histogram of the sum of the phases of every request
+} latency_stats;
+
+
+/**
+ * Parses the value of the '--timing' option.
+ *
+ * @param str: "json" or "prometheus".
+ * @return The format, or -1 if it is neither.
+ */
+int parse_timing_format(const char*);
+
+/**
+ * Reads the clock phases are measured with. Costs nothing when timing is off.
+ *
+ * @return The current time in milliseconds of CLOCK_MONOTONIC, or 0 if timing is off.
+ */
+double timing_now();
+
+/**
+ * Clears a timer and starts timing its first phase.
+ *
+ * @param timer: A pointer to the 'phase_timer' structure to start.
+ */
+void phase_timer_start(phase_timer*);
+
+/**
+ * Ends the phase being timed, adding the time since the previous mark to it, and starts timing the next one.
+ *
+ * @param timer: A pointer to a started 'phase_timer' structure, or NULL to time nothing.
+ * @param phase: The phase that just ended.
+ */
+void phase_timer_end(phase_timer*, latency_phase);
+
+/**
+ * Adds a phase that happened inside the one being timed, such as a cache write in the middle of the transfer.
+ * Its time is taken out of the enclosing phase.
+ *
+ * @param timer: A pointer to a started 'phase_timer' structure, or NULL to ignore the phase.
+ * @param phase: The nested phase.
+ * @param started: When the nested phase started, as returned by timing_now.
+ */
+void phase_timer_add(phase_timer*, latency_phase, double);
+
+/**
+ * Adds the phases timed by another timer, such as those of a fetch made for a request.
+ *
+ * @param timer: A pointer to the 'phase_timer' structure to add to.
+ * @param other: A pointer to the timer whose phases are added.
+ */
+void phase_timer_merge(phase_timer*, const phase_timer*);
+
+/**
+ * Opens the stream the latencies of the single fetch and batch modes are written to.
+ *
+ * @param path: The file to write, or NULL for the standard error.
+ * @return The stream, or NULL if the file cannot be opened.
+ */
+FILE* open_timing_stream(const char*);
+
+/**
+ * Clears the histograms.
+ *
+ * @param stats: A pointer to the 'latency_stats' structure to initialize.
+ */
+void latency_stats_init(latency_stats*);
+
+/**
+ * Adds the phases of one request to the histograms.
+ *
+ * @param stats: A pointer to an initialized 'latency_stats' structure.
+ * @param timer: The timer of the request. Nothing is added if it timed no phase.
+ */
+void latency_stats_record(latency_stats*, const phase_timer*);
+
+/**
+ * Adds the histograms of another process or thread to a sum, such as those of every server worker.
+ *
+ * @param sum: A pointer to an initialized 'latency_stats' structure to add to.
+ * @param other: A pointer to the histograms that are added.
+ */
+void latency_stats_add(latency_stats*, const latency_stats*);
+
+/**
+ * Writes the histograms of every phase, with cumulative bucket counts.
+ *
+ * @param stream: The stream to write to.
+ * @param stats: A pointer to an initialized 'latency_stats' structure.
+ * @param format: TIMING_JSON or TIMING_PROMETHEUS.
+ */
+void latency_stats_write(FILE*, const latency_stats*, timing_format);
+
+/**
+ * Writes the phases of one request: a JSON object on one line, or one Prometheus sample per phase.
+ *
+ * @param stream: The stream to write to.
+ * @param timer: The timer of the request.
+ * @param url: The requested URL.
+ * @param result: The outcome of the request, such as "SAVED".
+ * @param format: TIMING_JSON or TIMING_PROMETHEUS.
+ */
+void phase_timer_write(FILE*, const phase_timer*, const char*, const char*, timing_format);
+
+
+#endif //CPROXY_LATENCY_STATS_H
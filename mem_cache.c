@@ -0,0 +1,197 @@
+#include "mem_cache.h"
+
+
+
+void mem_cache_init(mem_cache* cache, size_t budget)
+{
+    memset(cache, 0, sizeof(mem_cache));
+    cache->budget = budget;
+}
+
+
+static size_t hash_key(const char* key)
+{
+    // FNV-1a
+    size_t hash = 2166136261u;
+    for (const char* c = key; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    return hash % MEM_CACHE_BUCKETS;
+}
+
+
+static void unlink_lru(mem_cache* cache, mem_entry* entry)
+{
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+
+static void push_lru(mem_cache* cache, mem_entry* entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (cache->lru_tail == NULL)
+        cache->lru_tail = entry;
+}
+
+
+static mem_entry* find_entry(mem_cache* cache, const char* key)
+{
+    for (mem_entry* entry = cache->buckets[hash_key(key)]; entry != NULL; entry = entry->hash_next)
+        if (strcmp(entry->key, key) == 0)
+            return entry;
+    return NULL;
+}
+
+
+static void remove_entry(mem_cache* cache, mem_entry* entry)
+{
+    for (mem_entry** link = &cache->buckets[hash_key(entry->key)]; *link != NULL; link = &(*link)->hash_next)
+    {
+        if (*link == entry)
+        {
+            *link = entry->hash_next;
+            break;
+        }
+    }
+
+    unlink_lru(cache, entry);
+    cache->used -= entry->size;
+    cache->entries--;
+
+    // Clients still sending it keep it alive
+    mem_cache_release(entry);
+}
+
+
+mem_entry* mem_cache_lookup(mem_cache* cache, full_URL* my_url)
+{
+    if (cache->budget == 0)
+        return NULL;
+
+    char* key = cache_key(my_url);
+    if (key == NULL)
+        return NULL;
+
+    mem_entry* entry = find_entry(cache, key);
+    free(key);
+
+    // A stale response goes through the disk cache, which revalidates it
+    if (entry == NULL || entry->expires_at <= time(NULL))
+    {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    unlink_lru(cache, entry);
+    push_lru(cache, entry);
+    entry->refs++;
+    return entry;
+}
+
+
+mem_entry* mem_cache_insert_file(mem_cache* cache, full_URL* my_url, int fd, size_t file_size,
+                                 const cache_metadata* metadata)
+{
+    // Same header as responses served from the disk
+    char header[256];
+    int header_length = format_cached_header(header, sizeof(header), file_size, metadata->encoding);
+
+    size_t size = header_length + file_size;
+    if (cache->budget == 0 || file_size > MAX_MEMORY_OBJECT_SIZE || size > cache->budget)
+        return NULL;
+
+    mem_entry* entry = (mem_entry*)calloc(1, sizeof(mem_entry));
+    if (entry == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return NULL;
+    }
+
+    entry->key = cache_key(my_url);
+    entry->data = (char*)malloc(size);
+    if (entry->key == NULL || entry->data == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        free(entry->key);
+        free(entry->data);
+        free(entry);
+        return NULL;
+    }
+
+    memcpy(entry->data, header, header_length);
+
+    size_t loaded = 0;
+    while (loaded < file_size)
+    {
+        ssize_t read_size = pread(fd, entry->data + header_length + loaded, file_size - loaded, loaded);
+        if (read_size <= 0)
+        {
+            // The file changed meanwhile, leave it to the disk path
+            free(entry->key);
+            free(entry->data);
+            free(entry);
+            return NULL;
+        }
+        loaded += read_size;
+    }
+
+    entry->size = size;
+    entry->expires_at = metadata->expires_at;
+    entry->encoding = metadata->encoding;
+    entry->refs = 2; // One for the cache, one for the caller
+
+    // A newer copy replaces the old one
+    mem_entry* old = find_entry(cache, entry->key);
+    if (old != NULL)
+        remove_entry(cache, old);
+
+    // Evict the least recently used responses until the new one fits
+    while (cache->used + size > cache->budget && cache->lru_tail != NULL)
+    {
+        remove_entry(cache, cache->lru_tail);
+        cache->evictions++;
+    }
+
+    size_t bucket = hash_key(entry->key);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    push_lru(cache, entry);
+    cache->used += size;
+    cache->entries++;
+    cache->insertions++;
+
+    return entry;
+}
+
+
+void mem_cache_release(mem_entry* entry)
+{
+    if (entry == NULL || --entry->refs > 0)
+        return;
+
+    free(entry->key);
+    free(entry->data);
+    free(entry);
+}
+
+
+void mem_cache_close(mem_cache* cache)
+{
+    while (cache->lru_tail != NULL)
+        remove_entry(cache, cache->lru_tail);
+}
@@ -0,0 +1,86 @@
+#ifndef CPROXY_MEM_CACHE_H
+#define CPROXY_MEM_CACHE_H
+
+
+#include "cproxy.h"
+#include "cache_store.h"
+#include "content_coding.h"
+
+
+#define MEM_CACHE_BUCKETS 4096 // Number of hash buckets of the memory cache
+#define DEFAULT_MEMORY_CACHE_SIZE (64 * 1024 * 1024) // Default byte budget of the memory cache
+#define MAX_MEMORY_OBJECT_SIZE (1024 * 1024) // Largest response kept in memory
+
+typedef struct mem_entry{
+    char* key; // Normalized URL, as built by cache_key
+    char* data; // Complete response: header and body
+    size_t size; // Size of data
+    time_t expires_at; // When the response becomes stale, in seconds since the epoch
+    content_encoding encoding; // Coding of the body, only sent to clients that accept it
+    int refs; // Clients still sending data, plus one while the entry is cached
+    struct mem_entry* hash_next; // Next entry in the same bucket
+    struct mem_entry* lru_prev; // More recently used entry
+    struct mem_entry* lru_next; // Less recently used entry
+} mem_entry;
+
+typedef struct{
+    mem_entry* buckets[MEM_CACHE_BUCKETS]; // Entries hashed by key
+    mem_entry* lru_head; // Most recently used entry
+    mem_entry* lru_tail; // Least recently used entry, evicted first
+    size_t budget; // Maximum total size of the cached responses, 0 disables the cache
+    size_t used; // Total size of the cached responses
+    size_t entries; // Number of cached responses
+    unsigned long hits; // Lookups answered from memory
+    unsigned long misses; // Lookups that had to go to the disk or the origin, including stale responses
+    unsigned long insertions; // Responses added
+    unsigned long evictions; // Responses evicted to stay within the budget
+} mem_cache;
+
+
+/**
+ * Initializes an empty memory cache.
+ *
+ * @param cache: A pointer to the 'mem_cache' structure to initialize.
+ * @param budget: The maximum total size of the cached responses, 0 to disable the cache.
+ */
+void mem_cache_init(mem_cache*, size_t);
+
+/**
+ * Looks up the fresh response of a URL and marks it as most recently used.
+ *
+ * @param cache: A pointer to an initialized 'mem_cache' structure.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @return The entry, referenced for the caller who must pass it to mem_cache_release,
+ *         or NULL on a miss or if the response is stale.
+ */
+mem_entry* mem_cache_lookup(mem_cache*, full_URL*);
+
+/**
+ * Loads a cached file and stores it as a complete response, evicting the least recently used responses as needed.
+ *
+ * @param cache: A pointer to an initialized 'mem_cache' structure.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param fd: The descriptor of the cached file.
+ * @param file_size: The size of the cached file.
+ * @param metadata: The freshness and coding of the cached file.
+ * @return The new entry, referenced for the caller who must pass it to mem_cache_release,
+ *         or NULL if the response is too large for the cache or loading it failed.
+ */
+mem_entry* mem_cache_insert_file(mem_cache*, full_URL*, int, size_t, const cache_metadata*);
+
+/**
+ * Releases a reference returned by mem_cache_lookup or mem_cache_insert_file.
+ *
+ * @param entry: The entry to release. It is freed once evicted and released by every client.
+ */
+void mem_cache_release(mem_entry*);
+
+/**
+ * Frees every cached response. Entries still referenced are freed when released.
+ *
+ * @param cache: A pointer to an initialized 'mem_cache' structure.
+ */
+void mem_cache_close(mem_cache*);
+
+
+#endif //CPROXY_MEM_CACHE_H
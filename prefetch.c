@@ -0,0 +1,569 @@
+#include "prefetch.h"
+
+
+
+static char lowercase(char c)
+{
+    return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+
+static int is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+
+static int is_letter(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+
+static int name_is(const char* name, size_t length, const char* expected)
+{
+    return length == strlen(expected) && memcmp(name, expected, length) == 0;
+}
+
+
+void link_scanner_init(link_scanner* scanner)
+{
+    memset(scanner, 0, sizeof(link_scanner));
+    scanner->state = SCAN_TEXT;
+}
+
+
+static void start_tag(link_scanner* scanner)
+{
+    scanner->tag_length = 0;
+    scanner->link_length = 0;
+    scanner->link_overflow = 0;
+    scanner->has_link = 0;
+    scanner->rel_length = 0;
+}
+
+
+static void append_name(char* name, size_t* length, char c)
+{
+    // Names longer than the buffer never match the short ones looked for, only their length must stay right
+    if (*length < MAX_TAG_NAME)
+        name[*length] = lowercase(c);
+    (*length)++;
+}
+
+
+static void start_attribute(link_scanner* scanner, char c)
+{
+    scanner->attribute_length = 0;
+    append_name(scanner->attribute, &scanner->attribute_length, c);
+    scanner->state = SCAN_ATTRIBUTE_NAME;
+}
+
+
+static void start_value(link_scanner* scanner, char quote)
+{
+    const char* attribute = scanner->attribute;
+    size_t attribute_length = scanner->attribute_length;
+    int is_link_tag = name_is(scanner->tag, scanner->tag_length, "link");
+
+    // The href of an anchor is a page the user may never open, only what the page loads is fetched ahead
+    scanner->kind = VALUE_IGNORED;
+    if (name_is(attribute, attribute_length, "src") || (is_link_tag && name_is(attribute, attribute_length, "href")))
+    {
+        scanner->kind = VALUE_LINK;
+        scanner->link_length = 0;
+        scanner->link_overflow = 0;
+        scanner->has_link = 0;
+    }
+    else if (is_link_tag && name_is(attribute, attribute_length, "rel"))
+    {
+        scanner->kind = VALUE_REL;
+        scanner->rel_length = 0;
+    }
+
+    scanner->quote = quote;
+    scanner->state = SCAN_VALUE;
+}
+
+
+static void append_value(link_scanner* scanner, char c)
+{
+    if (scanner->kind == VALUE_LINK)
+    {
+        if (scanner->link_length < MAX_LINK_LENGTH)
+            scanner->link[scanner->link_length++] = c;
+        else
+            scanner->link_overflow = 1;
+    }
+    else if (scanner->kind == VALUE_REL && scanner->rel_length < sizeof(scanner->rel))
+        scanner->rel[scanner->rel_length++] = lowercase(c);
+}
+
+
+static void end_value(link_scanner* scanner)
+{
+    if (scanner->kind == VALUE_LINK)
+        scanner->has_link = !scanner->link_overflow && scanner->link_length > 0;
+    scanner->state = SCAN_IN_TAG;
+}
+
+
+static int rel_is_subresource(const char* rel, size_t length)
+{
+    static const char* const subresources[] = {"stylesheet", "icon", "preload", "modulepreload", "prefetch",
+                                               "manifest", "apple-touch-icon"};
+
+    // rel is a list of tokens
+    size_t start = 0;
+    while (start < length)
+    {
+        size_t end = start;
+        while (end < length && !is_space(rel[end]))
+            end++;
+
+        for (size_t i = 0; i < sizeof(subresources) / sizeof(subresources[0]); i++)
+            if (name_is(rel + start, end - start, subresources[i]))
+                return 1;
+
+        start = end + 1;
+    }
+
+    return 0;
+}
+
+
+static void end_tag(link_scanner* scanner, link_handler handler, void* ctx)
+{
+    // The whole tag was seen, so the rel of a link element is known whatever the order of its attributes
+    if (scanner->has_link && (!name_is(scanner->tag, scanner->tag_length, "link") ||
+                              rel_is_subresource(scanner->rel, scanner->rel_length)))
+        handler(scanner->link, scanner->link_length, ctx);
+
+    // The content of scripts and styles is not markup, a '<' there starts no tag
+    int raw_text = name_is(scanner->tag, scanner->tag_length, "script") ||
+                   name_is(scanner->tag, scanner->tag_length, "style");
+    scanner->raw_matched = 0;
+    scanner->state = raw_text ? SCAN_RAW_TEXT : SCAN_TEXT;
+}
+
+
+static void scan_raw_text(link_scanner* scanner, char c)
+{
+    // Only the end tag of the element ends it: "</script" or "</style", in any case
+    size_t end_length = 2 + scanner->tag_length;
+    char expected = scanner->raw_matched < 2 ? "</"[scanner->raw_matched] : scanner->tag[scanner->raw_matched - 2];
+
+    if (lowercase(c) == expected)
+    {
+        if (++scanner->raw_matched == end_length)
+            scanner->state = SCAN_SKIP_TAG;
+    }
+    else
+        scanner->raw_matched = c == '<' ? 1 : 0;
+}
+
+
+void link_scanner_feed(link_scanner* scanner, const char* data, size_t length, link_handler handler, void* ctx)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = data[i];
+
+        switch (scanner->state)
+        {
+            case SCAN_TEXT:
+                if (c == '<')
+                    scanner->state = SCAN_TAG_OPEN;
+                break;
+
+            case SCAN_TAG_OPEN:
+                if (is_letter(c))
+                {
+                    start_tag(scanner);
+                    append_name(scanner->tag, &scanner->tag_length, c);
+                    scanner->state = SCAN_TAG_NAME;
+                }
+                else if (c == '!')
+                {
+                    scanner->dashes = 0;
+                    scanner->state = SCAN_MARKUP;
+                }
+                else if (c == '/' || c == '?')
+                    scanner->state = SCAN_SKIP_TAG;
+                else if (c != '<')
+                    scanner->state = SCAN_TEXT;
+                break;
+
+            case SCAN_TAG_NAME:
+                if (c == '>')
+                    end_tag(scanner, handler, ctx);
+                else if (is_space(c) || c == '/')
+                    scanner->state = SCAN_IN_TAG;
+                else
+                    append_name(scanner->tag, &scanner->tag_length, c);
+                break;
+
+            case SCAN_IN_TAG:
+                if (c == '>')
+                    end_tag(scanner, handler, ctx);
+                else if (!is_space(c) && c != '/')
+                    start_attribute(scanner, c);
+                break;
+
+            case SCAN_ATTRIBUTE_NAME:
+                if (c == '>')
+                    end_tag(scanner, handler, ctx);
+                else if (c == '=')
+                    scanner->state = SCAN_BEFORE_VALUE;
+                else if (is_space(c))
+                    scanner->state = SCAN_AFTER_ATTRIBUTE_NAME;
+                else if (c == '/')
+                    scanner->state = SCAN_IN_TAG;
+                else
+                    append_name(scanner->attribute, &scanner->attribute_length, c);
+                break;
+
+            case SCAN_AFTER_ATTRIBUTE_NAME:
+                if (c == '>')
+                    end_tag(scanner, handler, ctx);
+                else if (c == '=')
+                    scanner->state = SCAN_BEFORE_VALUE;
+                else if (!is_space(c))
+                    start_attribute(scanner, c);
+                break;
+
+            case SCAN_BEFORE_VALUE:
+                if (c == '>')
+                    end_tag(scanner, handler, ctx);
+                else if (c == '"' || c == '\'')
+                    start_value(scanner, c);
+                else if (!is_space(c))
+                {
+                    start_value(scanner, 0);
+                    append_value(scanner, c);
+                }
+                break;
+
+            case SCAN_VALUE:
+                if (scanner->quote != 0 ? c == scanner->quote : is_space(c))
+                    end_value(scanner);
+                else if (scanner->quote == 0 && c == '>')
+                {
+                    end_value(scanner);
+                    end_tag(scanner, handler, ctx);
+                }
+                else
+                    append_value(scanner, c);
+                break;
+
+            case SCAN_MARKUP:
+                // "<!--" starts a comment, anything else is a declaration such as the doctype
+                if (c == '-' && ++scanner->dashes == 2)
+                {
+                    scanner->dashes = 0;
+                    scanner->state = SCAN_COMMENT;
+                }
+                else if (c == '>')
+                    scanner->state = SCAN_TEXT;
+                else if (c != '-')
+                    scanner->state = SCAN_SKIP_TAG;
+                break;
+
+            case SCAN_COMMENT:
+                if (c == '>' && scanner->dashes >= 2)
+                    scanner->state = SCAN_TEXT;
+                else
+                    scanner->dashes = c == '-' ? scanner->dashes + 1 : 0;
+                break;
+
+            case SCAN_SKIP_TAG:
+                if (c == '>')
+                    scanner->state = SCAN_TEXT;
+                break;
+
+            case SCAN_RAW_TEXT:
+                scan_raw_text(scanner, c);
+                break;
+        }
+    }
+}
+
+
+static size_t remove_dot_segments(char* path, size_t length)
+{
+    // Segments are copied down one at a time; "." is dropped and ".." drops the segment before it
+    size_t out = 0;
+    size_t in = 0;
+
+    while (in < length)
+    {
+        size_t end = in + 1;
+        while (end < length && path[end] != '/')
+            end++;
+
+        const char* segment = path + in + 1; // After its slash
+        size_t segment_length = end - in - 1;
+
+        if (name_is(segment, segment_length, ".") || name_is(segment, segment_length, ".."))
+        {
+            if (segment_length == 2)
+                while (out > 0 && path[--out] != '/')
+                    ;
+
+            // A trailing dot segment still names a directory
+            if (end == length)
+                path[out++] = '/';
+        }
+        else
+        {
+            memmove(path + out, path + in, end - in);
+            out += end - in;
+        }
+
+        in = end;
+    }
+
+    if (out == 0)
+        path[out++] = '/';
+    return out;
+}
+
+
+static size_t clean_link(const char* link, size_t length, char* clean)
+{
+    while (length > 0 && is_space(*link))
+    {
+        link++;
+        length--;
+    }
+    while (length > 0 && is_space(link[length - 1]))
+        length--;
+
+    // Attribute values escape '&' in query strings, other character references are left as written
+    size_t clean_length = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        clean[clean_length++] = link[i];
+        if (link[i] == '&' && length - i >= 5 && memcmp(link + i, "&amp;", 5) == 0)
+            i += 4;
+    }
+
+    clean[clean_length] = '\0';
+    return clean_length;
+}
+
+
+static int scheme_length(const char* link)
+{
+    // A scheme is a letter followed by letters, digits, '+', '-' or '.', and ends with ':'
+    if (!is_letter(link[0]))
+        return -1;
+
+    int length = 1;
+    while (is_letter(link[length]) || (link[length] >= '0' && link[length] <= '9') || link[length] == '+' ||
+           link[length] == '-' || link[length] == '.')
+        length++;
+
+    return link[length] == ':' ? length : -1;
+}
+
+
+char* resolve_link(const full_URL* page, const char* link, size_t length)
+{
+    char* clean = (char*)malloc(length + 1);
+    if (clean == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return NULL;
+    }
+
+    size_t clean_length = clean_link(link, length, clean);
+    if (clean_length == 0 || clean[0] == '#')
+    {
+        free(clean);
+        return NULL;
+    }
+
+    // Only http links are fetched: javascript:, data:, mailto: and https: links are skipped
+    int scheme = scheme_length(clean);
+    if (scheme != -1 && (scheme != 4 || strncasecmp(clean, "http", 4) != 0))
+    {
+        free(clean);
+        return NULL;
+    }
+
+    size_t host_length = strlen(page->host_header);
+    size_t path_length = strlen(page->path);
+    char* url = (char*)malloc(strlen("http://") + host_length + path_length + clean_length + 1);
+    if (url == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        free(clean);
+        return NULL;
+    }
+
+    size_t url_length = 0;
+    if (scheme != -1)
+    {
+        // Schemes are case-insensitive
+        memcpy(url, "http", strlen("http"));
+        memcpy(url + strlen("http"), clean + strlen("http"), clean_length - strlen("http"));
+        url_length = clean_length;
+    }
+    else if (clean[0] == '/' && clean[1] == '/')
+    {
+        memcpy(url, "http:", strlen("http:"));
+        memcpy(url + strlen("http:"), clean, clean_length);
+        url_length = strlen("http:") + clean_length;
+    }
+    else
+    {
+        memcpy(url, "http://", strlen("http://"));
+        memcpy(url + strlen("http://"), page->host_header, host_length);
+        url_length = strlen("http://") + host_length;
+
+        // A relative link replaces the last segment of the page path, or only its query string
+        if (clean[0] != '/')
+        {
+            size_t base_length = strcspn(page->path, "?");
+            if (clean[0] != '?')
+                while (base_length > 0 && page->path[base_length - 1] != '/')
+                    base_length--;
+            memcpy(url + url_length, page->path, base_length);
+            url_length += base_length;
+        }
+
+        memcpy(url + url_length, clean, clean_length);
+        url_length += clean_length;
+    }
+    url[url_length] = '\0';
+    free(clean);
+
+    // The fragment is never sent, and "." and ".." segments are resolved here since origins may not
+    url_length = strcspn(url, "#");
+    url[url_length] = '\0';
+    char* path = url + strlen("http://") + strcspn(url + strlen("http://"), "/?");
+    if (*path == '/')
+    {
+        size_t segments_length = strcspn(path, "?");
+        size_t query_length = strlen(path + segments_length);
+        size_t resolved_length = remove_dot_segments(path, segments_length);
+        memmove(path + resolved_length, path + segments_length, query_length + 1);
+    }
+
+    full_URL* target = parse_URL(url);
+    int same_origin = target != NULL && strcasecmp(target->host, page->host) == 0 && target->port == page->port &&
+                      strcmp(target->key, page->key) != 0;
+    free_full_URL(target);
+
+    if (!same_origin)
+    {
+        free(url);
+        return NULL;
+    }
+
+    return url;
+}
+
+
+typedef struct{
+    full_URL* page; // Page the links are found in
+    char** links; // Distinct resolved links
+    size_t count; // Number of links
+    size_t limit; // Maximum number of links
+} link_list;
+
+
+static void collect_link(const char* link, size_t length, void* ctx)
+{
+    link_list* list = (link_list*)ctx;
+    if (list->count == list->limit)
+        return;
+
+    char* url = resolve_link(list->page, link, length);
+    if (url == NULL)
+        return;
+
+    // Pages load the same stylesheets and icons more than once, and the limit is small
+    for (size_t i = 0; i < list->count; i++)
+    {
+        if (strcmp(list->links[i], url) == 0)
+        {
+            free(url);
+            return;
+        }
+    }
+
+    list->links[list->count++] = url;
+}
+
+
+ssize_t prefetch_collect(full_URL* page, size_t limit, char*** links)
+{
+    *links = NULL;
+
+    off_t object_size;
+    cache_metadata metadata;
+    int fd = cache_store_open_object(page, &object_size, &metadata);
+    if (fd == -1)
+        return -1;
+
+    link_list list = {page, NULL, 0, limit};
+    if (limit > 0)
+    {
+        list.links = (char**)malloc(limit * sizeof(char*));
+        if (list.links == NULL)
+        {
+            fprintf(stderr, "Malloc failed\n");
+            close(fd);
+            return -1;
+        }
+    }
+
+    link_scanner scanner;
+    link_scanner_init(&scanner);
+
+    body_decoder decoder;
+    int compressed = metadata.encoding == ENCODING_GZIP || metadata.encoding == ENCODING_DEFLATE;
+    if (compressed)
+        body_decoder_init(&decoder, (content_encoding)metadata.encoding, fd, object_size);
+
+    // The page is read back from the cache file, the body was moved to it without passing through user space
+    char buffer[READ_BUFFER_SIZE * 4];
+    size_t scanned = 0;
+    while (scanned < PREFETCH_SCAN_LIMIT && list.count < limit &&
+           (compressed || (off_t)scanned < object_size))
+    {
+        ssize_t read_bytes = compressed ? body_decoder_read(&decoder, buffer, sizeof(buffer))
+                                        : pread(fd, buffer, sizeof(buffer), scanned);
+        if (read_bytes <= 0)
+            break;
+
+        link_scanner_feed(&scanner, buffer, read_bytes, collect_link, &list);
+        scanned += read_bytes;
+    }
+
+    if (compressed)
+        body_decoder_close(&decoder);
+    close(fd);
+
+    if (list.count == 0)
+    {
+        free(list.links);
+        list.links = NULL;
+    }
+
+    *links = list.links;
+    return (ssize_t)list.count;
+}
+
+
+void free_links(char** links, size_t count)
+{
+    if (links == NULL)
+        return;
+
+    for (size_t i = 0; i < count; i++)
+        free(links[i]);
+    free(links);
+}
@@ -0,0 +1,112 @@
+#ifndef CPROXY_PREFETCH_H
+#define CPROXY_PREFETCH_H
+
+
+#include "cproxy.h"
+#include <strings.h>
+#include "cache_store.h"
+#include "content_coding.h"
+
+
+#define MAX_LINK_LENGTH 2048 // Longest attribute value kept as a link, longer ones are skipped
+#define MAX_TAG_NAME 16 // Tag and attribute names are compared on this many bytes at most
+#define PREFETCH_SCAN_LIMIT (4 * 1024 * 1024) // Decoded bytes of a page searched for links
+#define DEFAULT_PREFETCH_DEPTH 1 // Default number of link levels followed from a requested page
+
+typedef enum{
+    SCAN_TEXT, // Between tags
+    SCAN_TAG_OPEN, // After '<'
+    SCAN_TAG_NAME, // Reading the name of a start tag
+    SCAN_IN_TAG, // Between the attributes of a start tag
+    SCAN_ATTRIBUTE_NAME, // Reading an attribute name
+    SCAN_AFTER_ATTRIBUTE_NAME, // After an attribute name, an '=' may follow
+    SCAN_BEFORE_VALUE, // After '=', waiting for the value
+    SCAN_VALUE, // Reading an attribute value, quoted or not
+    SCAN_MARKUP, // After "<!", a comment if two dashes follow
+    SCAN_COMMENT, // Inside a comment, up to "-->"
+    SCAN_SKIP_TAG, // Inside an end tag, a declaration or a processing instruction, up to '>'
+    SCAN_RAW_TEXT // Inside a script or style element, up to its end tag
+} scan_state;
+
+typedef enum{
+    VALUE_IGNORED, // The value of the attribute is not needed
+    VALUE_LINK, // src, or href of a link element: a subresource URL
+    VALUE_REL // rel of a link element, which tells whether its href is a subresource
+} value_kind;
+
+// Finds the subresource URLs of an HTML document fed in arbitrary pieces, without buffering the document
+typedef struct{
+    scan_state state; // Position in the markup
+    char tag[MAX_TAG_NAME]; // Lowercase name of the current tag, truncated
+    size_t tag_length; // Bytes of the tag name read
+    char attribute[MAX_TAG_NAME]; // Lowercase name of the current attribute, truncated
+    size_t attribute_length; // Bytes of the attribute name read
+    value_kind kind; // What the current attribute value is
+    char quote; // Quote closing the current value, or 0 if it is unquoted
+    char link[MAX_LINK_LENGTH]; // Subresource URL of the current tag, as written
+    size_t link_length; // Bytes of the link read
+    int link_overflow; // 1 if the link did not fit in link and is skipped
+    int has_link; // 1 once the current tag has a complete link
+    char rel[64]; // rel value of the current tag, truncated
+    size_t rel_length; // Bytes of the rel value read
+    int dashes; // Consecutive dashes seen, to find the start and end of comments
+    size_t raw_matched; // Bytes of "</script" or "</style" matched inside a raw text element
+} link_scanner;
+
+// Called with every subresource link found, as written in the document, not null-terminated
+typedef void (*link_handler)(const char*, size_t, void*);
+
+
+/**
+ * Initializes a scanner at the start of a document.
+ *
+ * @param scanner: A pointer to the 'link_scanner' structure to initialize.
+ */
+void link_scanner_init(link_scanner*);
+
+/**
+ * Scans the next part of a document for the src attributes of any element and the href attributes of the link
+ * elements that load a subresource (stylesheets, icons, preloads). Links inside comments, scripts and styles are
+ * skipped. A tag may be split anywhere across calls.
+ *
+ * @param scanner: A pointer to an initialized 'link_scanner' structure.
+ * @param data: The next bytes of the document.
+ * @param length: The number of bytes in data.
+ * @param handler: Called with each link once its tag ended.
+ * @param ctx: The context passed to the handler.
+ */
+void link_scanner_feed(link_scanner*, const char*, size_t, link_handler, void*);
+
+/**
+ * Resolves a link found in a page against the URL of the page: absolute, protocol-relative, root-relative and
+ * relative links are accepted. "&amp;" is decoded, the fragment dropped and the dot segments of the path removed.
+ *
+ * @param page: A pointer to the 'full_URL' structure of the page.
+ * @param link: The link as written in the page, not null-terminated.
+ * @param length: The length of the link.
+ * @return The newly allocated absolute URL, or NULL if the link is not an http URL of the same origin as the page,
+ *         points back to the page, or memory allocation fails.
+ */
+char* resolve_link(const full_URL*, const char*, size_t);
+
+/**
+ * Finds the same-origin subresources of a page saved to the cache. Compressed pages are decoded as they are read,
+ * and at most PREFETCH_SCAN_LIMIT decoded bytes are searched.
+ *
+ * @param page: A pointer to the 'full_URL' structure of the cached page.
+ * @param limit: The maximum number of URLs to return.
+ * @param links: Set to a newly allocated array of distinct absolute URLs, in document order, or NULL if none.
+ * @return The number of URLs in links, or -1 if the page is not cached or memory allocation fails.
+ */
+ssize_t prefetch_collect(full_URL*, size_t, char***);
+
+/**
+ * Frees the URLs returned by prefetch_collect.
+ *
+ * @param links: The array of URLs. It can be NULL.
+ * @param count: The number of URLs in the array.
+ */
+void free_links(char**, size_t);
+
+
+#endif //CPROXY_PREFETCH_H
@@ -0,0 +1,271 @@
+#include "range_fetch.h"
+
+
+
+static double elapsed_since(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+
+static int send_range_request(full_URL* my_url, const char* headers)
+{
+    // The ranges run in parallel, so their phases are not timed one by one
+    int sd = start_connection(my_url, 0, NULL);
+    if (sd == -1)
+        return -1;
+
+    size_t request_length;
+    char* request = build_request(my_url, 0, headers, &request_length);
+    if (request == NULL || write_all(sd, request, request_length) == -1)
+    {
+        free(request);
+        close(sd);
+        return -1;
+    }
+
+    free(request);
+    return sd;
+}
+
+
+static int probe_object(full_URL* my_url, http_response* probe)
+{
+    // The first byte alone tells whether ranges are supported, and Content-Range gives the size
+    int sd = send_range_request(my_url, "Range: bytes=0-0\r\n");
+    if (sd == -1)
+        return -1;
+
+    response_init(probe, my_url);
+
+    char buffer[READ_BUFFER_SIZE];
+    while (!probe->header_end_found)
+    {
+        ssize_t read_bytes = read(sd, buffer, sizeof(buffer));
+        if (read_bytes < 0 && errno == EINTR)
+            continue;
+        if (read_bytes <= 0)
+            break;
+
+        parse_response_header(probe, buffer, read_bytes);
+    }
+
+    close(sd);
+    // A probe whose length cannot be trusted is not split into ranges
+    return probe->header_end_found && !probe->malformed ? 0 : -1;
+}
+
+
+static ssize_t pwrite_all(int fd, const char* data, size_t length, off_t offset)
+{
+    size_t total_written_bytes = 0;
+
+    while (total_written_bytes < length)
+    {
+        ssize_t wrote_bytes = pwrite(fd, data + total_written_bytes, length - total_written_bytes,
+                                     offset + total_written_bytes);
+        if (wrote_bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        total_written_bytes += wrote_bytes;
+    }
+
+    return (ssize_t)total_written_bytes;
+}
+
+
+static int range_matches(byte_range* range, http_response* response)
+{
+    // A 200 means the object changed since the probe (If-Range) or the origin ignored the Range header
+    return response->status_code == 206 && !response->chunked && !response->malformed &&
+           response->range_start == range->start && response->range_end == range->end &&
+           (content_encoding)response->metadata.encoding == range->encoding;
+}
+
+
+static void* download_range(void* arg)
+{
+    byte_range* range = (byte_range*)arg;
+
+    char headers[256];
+    snprintf(headers, sizeof(headers), "Range: bytes=%ld-%ld\r\n%s", range->start, range->end, range->if_range);
+
+    int sd = send_range_request(range->url, headers);
+    if (sd == -1)
+        return NULL;
+
+    http_response response;
+    response_init(&response, range->url);
+
+    char* buffer = (char*)malloc(RANGE_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        close(sd);
+        return NULL;
+    }
+
+    off_t offset = range->start;
+    while (offset <= range->end)
+    {
+        ssize_t read_bytes = read(sd, buffer, RANGE_BUFFER_SIZE);
+        if (read_bytes < 0 && errno == EINTR)
+            continue;
+        if (read_bytes <= 0)
+            break; // Cut short
+
+        const char* body = buffer;
+        size_t body_length = read_bytes;
+        if (!response.header_end_found)
+        {
+            size_t header_length = parse_response_header(&response, buffer, read_bytes);
+            if (!response.header_end_found)
+                continue;
+
+            if (!range_matches(range, &response))
+                break;
+
+            body += header_length;
+            body_length -= header_length;
+        }
+
+        // Each range goes straight to its own part of the file
+        if (body_length > (size_t)(range->end + 1 - offset))
+            body_length = range->end + 1 - offset;
+
+        if (pwrite_all(range->fd, body, body_length, offset) == -1)
+        {
+            perror("pwrite\n");
+            break;
+        }
+
+        offset += body_length;
+    }
+
+    range->done = offset > range->end;
+
+    free(buffer);
+    close(sd);
+    return NULL;
+}
+
+
+static void format_if_range(http_response* probe, char* if_range, size_t size)
+{
+    if_range[0] = '\0';
+
+    // Every range must come from the same version of the object; If-Range only takes a strong ETag
+    if (probe->metadata.etag[0] == '"')
+        snprintf(if_range, size, "If-Range: %s\r\n", probe->metadata.etag);
+    else if (probe->metadata.last_modified != 0)
+    {
+        time_t last_modified = (time_t)probe->metadata.last_modified;
+        struct tm date_info;
+        char date[64];
+        gmtime_r(&last_modified, &date_info);
+        strftime(date, sizeof(date), HTTP_DATE_FORMAT, &date_info);
+        snprintf(if_range, size, "If-Range: %s\r\n", date);
+    }
+}
+
+
+static int download_ranges(full_URL* my_url, http_response* probe, int connections, int fd)
+{
+    long total = probe->range_total;
+
+    // The file gets its final size first, so the ranges can be written in any order
+    if (ftruncate(fd, total) == -1)
+    {
+        perror("ftruncate\n");
+        close(fd);
+        return 0;
+    }
+
+    char if_range[128];
+    format_if_range(probe, if_range, sizeof(if_range));
+
+    byte_range ranges[MAX_RANGE_CONNECTIONS];
+    long range_size = total / connections;
+    int started = 0;
+
+    for (int i = 0; i < connections; i++)
+    {
+        byte_range* range = &ranges[i];
+        range->url = my_url;
+        range->fd = fd;
+        range->start = i * range_size;
+        range->end = i == connections - 1 ? total - 1 : range->start + range_size - 1;
+        range->if_range = if_range;
+        range->encoding = (content_encoding)probe->metadata.encoding;
+        range->done = 0;
+
+        if (pthread_create(&range->thread, NULL, download_range, range) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+        started++;
+    }
+
+    int saved = started == connections;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(ranges[i].thread, NULL);
+        saved = saved && ranges[i].done;
+    }
+
+    close(fd);
+    return saved;
+}
+
+
+int range_fetch_download(full_URL* my_url, int connections)
+{
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    http_response probe;
+    if (probe_object(my_url, &probe) == -1)
+        return 0;
+
+    // Without ranges or a known size the object comes as a single stream, and so does what may not be cached
+    if (probe.status_code != 206 || probe.range_total <= 0 || !probe.cacheable)
+        return 0;
+
+    if (connections > MAX_RANGE_CONNECTIONS)
+        connections = MAX_RANGE_CONNECTIONS;
+    if (connections > probe.range_total / MIN_RANGE_SIZE)
+        connections = probe.range_total / MIN_RANGE_SIZE;
+    if (connections < 2)
+        return 0;
+
+    // The ranges land in a temporary file, so a download cut short never replaces the cached object
+    char* file_path;
+    int fd = cache_store_prepare(my_url, &file_path);
+    if (fd == -1)
+        return 0;
+
+    int saved = download_ranges(my_url, &probe, connections, fd);
+    if (saved && cache_store_commit(my_url, file_path, probe.range_total, &probe.metadata) == -1)
+        saved = 0;
+
+    // Progress notes are part of the full output only, written before the response bytes that follow
+    if (saved && options.output == OUTPUT_FULL)
+        dprintf(options.output_fd, "Downloaded %ld bytes over %d connections in %.1f ms\n", probe.range_total,
+                connections, elapsed_since(&started));
+    else if (!saved)
+    {
+        if (options.output == OUTPUT_FULL)
+            dprintf(options.output_fd, "Ranged download failed, fetching as a single stream\n");
+        unlink(file_path);
+    }
+
+    free(file_path);
+    return saved;
+}
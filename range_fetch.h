@@ -0,0 +1,40 @@
+#ifndef CPROXY_RANGE_FETCH_H
+#define CPROXY_RANGE_FETCH_H
+
+
+#include "cproxy.h"
+#include <pthread.h>
+#include <time.h>
+#include "response.h"
+#include "cache_store.h"
+
+
+#define MAX_RANGE_CONNECTIONS 64 // Most connections of one ranged download
+#define MIN_RANGE_SIZE (4 * 1024 * 1024) // Smallest byte range worth its own connection
+#define RANGE_BUFFER_SIZE (64 * 1024) // Bytes read from a range connection at a time
+
+typedef struct{
+    full_URL* url; // URL being downloaded
+    int fd; // Cache file the range is written into
+    long start; // First byte of the range
+    long end; // Last byte of the range
+    const char* if_range; // If-Range header line, or an empty string
+    content_encoding encoding; // Coding the probe reported, every range must have the same
+    int done; // 1 once the whole range was written
+    pthread_t thread; // Thread downloading the range
+} byte_range;
+
+
+/**
+ * Downloads a URL over several connections at once: probes the object size with a one-byte Range request,
+ * splits the object into byte ranges, fetches them concurrently and writes each at its offset of the cache file.
+ *
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ * @param connections: The maximum number of concurrent connections.
+ * @return 1 if the object was saved to the cache, or 0 if it must be fetched as a single stream:
+ *         the origin does not support ranges, the object is too small to split or may not be cached, or a range failed.
+ */
+int range_fetch_download(full_URL*, int);
+
+
+#endif //CPROXY_RANGE_FETCH_H
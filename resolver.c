@@ -0,0 +1,406 @@
+#include "resolver.h"
+
+
+
+int resolve_host(const char* host, resolved_addresses* result)
+{
+    struct addrinfo hints;
+    struct addrinfo* addresses;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC; // IPv4 and IPv6
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG; // Only families the machine has addresses for
+
+    result->count = 0;
+
+    int status = getaddrinfo(host, NULL, &hints, &addresses);
+    if (status != 0)
+        return status;
+
+    for (struct addrinfo* address = addresses; address != NULL && result->count < MAX_RESOLVED_ADDRESSES;
+         address = address->ai_next)
+    {
+        if (address->ai_family != AF_INET && address->ai_family != AF_INET6)
+            continue;
+
+        memcpy(&result->addresses[result->count], address->ai_addr, address->ai_addrlen);
+        result->lengths[result->count] = address->ai_addrlen;
+        result->count++;
+    }
+
+    freeaddrinfo(addresses);
+    return result->count > 0 ? 0 : EAI_NONAME;
+}
+
+
+void set_address_port(struct sockaddr_storage* address, int port)
+{
+    if (address->ss_family == AF_INET6)
+        ((struct sockaddr_in6*)address)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in*)address)->sin_port = htons(port);
+}
+
+
+static time_t monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+
+static size_t hash_host(const char* host)
+{
+    // FNV-1a over the lower-cased host name
+    size_t hash = 2166136261u;
+    for (const char* c = host; *c != '\0'; c++)
+    {
+        char lower = (*c >= 'A' && *c <= 'Z') ? (char)(*c - 'A' + 'a') : *c;
+        hash = (hash ^ (unsigned char)lower) * 16777619u;
+    }
+    return hash % RESOLVER_BUCKETS;
+}
+
+
+static resolver_entry* find_entry(resolver* dns, const char* host)
+{
+    for (resolver_entry* entry = dns->buckets[hash_host(host)]; entry != NULL; entry = entry->next)
+        if (strcasecmp(entry->host, host) == 0)
+            return entry;
+    return NULL;
+}
+
+
+static void remove_expired_entries(resolver* dns, time_t now)
+{
+    for (size_t bucket = 0; bucket < RESOLVER_BUCKETS; bucket++)
+    {
+        resolver_entry** link = &dns->buckets[bucket];
+        while (*link != NULL)
+        {
+            resolver_entry* entry = *link;
+            if (entry->expires <= now)
+            {
+                *link = entry->next;
+                free(entry->host);
+                free(entry);
+                dns->entries--;
+            }
+            else
+                link = &entry->next;
+        }
+    }
+}
+
+
+static void cache_result(resolver* dns, const char* host, const resolved_addresses* result)
+{
+    if (dns->ttl <= 0)
+        return;
+
+    time_t now = monotonic_seconds();
+    resolver_entry* entry = find_entry(dns, host);
+
+    if (entry == NULL)
+    {
+        if (dns->entries >= MAX_RESOLVER_ENTRIES)
+            remove_expired_entries(dns, now);
+        if (dns->entries >= MAX_RESOLVER_ENTRIES)
+            return; // Full of live entries, the host is simply resolved again next time
+
+        entry = (resolver_entry*)malloc(sizeof(resolver_entry));
+        if (entry == NULL)
+            return;
+
+        entry->host = strdup(host);
+        if (entry->host == NULL)
+        {
+            free(entry);
+            return;
+        }
+
+        size_t bucket = hash_host(host);
+        entry->next = dns->buckets[bucket];
+        dns->buckets[bucket] = entry;
+        dns->entries++;
+    }
+
+    entry->result = *result;
+    entry->expires = now + dns->ttl;
+}
+
+
+static void* run_resolver_thread(void* arg)
+{
+    resolver* dns = (resolver*)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&dns->lock);
+        while (dns->work_head == NULL && !dns->stopping)
+            pthread_cond_wait(&dns->work_ready, &dns->lock);
+
+        if (dns->stopping)
+        {
+            pthread_mutex_unlock(&dns->lock);
+            return NULL;
+        }
+
+        resolve_job* job = dns->work_head;
+        dns->work_head = job->next;
+        if (dns->work_head == NULL)
+            dns->work_tail = NULL;
+        pthread_mutex_unlock(&dns->lock);
+
+        // The slow part runs without the lock
+        job->status = resolve_host(job->host, &job->result);
+
+        pthread_mutex_lock(&dns->lock);
+        job->next = dns->done;
+        dns->done = job;
+        pthread_mutex_unlock(&dns->lock);
+
+        // Wake up the event loop
+        uint64_t one = 1;
+        if (write(dns->watcher.fd, &one, sizeof(one)) == -1)
+            perror("eventfd\n");
+    }
+}
+
+
+static void remove_pending(resolver* dns, resolve_job* job)
+{
+    for (resolve_job** link = &dns->pending; *link != NULL; link = &(*link)->next_pending)
+    {
+        if (*link == job)
+        {
+            *link = job->next_pending;
+            return;
+        }
+    }
+}
+
+
+static void handle_resolved(event_loop* loop, uint32_t events, void* ctx)
+{
+    (void)loop;
+    (void)events;
+    resolver* dns = (resolver*)ctx;
+    uint64_t count;
+
+    if (read(dns->watcher.fd, &count, sizeof(count)) != sizeof(count))
+        return;
+
+    pthread_mutex_lock(&dns->lock);
+    resolve_job* done = dns->done;
+    dns->done = NULL;
+    pthread_mutex_unlock(&dns->lock);
+
+    while (done != NULL)
+    {
+        resolve_job* job = done;
+        done = job->next;
+
+        remove_pending(dns, job);
+        if (job->status == 0)
+            cache_result(dns, job->host, &job->result);
+
+        // Handlers may cancel or start other queries, so detach each query before calling it
+        while (job->queries != NULL)
+        {
+            resolve_query* query = job->queries;
+            job->queries = query->next;
+            query->job = NULL;
+            query->next = NULL;
+            query->handler(query, job->status, &job->result);
+        }
+
+        free(job->host);
+        free(job);
+    }
+}
+
+
+int resolver_init(resolver* dns, event_loop* loop, long ttl)
+{
+    memset(dns->buckets, 0, sizeof(dns->buckets));
+    dns->loop = loop;
+    dns->entries = 0;
+    dns->ttl = ttl;
+    dns->pending = NULL;
+    dns->work_head = NULL;
+    dns->work_tail = NULL;
+    dns->done = NULL;
+    dns->stopping = 0;
+    dns->thread_count = 0;
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("eventfd\n");
+        return -1;
+    }
+
+    event_watcher_init(&dns->watcher, fd, handle_resolved, dns);
+    if (event_loop_add(loop, &dns->watcher, EPOLLIN) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&dns->lock, NULL);
+    pthread_cond_init(&dns->work_ready, NULL);
+
+    for (int i = 0; i < RESOLVER_THREADS; i++)
+    {
+        if (pthread_create(&dns->threads[i], NULL, run_resolver_thread, dns) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            resolver_close(dns);
+            return -1;
+        }
+        dns->thread_count++;
+    }
+
+    return 0;
+}
+
+
+resolve_status resolver_lookup(resolver* dns, const char* host, resolve_query* query)
+{
+    query->job = NULL;
+    query->next = NULL;
+
+    // Fresh cached addresses skip resolution entirely
+    resolver_entry* entry = find_entry(dns, host);
+    if (entry != NULL && entry->expires > monotonic_seconds())
+    {
+        query->result = entry->result;
+        return RESOLVE_DONE;
+    }
+
+    // Join a lookup of the same host that is already in progress
+    for (resolve_job* job = dns->pending; job != NULL; job = job->next_pending)
+    {
+        if (strcasecmp(job->host, host) == 0)
+        {
+            query->job = job;
+            query->next = job->queries;
+            job->queries = query;
+            return RESOLVE_PENDING;
+        }
+    }
+
+    resolve_job* job = (resolve_job*)calloc(1, sizeof(resolve_job));
+    if (job == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return RESOLVE_FAILED;
+    }
+
+    job->host = strdup(host);
+    if (job->host == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        free(job);
+        return RESOLVE_FAILED;
+    }
+
+    job->queries = query;
+    query->job = job;
+    job->next_pending = dns->pending;
+    dns->pending = job;
+
+    pthread_mutex_lock(&dns->lock);
+    if (dns->work_tail != NULL)
+        dns->work_tail->next = job;
+    else
+        dns->work_head = job;
+    dns->work_tail = job;
+    pthread_cond_signal(&dns->work_ready);
+    pthread_mutex_unlock(&dns->lock);
+
+    return RESOLVE_PENDING;
+}
+
+
+void resolver_cancel(resolver* dns, resolve_query* query)
+{
+    (void)dns;
+    resolve_job* job = query->job;
+    if (job == NULL)
+        return;
+
+    // The lookup itself goes on, its result is still cached
+    for (resolve_query** link = &job->queries; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == query)
+        {
+            *link = query->next;
+            break;
+        }
+    }
+
+    query->job = NULL;
+    query->next = NULL;
+}
+
+
+static void free_jobs(resolve_job* job)
+{
+    while (job != NULL)
+    {
+        resolve_job* next = job->next;
+        free(job->host);
+        free(job);
+        job = next;
+    }
+}
+
+
+void resolver_close(resolver* dns)
+{
+    pthread_mutex_lock(&dns->lock);
+    dns->stopping = 1;
+    pthread_cond_broadcast(&dns->work_ready);
+    pthread_mutex_unlock(&dns->lock);
+
+    // Threads finish the getaddrinfo call they are in
+    for (int i = 0; i < dns->thread_count; i++)
+        pthread_join(dns->threads[i], NULL);
+    dns->thread_count = 0;
+
+    // Every job is either waiting for a thread or done
+    free_jobs(dns->work_head);
+    free_jobs(dns->done);
+    dns->work_head = NULL;
+    dns->work_tail = NULL;
+    dns->done = NULL;
+    dns->pending = NULL;
+
+    for (size_t bucket = 0; bucket < RESOLVER_BUCKETS; bucket++)
+    {
+        resolver_entry* entry = dns->buckets[bucket];
+        while (entry != NULL)
+        {
+            resolver_entry* next = entry->next;
+            free(entry->host);
+            free(entry);
+            entry = next;
+        }
+        dns->buckets[bucket] = NULL;
+    }
+    dns->entries = 0;
+
+    int fd = dns->watcher.fd;
+    if (fd != -1)
+    {
+        event_loop_remove(dns->loop, &dns->watcher);
+        close(fd);
+    }
+
+    pthread_mutex_destroy(&dns->lock);
+    pthread_cond_destroy(&dns->work_ready);
+}
@@ -0,0 +1,132 @@
+#ifndef CPROXY_RESOLVER_H
+#define CPROXY_RESOLVER_H
+
+
+#include "cproxy.h"
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "event_loop.h"
+
+
+#define MAX_RESOLVED_ADDRESSES 8 // Maximum number of addresses kept per host
+#define RESOLVER_THREADS 4 // Number of threads running getaddrinfo
+#define RESOLVER_BUCKETS 1024 // Number of hash buckets of the cache
+#define MAX_RESOLVER_ENTRIES 4096 // Maximum number of cached hosts
+#define DEFAULT_DNS_TTL 60 // Default seconds a resolved host is cached
+
+typedef struct{
+    int count; // Number of addresses
+    struct sockaddr_storage addresses[MAX_RESOLVED_ADDRESSES]; // IPv4 and IPv6 addresses, in preference order
+    socklen_t lengths[MAX_RESOLVED_ADDRESSES]; // Length of each address
+} resolved_addresses;
+
+typedef enum{
+    RESOLVE_DONE, // The result was found in the cache and copied to the query
+    RESOLVE_PENDING, // The handler of the query will be called from the event loop
+    RESOLVE_FAILED // The lookup could not be started
+} resolve_status;
+
+typedef struct resolve_query resolve_query;
+typedef struct resolve_job resolve_job;
+
+// Called from the event loop with 0 and the addresses on success, or a getaddrinfo error code
+typedef void (*resolve_handler)(resolve_query*, int, const resolved_addresses*);
+
+struct resolve_query{
+    resolve_handler handler; // Called once the lookup completed
+    resolved_addresses result; // Addresses of a RESOLVE_DONE lookup
+    resolve_job* job; // Lookup the query waits for, or NULL
+    resolve_query* next; // Next query waiting for the same lookup
+};
+
+struct resolve_job{
+    char* host; // Host name being resolved
+    int status; // getaddrinfo result
+    resolved_addresses result; // Resolved addresses
+    resolve_query* queries; // Queries waiting for the lookup, only touched by the event loop thread
+    resolve_job* next; // Next job in the work or done queue
+    resolve_job* next_pending; // Next job being resolved, only touched by the event loop thread
+};
+
+typedef struct resolver_entry{
+    char* host; // Host name
+    resolved_addresses result; // Its addresses
+    time_t expires; // Monotonic second after which the entry is stale
+    struct resolver_entry* next; // Next entry in the same bucket
+} resolver_entry;
+
+typedef struct{
+    event_loop* loop; // Loop the handlers are called from
+    event_watcher watcher; // Watcher of the eventfd signalled by the threads
+    resolver_entry* buckets[RESOLVER_BUCKETS]; // Cached lookups
+    size_t entries; // Number of cached hosts
+    long ttl; // Seconds a lookup is cached, 0 disables the cache
+    resolve_job* pending; // Jobs being resolved, so concurrent lookups of a host share one
+    pthread_mutex_t lock; // Protects the queues and stopping
+    pthread_cond_t work_ready; // Signalled when a job is queued
+    resolve_job* work_head; // Jobs waiting for a thread
+    resolve_job* work_tail; // Last job waiting for a thread
+    resolve_job* done; // Resolved jobs waiting for the event loop
+    int stopping; // 1 once the threads should exit
+    pthread_t threads[RESOLVER_THREADS]; // Threads running getaddrinfo
+    int thread_count; // Number of started threads
+} resolver;
+
+
+/**
+ * Resolves a host name to its IPv4 and IPv6 addresses, blocking until done.
+ *
+ * @param host: The host name or address literal.
+ * @param result: Filled with the addresses, in the preference order returned by getaddrinfo.
+ * @return 0 on success, or a getaddrinfo error code (see gai_strerror).
+ */
+int resolve_host(const char*, resolved_addresses*);
+
+/**
+ * Sets the port of a resolved address.
+ *
+ * @param address: The IPv4 or IPv6 address.
+ * @param port: The port, in host byte order.
+ */
+void set_address_port(struct sockaddr_storage*, int);
+
+/**
+ * Starts the resolver threads and registers the resolver on an event loop.
+ *
+ * @param dns: A pointer to the 'resolver' structure to initialize.
+ * @param loop: The event loop the handlers are called from.
+ * @param ttl: The number of seconds a lookup is cached, 0 to disable caching.
+ * @return 0 on success, or -1 on failure.
+ */
+int resolver_init(resolver*, event_loop*, long);
+
+/**
+ * Looks up a host name: from the cache when possible, else asynchronously on a resolver thread.
+ *
+ * @param dns: A pointer to an initialized 'resolver' structure.
+ * @param host: The host name to resolve.
+ * @param query: The query to answer. Its handler must be set, and it must stay valid until answered or cancelled.
+ * @return RESOLVE_DONE with the addresses in query->result, RESOLVE_PENDING, or RESOLVE_FAILED.
+ */
+resolve_status resolver_lookup(resolver*, const char*, resolve_query*);
+
+/**
+ * Cancels a pending query. Its handler will not be called.
+ *
+ * @param dns: A pointer to an initialized 'resolver' structure.
+ * @param query: The pending query.
+ */
+void resolver_cancel(resolver*, resolve_query*);
+
+/**
+ * Stops the resolver threads and frees the cache.
+ *
+ * @param dns: A pointer to an initialized 'resolver' structure.
+ */
+void resolver_close(resolver*);
+
+
+#endif //CPROXY_RESOLVER_H
@@ -0,0 +1,928 @@
+#include "response.h"
+
+
+
+void response_init(http_response* response, full_URL* my_url)
+{
+    response->url = my_url;
+    response->header_end_found = 0;
+    response->save_file_flag = 1;
+    response->file = NULL;
+    response->full_file_path = NULL;
+    response->total_bytes = 0;
+    response->header_bytes = 0;
+    response->status_code = 0;
+    response->http_minor = 0;
+    response->content_length = -1;
+    response->chunked = 0;
+    response->range_start = -1;
+    response->range_end = -1;
+    response->range_total = -1;
+    response->decoder.state = CHUNK_SIZE;
+    response->decoder.remaining = 0;
+    response->decoder.size_digits = 0;
+    response->decoder.last_chunk = 0;
+    response->malformed = 0;
+    response->write_failed = 0;
+    response->keep_alive = 0;
+    response->body_bytes = 0;
+    response->complete = 0;
+    response->cacheable = 1;
+    response->is_html = 0;
+    response->not_modified = 0;
+    memset(&response->metadata, 0, sizeof(response->metadata));
+    response->timing = NULL;
+    response->body_fd = -1;
+
+    header_parser* parser = &response->parser;
+    parser->state = HEADER_STATUS_LINE;
+    parser->line_length = 0;
+    parser->line_overflow = 0;
+    parser->connection_close = 0;
+    parser->connection_keep_alive = 0;
+    parser->date = -1;
+    parser->expires = -1;
+    parser->has_expires = 0;
+    parser->age = 0;
+    parser->max_age = -1;
+    parser->shared_max_age = -1;
+    parser->no_cache = 0;
+}
+
+
+static int header_value_is(const char* value, size_t value_length, const char* expected)
+{
+    return value_length == strlen(expected) && strncasecmp(value, expected, value_length) == 0;
+}
+
+
+static int parse_digits(const char* value, size_t count)
+{
+    int number = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (value[i] < '0' || value[i] > '9')
+            return -1;
+        number = number * 10 + (value[i] - '0');
+    }
+    return number;
+}
+
+
+static time_t parse_fixdate(const char* value, size_t value_length)
+{
+    // "Sun, 06 Nov 1994 08:49:37 GMT", the format every current origin sends
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (value_length != 29 || value[3] != ',' || value[4] != ' ' || value[7] != ' ' || value[11] != ' ' ||
+        value[16] != ' ' || value[19] != ':' || value[22] != ':' || memcmp(value + 25, " GMT", 4) != 0)
+        return -1;
+
+    int month = -1;
+    for (int i = 0; i < 12; i++)
+        if (memcmp(value + 8, months + i * 3, 3) == 0)
+            month = i + 1;
+
+    int day = parse_digits(value + 5, 2);
+    int year = parse_digits(value + 12, 4);
+    int hours = parse_digits(value + 17, 2);
+    int minutes = parse_digits(value + 20, 2);
+    int seconds = parse_digits(value + 23, 2);
+    if (month == -1 || day < 1 || day > 31 || year < 1970 || hours > 23 || minutes > 59 || seconds > 60 ||
+        hours < 0 || minutes < 0 || seconds < 0)
+        return -1;
+
+    // Days since the epoch of a proleptic Gregorian date, with years starting in March
+    int shifted_year = month <= 2 ? year - 1 : year;
+    int era = shifted_year / 400;
+    int year_of_era = shifted_year - era * 400;
+    int day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    long days = (long)era * 146097 + day_of_era - 719468;
+
+    return (time_t)(days * 86400 + hours * 3600 + minutes * 60 + seconds);
+}
+
+
+static time_t parse_http_date(const char* value, size_t value_length)
+{
+    time_t parsed = parse_fixdate(value, value_length);
+    if (parsed != -1)
+        return parsed;
+
+    // The obsolete RFC 850 and asctime formats are rare, strptime handles them
+    char date[64];
+    if (value_length >= sizeof(date))
+        return -1;
+
+    memcpy(date, value, value_length);
+    date[value_length] = '\0';
+
+    static const char* const formats[] = {"%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y"};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        struct tm date_info;
+        memset(&date_info, 0, sizeof(date_info));
+        const char* end = strptime(date, formats[i], &date_info);
+        if (end != NULL && *end == '\0')
+            return timegm(&date_info);
+    }
+
+    return -1;
+}
+
+
+static long parse_directive_seconds(const char* value, size_t value_length)
+{
+    if (value_length == 0 || value[0] == '-')
+        return -1;
+
+    char* end;
+    long seconds = strtol(value, &end, 10);
+    return end == value ? -1 : seconds;
+}
+
+
+static void parse_cache_control(const char* value, size_t value_length, long* max_age, long* shared_max_age,
+                                int* no_cache, int* cacheable)
+{
+    const char* end = value + value_length;
+
+    while (value < end)
+    {
+        const char* directive_end = memchr(value, ',', end - value);
+        if (directive_end == NULL)
+            directive_end = end;
+
+        while (value < directive_end && (*value == ' ' || *value == '\t'))
+            value++;
+        size_t directive_length = directive_end - value;
+        while (directive_length > 0 && (value[directive_length - 1] == ' ' || value[directive_length - 1] == '\t'))
+            directive_length--;
+
+        if (directive_length > strlen("max-age=") && strncasecmp(value, "max-age=", strlen("max-age=")) == 0)
+            *max_age = parse_directive_seconds(value + strlen("max-age="), directive_length - strlen("max-age="));
+        else if (directive_length > strlen("s-maxage=") && strncasecmp(value, "s-maxage=", strlen("s-maxage=")) == 0)
+            *shared_max_age = parse_directive_seconds(value + strlen("s-maxage="),
+                                                      directive_length - strlen("s-maxage="));
+        else if (header_value_is(value, directive_length, "no-cache"))
+            *no_cache = 1;
+        else if (header_value_is(value, directive_length, "no-store") ||
+                 header_value_is(value, directive_length, "private"))
+            *cacheable = 0;
+
+        value = directive_end + 1;
+    }
+}
+
+
+static int parse_status_line(http_response* response, const char* line, size_t length)
+{
+    // HTTP/1.x SP 3DIGIT [SP reason]
+    if (length < 12 || memcmp(line, "HTTP/1.", 7) != 0 || line[7] < '0' || line[7] > '9' || line[8] != ' ')
+        return -1;
+
+    int status_code = 0;
+    for (size_t i = 9; i < 12; i++)
+    {
+        if (line[i] < '0' || line[i] > '9')
+            return -1;
+        status_code = status_code * 10 + (line[i] - '0');
+    }
+
+    if (length > 12 && line[12] != ' ')
+        return -1;
+
+    response->http_minor = line[7] - '0';
+    response->status_code = status_code;
+    return 0;
+}
+
+
+static void parse_content_range(http_response* response, const char* value, size_t value_length)
+{
+    // "bytes <first>-<last>/<total>", the total may be "*"
+    if (value_length < strlen("bytes ") || strncasecmp(value, "bytes ", strlen("bytes ")) != 0)
+        return;
+
+    char* end;
+    const char* range = value + strlen("bytes ");
+    long start = strtol(range, &end, 10);
+    if (end == range || *end != '-' || start < 0)
+        return;
+
+    range = end + 1;
+    long last = strtol(range, &end, 10);
+    if (end == range || *end != '/' || last < start)
+        return;
+
+    range = end + 1;
+    long total = strtol(range, &end, 10);
+    response->range_start = start;
+    response->range_end = last;
+    response->range_total = end == range || total <= last ? -1 : total;
+}
+
+
+static void parse_content_length(http_response* response, const char* value, size_t value_length)
+{
+    // A list of equal values, as left by a proxy that merged repeated fields, is one length
+    size_t i = 0;
+    do
+    {
+        while (i < value_length && (value[i] == ' ' || value[i] == '\t'))
+            i++;
+
+        size_t digits = 0;
+        long length = 0;
+        for (; i < value_length && value[i] >= '0' && value[i] <= '9'; i++, digits++)
+        {
+            if (length > (LONG_MAX - (value[i] - '0')) / 10)
+            {
+                response->malformed = 1; // Larger than any body
+                return;
+            }
+            length = length * 10 + (value[i] - '0');
+        }
+
+        while (i < value_length && (value[i] == ' ' || value[i] == '\t'))
+            i++;
+
+        // Anything but digits, or another length than an earlier field gave, makes the body end unknowable
+        if (digits == 0 || (i < value_length && value[i] != ',') ||
+            (response->content_length >= 0 && response->content_length != length))
+        {
+            response->malformed = 1;
+            return;
+        }
+
+        response->content_length = length;
+    } while (i++ < value_length);
+}
+
+
+static int field_name_is(const char* name, size_t name_length, const char* expected)
+{
+    return name_length == strlen(expected) && strncasecmp(name, expected, name_length) == 0;
+}
+
+
+static void parse_header_field(http_response* response, const char* line, size_t length)
+{
+    header_parser* parser = &response->parser;
+
+    const char* colon = memchr(line, ':', length);
+    if (colon == NULL)
+        return;
+
+    // The byte after the line is still its CR or LF, so number parsing stops there
+    const char* line_end = line + length;
+    size_t name_length = colon - line;
+    const char* value = colon + 1;
+    while (value < line_end && (*value == ' ' || *value == '\t'))
+        value++;
+    size_t value_length = line_end - value;
+    while (value_length > 0 && (value[value_length - 1] == ' ' || value[value_length - 1] == '\t'))
+        value_length--;
+
+    if (field_name_is(line, name_length, "Content-Length"))
+        parse_content_length(response, value, value_length);
+    else if (field_name_is(line, name_length, "Transfer-Encoding"))
+        response->chunked = !header_value_is(value, value_length, "identity");
+    else if (field_name_is(line, name_length, "Content-Range"))
+        parse_content_range(response, value, value_length);
+    else if (field_name_is(line, name_length, "Content-Encoding"))
+    {
+        // The body is stored as sent, a coding that cannot be decoded for other clients is not stored
+        response->metadata.encoding = parse_content_encoding(value, value_length);
+        if (response->metadata.encoding == ENCODING_UNSUPPORTED)
+            response->cacheable = 0;
+    }
+    else if (field_name_is(line, name_length, "Content-Type"))
+    {
+        // Only the media type matters, not its parameters such as the charset
+        size_t type_length = 0;
+        while (type_length < value_length && value[type_length] != ';' && value[type_length] != ' ')
+            type_length++;
+        response->is_html = header_value_is(value, type_length, "text/html") ||
+                            header_value_is(value, type_length, "application/xhtml+xml");
+    }
+    else if (field_name_is(line, name_length, "Connection"))
+    {
+        parser->connection_close = header_value_is(value, value_length, "close");
+        parser->connection_keep_alive = header_value_is(value, value_length, "keep-alive");
+    }
+    else if (field_name_is(line, name_length, "Date"))
+        parser->date = parse_http_date(value, value_length);
+    else if (field_name_is(line, name_length, "Expires"))
+    {
+        parser->has_expires = 1;
+        parser->expires = parse_http_date(value, value_length); // Invalid dates such as "0" mean already expired
+    }
+    else if (field_name_is(line, name_length, "Age"))
+    {
+        long parsed_age = parse_directive_seconds(value, value_length);
+        parser->age = parsed_age > 0 ? parsed_age : 0;
+    }
+    else if (field_name_is(line, name_length, "Cache-Control"))
+        parse_cache_control(value, value_length, &parser->max_age, &parser->shared_max_age, &parser->no_cache,
+                            &response->cacheable);
+    else if (field_name_is(line, name_length, "Last-Modified"))
+    {
+        time_t last_modified = parse_http_date(value, value_length);
+        response->metadata.last_modified = last_modified > 0 ? last_modified : 0;
+    }
+    else if (field_name_is(line, name_length, "ETag") && value_length < sizeof(response->metadata.etag))
+    {
+        memcpy(response->metadata.etag, value, value_length);
+        response->metadata.etag[value_length] = '\0';
+    }
+}
+
+
+static void finish_header(http_response* response)
+{
+    header_parser* parser = &response->parser;
+
+    // An interim response (e.g. 100 Continue) is followed by the real one
+    if (response->status_code >= 100 && response->status_code < 200)
+    {
+        parser->state = HEADER_STATUS_LINE;
+        response->status_code = 0;
+        response->content_length = -1;
+        return;
+    }
+
+    // Freshness lifetime, in the order of precedence a shared cache applies
+    time_t now = time(NULL);
+    long lifetime = 0;
+    if (parser->no_cache)
+        lifetime = 0; // Stored, but revalidated before every use
+    else if (parser->shared_max_age >= 0)
+        lifetime = parser->shared_max_age;
+    else if (parser->max_age >= 0)
+        lifetime = parser->max_age;
+    else if (parser->has_expires)
+        lifetime = parser->expires == -1 ? 0 : parser->expires - (parser->date != -1 ? parser->date : now);
+    else if (response->metadata.last_modified != 0)
+    {
+        // Heuristic freshness: a tenth of the time since the last modification
+        time_t since_modified = (parser->date != -1 ? parser->date : now) - response->metadata.last_modified;
+        lifetime = since_modified > 0 ? since_modified / 10 : 0;
+    }
+
+    response->metadata.expires_at = now + lifetime - parser->age;
+    response->not_modified = response->status_code == 304;
+
+    // Responses to GET that never carry a body
+    if (response->status_code == 204 || response->status_code == 304)
+        response->content_length = 0;
+
+    // A chunked body wins over Content-Length
+    if (response->chunked)
+        response->content_length = -1;
+
+    // HTTP/1.1 keeps connections open unless told otherwise, HTTP/1.0 only when asked to
+    if (response->http_minor >= 1)
+        response->keep_alive = !parser->connection_close;
+    else
+        response->keep_alive = parser->connection_keep_alive;
+
+    // Only a body whose end is known leaves the connection usable
+    if (response->content_length < 0 && !response->chunked)
+        response->keep_alive = 0;
+
+    parser->state = HEADER_DONE;
+    response->header_end_found = 1;
+}
+
+
+static void parse_line(http_response* response, const char* line, size_t length)
+{
+    // Drop the line ending, a bare LF is accepted as well as CRLF
+    length--;
+    if (length > 0 && line[length - 1] == '\r')
+        length--;
+
+    if (response->parser.state == HEADER_STATUS_LINE)
+    {
+        // Empty lines before the status line are ignored
+        if (length == 0)
+            return;
+
+        // A malformed status line leaves status_code at 0, so nothing is saved
+        parse_status_line(response, line, length);
+        response->parser.state = HEADER_FIELDS;
+    }
+    else if (length == 0)
+        finish_header(response);
+    else
+        parse_header_field(response, line, length);
+}
+
+
+static void keep_line_part(header_parser* parser, const char* data, size_t length)
+{
+    if (parser->line_overflow || parser->line_length + length > sizeof(parser->line))
+    {
+        parser->line_overflow = 1;
+        return;
+    }
+
+    memcpy(parser->line + parser->line_length, data, length);
+    parser->line_length += length;
+}
+
+
+size_t parse_response_header(http_response* response, const char* data, size_t length)
+{
+    header_parser* parser = &response->parser;
+    size_t consumed = 0;
+
+    while (consumed < length && parser->state != HEADER_DONE)
+    {
+        // memchr scans a word or a vector register at a time
+        const char* start = data + consumed;
+        const char* newline = memchr(start, '\n', length - consumed);
+        if (newline == NULL)
+        {
+            // The line continues in the next read
+            keep_line_part(parser, start, length - consumed);
+            return length;
+        }
+
+        size_t part_length = newline - start + 1;
+        consumed += part_length;
+
+        // A line inside one read is parsed in place, only split lines are copied
+        if (parser->line_length == 0 && !parser->line_overflow)
+            parse_line(response, start, part_length);
+        else
+        {
+            keep_line_part(parser, start, part_length);
+            if (!parser->line_overflow)
+                parse_line(response, parser->line, parser->line_length);
+        }
+
+        parser->line_length = 0;
+        parser->line_overflow = 0;
+    }
+
+    return consumed;
+}
+
+
+static void write_body(http_response* response, const char* body, size_t length)
+{
+    // Write to the file if save_file_flag is set
+    if (response->save_file_flag && length > 0)
+    {
+        double started = timing_now();
+        // A full disk or an I/O error leaves the file short of body_bytes, it must not be committed
+        if (fwrite(body, 1, length, response->file) != length)
+            response->write_failed = 1;
+        phase_timer_add(response->timing, PHASE_CACHE_WRITE, started);
+    }
+    else if (response->body_fd != -1 && length > 0)
+        write_all(response->body_fd, body, length);
+
+    response->body_bytes += length;
+}
+
+
+static int hex_digit_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+
+static void end_chunk_line(chunk_decoder* decoder)
+{
+    // The size line is over: a zero size starts the trailer
+    if (decoder->state == CHUNK_SIZE || decoder->state == CHUNK_EXTENSION || decoder->state == CHUNK_SIZE_LF)
+    {
+        decoder->last_chunk = decoder->remaining == 0;
+        decoder->state = decoder->last_chunk ? CHUNK_TRAILER_LINE_START : CHUNK_DATA;
+    }
+    else // The line after the chunk data
+    {
+        decoder->state = CHUNK_SIZE;
+        decoder->remaining = 0;
+        decoder->size_digits = 0;
+    }
+}
+
+
+static size_t decode_chunked(http_response* response, const char* data, size_t length)
+{
+    chunk_decoder* decoder = &response->decoder;
+    size_t consumed = 0;
+
+    while (consumed < length && !response->complete && !response->malformed)
+    {
+        // Chunk data is written as a block, the framing is read byte by byte
+        if (decoder->state == CHUNK_DATA)
+        {
+            size_t part = length - consumed < decoder->remaining ? length - consumed : decoder->remaining;
+            write_body(response, data + consumed, part);
+            consumed += part;
+            decoder->remaining -= part;
+            if (decoder->remaining == 0)
+                decoder->state = CHUNK_DATA_CR;
+            continue;
+        }
+
+        char c = data[consumed++];
+        switch (decoder->state)
+        {
+            case CHUNK_SIZE:
+            {
+                int digit = hex_digit_value(c);
+                if (digit != -1 && decoder->size_digits < 15)
+                {
+                    decoder->remaining = decoder->remaining * 16 + digit;
+                    decoder->size_digits++;
+                }
+                else if (decoder->size_digits == 0)
+                    response->malformed = 1;
+                else if (c == ';' || c == ' ' || c == '\t')
+                    decoder->state = CHUNK_EXTENSION;
+                else if (c == '\r')
+                    decoder->state = CHUNK_SIZE_LF;
+                else if (c == '\n')
+                    end_chunk_line(decoder);
+                else
+                    response->malformed = 1; // Not hexadecimal, or too large
+                break;
+            }
+
+            case CHUNK_EXTENSION:
+                if (c == '\n')
+                    end_chunk_line(decoder);
+                break;
+
+            case CHUNK_SIZE_LF:
+            case CHUNK_DATA_LF:
+                if (c == '\n')
+                    end_chunk_line(decoder);
+                else
+                    response->malformed = 1;
+                break;
+
+            case CHUNK_DATA_CR:
+                if (c == '\r')
+                    decoder->state = CHUNK_DATA_LF;
+                else if (c == '\n')
+                    end_chunk_line(decoder);
+                else
+                    response->malformed = 1;
+                break;
+
+            case CHUNK_TRAILER_LINE_START:
+                if (c == '\r')
+                    decoder->state = CHUNK_TRAILER_LF;
+                else if (c == '\n')
+                    response->complete = 1;
+                else
+                    decoder->state = CHUNK_TRAILER_LINE; // Trailer fields are not kept
+                break;
+
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n')
+                    decoder->state = CHUNK_TRAILER_LINE_START;
+                break;
+
+            case CHUNK_TRAILER_LF:
+                if (c == '\n')
+                    response->complete = 1;
+                else
+                    response->malformed = 1;
+                break;
+
+            case CHUNK_DATA:
+                break;
+        }
+    }
+
+    return consumed;
+}
+
+
+static int save_body(http_response* response, const char* body, size_t length)
+{
+    size_t used = length;
+
+    if (response->chunked)
+        used = decode_chunked(response, body, length);
+    else
+    {
+        // Bytes past Content-Length are not part of this response
+        if (response->content_length >= 0)
+        {
+            size_t remaining = (size_t)response->content_length - response->body_bytes;
+            if (used > remaining)
+                used = remaining;
+        }
+
+        write_body(response, body, used);
+        if (response->content_length >= 0 && response->body_bytes == (size_t)response->content_length)
+            response->complete = 1;
+    }
+
+    // The origin sent more than the response, the connection is out of sync
+    if (used < length)
+        response->keep_alive = 0;
+
+    if (response->malformed)
+    {
+        response->keep_alive = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int response_feed(http_response* response, const char* data, size_t length)
+{
+    response->total_bytes += length; // Update the total bytes read
+
+    // If the header end has been found, the rest is body
+    if (response->header_end_found)
+        return save_body(response, data, length);
+
+    size_t header_length = parse_response_header(response, data, length);
+    response->header_bytes += header_length;
+    if (!response->header_end_found)
+        return 0;
+
+    // Check if the response is OK and may be stored. A body whose end is unknowable is neither stored nor read
+    if (response->malformed)
+    {
+        response->keep_alive = 0;
+        return -1;
+    }
+
+    if (response->status_code != 200 || !response->cacheable)
+        response->save_file_flag = 0; // If not OK, set save_file_flag to 0
+    else // If OK
+    {
+        // A URL the cache has no room for is still read, just not saved
+        double started = timing_now();
+        int fd = cache_store_prepare(response->url, &response->full_file_path);
+        if (fd == -1)
+            response->save_file_flag = 0;
+        else
+        {
+            response->file = fdopen(fd, "wb");
+            if (response->file == NULL)
+            {
+                fprintf(stderr, "Malloc failed\n");
+                close(fd);
+                unlink(response->full_file_path);
+                return -1;
+            }
+        }
+        phase_timer_add(response->timing, PHASE_CACHE_WRITE, started);
+    }
+
+    // A body that never comes is complete right away
+    if (response->content_length == 0)
+        response->complete = 1;
+
+    // Write any part of the body that's in the buffer to the file
+    return save_body(response, data + header_length, length - header_length);
+}
+
+
+int create_splice_pipe(int pipe_fds[2], size_t buffer_size)
+{
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+    {
+        perror("pipe2\n");
+        return -1;
+    }
+
+    // Larger pipes move more bytes per splice(); unprivileged processes are capped by /proc/sys/fs/pipe-max-size
+    if (buffer_size > (size_t)INT_MAX || fcntl(pipe_fds[1], F_SETPIPE_SZ, (int)buffer_size) == -1)
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, DEFAULT_SPLICE_BUFFER_SIZE);
+
+    return 0;
+}
+
+
+int response_can_splice(http_response* response)
+{
+    // Chunked bodies are decoded in user space
+    return response->header_end_found && response->save_file_flag && response->file != NULL && !response->complete &&
+           !response->chunked;
+}
+
+
+static int drain_pipe(int pipe_fd, int out_fd, size_t count)
+{
+    while (count > 0)
+    {
+        ssize_t moved = splice(pipe_fd, NULL, out_fd, NULL, count, SPLICE_F_MOVE);
+        if (moved > 0)
+        {
+            count -= moved;
+            continue;
+        }
+
+        if (moved < 0 && errno == EINTR)
+            continue;
+
+        if (moved == 0 || errno != EINVAL)
+            return -1;
+
+        // The file system does not support splice, copy the bytes through user space
+        char buffer[READ_BUFFER_SIZE];
+        while (count > 0)
+        {
+            ssize_t read_bytes = read(pipe_fd, buffer, count < sizeof(buffer) ? count : sizeof(buffer));
+            if (read_bytes <= 0 || write_all(out_fd, buffer, read_bytes) == -1)
+                return -1;
+            count -= read_bytes;
+        }
+    }
+
+    return 0;
+}
+
+
+ssize_t response_splice_body(http_response* response, int sd, int pipe_fds[2], int tee_fd, size_t chunk_size,
+                             int nonblocking)
+{
+    size_t wanted = chunk_size;
+
+    // Never take bytes past Content-Length off the socket
+    if (response->content_length >= 0)
+    {
+        size_t remaining = (size_t)response->content_length - response->body_bytes;
+        if (remaining < wanted)
+            wanted = remaining;
+        if (wanted == 0)
+            return 0;
+    }
+
+    // Body bytes written through stdio must reach the file before the spliced ones
+    if (fflush(response->file) == EOF)
+        return -1;
+
+    ssize_t moved = splice(sd, NULL, pipe_fds[1], NULL, wanted, SPLICE_F_MOVE | (nonblocking ? SPLICE_F_NONBLOCK : 0));
+    if (moved <= 0)
+        return moved;
+
+    int file_fd = fileno(response->file);
+    size_t left = moved;
+    double started = timing_now();
+
+    while (left > 0)
+    {
+        size_t part = left;
+
+        // tee() does not consume, so each duplicated part is spliced to the file before duplicating the next one
+        if (tee_fd != -1)
+        {
+            ssize_t teed = tee(pipe_fds[0], tee_fd, left, 0);
+            if (teed <= 0)
+            {
+                if (teed < 0 && errno == EINTR)
+                    continue;
+                return -1;
+            }
+            part = teed;
+        }
+
+        if (drain_pipe(pipe_fds[0], file_fd, part) == -1)
+            return -1;
+
+        left -= part;
+    }
+
+    phase_timer_add(response->timing, PHASE_CACHE_WRITE, started);
+
+    response->total_bytes += moved;
+    response->body_bytes += moved;
+    if (response->content_length >= 0 && response->body_bytes == (size_t)response->content_length)
+        response->complete = 1;
+
+    return moved;
+}
+
+
+int response_reusable(http_response* response)
+{
+    return response->complete && response->keep_alive;
+}
+
+
+static void release_file(http_response* response)
+{
+    // Close the file if it's open
+    if (response->file != NULL)
+        fclose(response->file);
+
+    free(response->full_file_path);
+
+    response->file = NULL;
+    response->full_file_path = NULL;
+}
+
+
+static void discard_file(http_response* response)
+{
+    // Only the temporary file goes, an older copy of the object stays in place
+    if (response->file != NULL)
+        unlink(response->full_file_path);
+
+    release_file(response);
+}
+
+
+int response_finish(http_response* response)
+{
+    double started = timing_now();
+
+    // The stale copy is still valid, only its freshness changes
+    if (response->not_modified)
+    {
+        discard_file(response);
+        int refreshed = cache_store_refresh(response->url, &response->metadata) == 0;
+        phase_timer_add(response->timing, PHASE_CACHE_WRITE, started);
+        return refreshed;
+    }
+
+    int saved = response->save_file_flag;
+
+    // A 200 response whose header never arrived saved nothing, and a body cut short is not the object
+    if (response->file == NULL || ((response->content_length >= 0 || response->chunked) && !response->complete))
+        saved = 0;
+
+    // The rename makes the object visible to lookups once it is complete and every byte of it reached the file.
+    // stdio may have failed a write while flushing its buffer inside an earlier fwrite, which ferror() remembers
+    if (saved && (response->write_failed || fflush(response->file) != 0 || ferror(response->file) ||
+                  cache_store_commit(response->url, response->full_file_path, response->body_bytes,
+                                     &response->metadata) == -1))
+        saved = 0;
+
+    if (saved)
+        release_file(response);
+    else
+        discard_file(response);
+
+    // Broken links are asked for again and again, the origin is spared them for a while
+    int status = response->status_code;
+    if (!saved && response->header_end_found && response->cacheable &&
+        (status == 404 || status == 410 || status / 100 == 5))
+        cache_store_record_failure(response->url, status);
+
+    phase_timer_add(response->timing, PHASE_CACHE_WRITE, started);
+    return saved;
+}
+
+
+void response_abort(http_response* response)
+{
+    discard_file(response);
+}
+
+
+void negative_status_text(int status, char* text, size_t size)
+{
+    const char* reason;
+    switch (status)
+    {
+        case 404:
+            reason = "Not Found";
+            break;
+        case 410:
+            reason = "Gone";
+            break;
+        case 500:
+            reason = "Internal Server Error";
+            break;
+        case 501:
+            reason = "Not Implemented";
+            break;
+        case 503:
+            reason = "Service Unavailable";
+            break;
+        case 504:
+            reason = "Gateway Timeout";
+            break;
+        default:
+            // An unreachable origin is answered like a proxy answers it on the first try
+            status = status == CACHE_UNREACHABLE ? 502 : status;
+            reason = status == 502 ? "Bad Gateway" : "Server Error";
+            break;
+    }
+
+    snprintf(text, size, "%d %s", status, reason);
+}
@@ -0,0 +1,189 @@
+#ifndef CPROXY_RESPONSE_H
+#define CPROXY_RESPONSE_H
+
+
+#include "cproxy.h"
+#include <strings.h>
+#include "cache_store.h"
+#include "content_coding.h"
+#include "latency_stats.h"
+
+
+#define MAX_HEADER_LINE 8192 // Longest response header line kept across reads, longer fields are skipped
+
+typedef enum{
+    HEADER_STATUS_LINE, // Waiting for the status line
+    HEADER_FIELDS, // Reading the header fields
+    HEADER_DONE // The empty line ending the header was seen
+} header_state;
+
+typedef struct{
+    header_state state; // Position in the header
+    char line[MAX_HEADER_LINE]; // Start of a line split across reads
+    size_t line_length; // Number of bytes in line
+    int line_overflow; // 1 if the current line did not fit in line and is skipped
+    int connection_close; // 1 if "Connection: close" was seen
+    int connection_keep_alive; // 1 if "Connection: keep-alive" was seen
+    time_t date; // Date header, or -1
+    time_t expires; // Expires header, or -1 if missing or invalid
+    int has_expires; // 1 if an Expires header was seen, even an invalid one
+    long age; // Age header in seconds
+    long max_age; // Cache-Control max-age, or -1
+    long shared_max_age; // Cache-Control s-maxage, or -1
+    int no_cache; // 1 if Cache-Control has no-cache
+} header_parser;
+
+typedef enum{
+    CHUNK_SIZE, // Reading the hexadecimal size of the next chunk
+    CHUNK_EXTENSION, // Skipping chunk extensions up to the end of the size line
+    CHUNK_SIZE_LF, // The size line ended with CR, waiting for its LF
+    CHUNK_DATA, // Reading the data of a chunk
+    CHUNK_DATA_CR, // Waiting for the CR after the data of a chunk
+    CHUNK_DATA_LF, // Waiting for the LF after the data of a chunk
+    CHUNK_TRAILER_LINE_START, // At the start of a trailer line, an empty one ends the body
+    CHUNK_TRAILER_LINE, // Skipping a trailer field
+    CHUNK_TRAILER_LF // The last line ended with CR, waiting for its LF
+} chunk_state;
+
+typedef struct{
+    chunk_state state; // Position in the chunked framing
+    size_t remaining; // Bytes of the current chunk not read yet
+    int size_digits; // Number of hexadecimal digits of the current size read so far
+    int last_chunk; // 1 once the zero-size chunk was seen, the trailer follows
+} chunk_decoder;
+
+typedef struct{
+    full_URL* url; // URL the response belongs to
+    int header_end_found; // 1 once the end of the header part was seen
+    int save_file_flag; // 1 if the body should be saved to the cache
+    FILE* file; // Cache file the body is written to
+    char* full_file_path; // Full path of the cache file
+    size_t total_bytes; // Total response bytes fed so far
+    size_t header_bytes; // Bytes of the header fed so far, including interim responses
+    int status_code; // Status code of the response, or 0 before the header was parsed
+    int http_minor; // Minor HTTP version of the response (0 for HTTP/1.0, 1 for HTTP/1.1)
+    long content_length; // Value of the Content-Length header, or -1 if the body is delimited by closing
+    int chunked; // 1 if the body uses the chunked transfer-encoding
+    long range_start; // First byte of the object in a 206 response, from Content-Range, or -1
+    long range_end; // Last byte of the object in a 206 response, or -1
+    long range_total; // Size of the whole object from Content-Range, or -1 if not given
+    chunk_decoder decoder; // State of the chunked decoding across reads
+    int malformed; // 1 if the body framing is invalid: a bad chunk or an invalid or conflicting Content-Length
+    int write_failed; // 1 if a write to the cache file failed or was short, so the file is never committed
+    int keep_alive; // 1 if the origin keeps the connection open after the response
+    size_t body_bytes; // Body bytes received so far, without the chunked framing
+    int complete; // 1 once the whole body was received
+    int cacheable; // 0 if Cache-Control forbids a shared cache to store the response
+    int is_html; // 1 if the Content-Type is text/html or XHTML, whose links may be prefetched
+    int not_modified; // 1 if the origin confirmed the stale cached copy with 304 Not Modified
+    cache_metadata metadata; // Freshness and validators computed from the header
+    header_parser parser; // State of the header parsing across reads
+    phase_timer* timing; // Timer the cache writes are counted in, or NULL
+    int body_fd; // Descriptor the body of a response that is not saved is copied to without its framing, or -1
+} http_response;
+
+
+/**
+ * Initializes the state used to process an HTTP response for the given URL.
+ *
+ * @param response: A pointer to the 'http_response' structure to initialize.
+ * @param my_url: A pointer to a 'full_URL' structure containing the host name, path, and port.
+ */
+void response_init(http_response*, full_URL*);
+
+/**
+ * Processes the next part of an HTTP response: parses the header, removes the chunked framing of the body if any,
+ * and saves the body to the cache. 'complete' is set once the end of the body was seen: after Content-Length bytes
+ * or the last chunk and its trailer. A body with neither ends when the origin closes the connection.
+ *
+ * @param response: A pointer to an initialized 'http_response' structure.
+ * @param data: The bytes read from the connection. They may split the header anywhere and contain null bytes.
+ * @param length: The number of bytes in data.
+ * @return 0 on success, or -1 if the cache file could not be prepared, the chunked framing is malformed or the
+ *         Content-Length is invalid or conflicting. A malformed response leaves the connection unusable.
+ */
+int response_feed(http_response*, const char*, size_t);
+
+/**
+ * Parses the next part of a response header: the status line, the framing headers (Content-Length,
+ * Transfer-Encoding, Connection), Content-Encoding, Content-Type, Content-Range and the caching headers (Date, Expires, Age, Cache-Control, ETag, Last-Modified).
+ * Lines may be split across calls; nothing is allocated.
+ *
+ * @param response: A pointer to an initialized 'http_response' structure.
+ * @param data: The next bytes of the response.
+ * @param length: The number of bytes in data.
+ * @return The number of bytes that belong to the header. header_end_found is set once the whole header was parsed,
+ *         and the remaining bytes are the start of the body.
+ */
+size_t parse_response_header(http_response*, const char*, size_t);
+
+/**
+ * Creates a pipe used to splice response bodies, sized to hold buffer_size bytes when the system allows it.
+ *
+ * @param pipe_fds: Set to the read and write ends of the pipe.
+ * @param buffer_size: The wanted capacity of the pipe in bytes.
+ * @return 0 on success, or -1 on failure.
+ */
+int create_splice_pipe(int[2], size_t);
+
+/**
+ * Checks whether the rest of a response body can be moved to the cache file with response_splice_body.
+ *
+ * @param response: A pointer to an initialized 'http_response' structure.
+ * @return 1 if the header was processed, the body is being saved, is not chunked and is not complete yet, else 0.
+ */
+int response_can_splice(http_response*);
+
+/**
+ * Moves the next part of a response body from the socket to the cache file inside the kernel,
+ * through a pipe (socket -> pipe -> cache file), optionally duplicating it to another pipe with tee().
+ *
+ * @param response: A pointer to an 'http_response' structure for which response_can_splice returns 1.
+ * @param sd: The socket descriptor the response is read from.
+ * @param pipe_fds: An empty pipe created with create_splice_pipe. It is empty again when the function returns.
+ * @param tee_fd: A pipe descriptor that receives a copy of the body, or -1.
+ * @param chunk_size: The maximum number of bytes to move.
+ * @param nonblocking: 1 to fail with EAGAIN instead of waiting for the socket.
+ * @return
+ *   - The number of body bytes moved.
+ *   - 0 if the origin closed the connection or the body is complete.
+ *   - -1 on failure, with errno set. EINVAL before anything was moved means splicing is not supported.
+ */
+ssize_t response_splice_body(http_response*, int, int[2], int, size_t, int);
+
+/**
+ * Checks whether the connection a response was read from can be used for another request.
+ *
+ * @param response: A pointer to an initialized 'http_response' structure.
+ * @return 1 if the whole body was received and the origin keeps the connection open, else 0.
+ */
+int response_reusable(http_response*);
+
+/**
+ * Completes a response once it was fully read, closing the cache file and recording it in the cache index.
+ * A 304 Not Modified response refreshes the freshness of the cached copy instead, and a 404, 410 or 5xx one is
+ * remembered in the negative cache when '--negative-ttl' is set.
+ *
+ * @param response: A pointer to an initialized 'http_response' structure.
+ * @return 1 if a file was saved or the cached copy was revalidated, else return 0.
+ */
+int response_finish(http_response*);
+
+/**
+ * Releases the resources of a response that could not be completed.
+ *
+ * @param response: A pointer to an initialized 'http_response' structure.
+ */
+void response_abort(http_response*);
+
+/**
+ * Writes the status code and reason phrase a negative cache entry is answered with, as in a status line.
+ *
+ * @param status: The status of the entry, a status code or CACHE_UNREACHABLE (answered with 502 Bad Gateway).
+ * @param text: The buffer the null-terminated text is written to, such as "404 Not Found".
+ * @param size: The size of the buffer.
+ */
+void negative_status_text(int, char*, size_t);
+
+
+#endif //CPROXY_RESPONSE_H
@@ -0,0 +1,1488 @@
+#include "server.h"
+
+
+static latency_stats* worker_latency = NULL; // Histograms of every worker, shared across the fork, or NULL if single
+static int worker_count = 0; // Number of histograms in worker_latency
+
+
+
+int create_listener(int port, int reuse_port)
+{
+    int sd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd == -1)
+    {
+        perror("socket\n");
+        return -1;
+    }
+
+    // Allow restarting the server while old connections are in TIME_WAIT
+    int enable = 1;
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1)
+    {
+        perror("setsockopt\n");
+        close(sd);
+        return -1;
+    }
+
+    // Every worker binds its own socket to the port, and the kernel spreads the connections among them
+    if (reuse_port && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+    {
+        perror("setsockopt\n");
+        close(sd);
+        return -1;
+    }
+
+    struct sockaddr_in socket_info;
+    memset(&socket_info, 0, sizeof(struct sockaddr_in));
+    socket_info.sin_family = AF_INET;
+    socket_info.sin_addr.s_addr = htonl(INADDR_ANY);
+    socket_info.sin_port = htons(port);
+
+    if (bind(sd, (struct sockaddr*) &socket_info, sizeof(struct sockaddr_in)) == -1)
+    {
+        perror("bind\n");
+        close(sd);
+        return -1;
+    }
+
+    if (listen(sd, LISTEN_BACKLOG) == -1)
+    {
+        perror("listen\n");
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+
+full_URL* parse_client_request(const char* request)
+{
+    // Only GET requests are supported
+    if (strncmp(request, "GET ", 4) != 0)
+        return NULL;
+
+    const char* target = request + 4;
+    const char* target_end = strchr(target, ' ');
+    const char* line_end = strstr(request, "\r\n");
+    if (target_end == NULL || line_end == NULL || target_end > line_end || target_end == target)
+        return NULL;
+
+    size_t target_length = target_end - target;
+    char* url_string;
+
+    if (starts_with_http(target))
+    {
+        // Absolute request sent to a proxy
+        url_string = strndup(target, target_length);
+    }
+    else if (target[0] == '/')
+    {
+        // Origin request, the host comes from the Host header
+        const char* host = strcasestr(line_end, "\r\nHost:");
+        if (host == NULL)
+            return NULL;
+
+        host += strlen("\r\nHost:");
+        while (*host == ' ' || *host == '\t')
+            host++;
+
+        size_t host_length = strcspn(host, " \t\r\n");
+        if (host_length == 0)
+            return NULL;
+
+        url_string = (char*)malloc(strlen("http://") + host_length + target_length + 1);
+        if (url_string != NULL)
+            sprintf(url_string, "http://%.*s%.*s", (int)host_length, host, (int)target_length, target);
+    }
+    else
+        return NULL;
+
+    if (url_string == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return NULL;
+    }
+
+    full_URL* my_url = parse_URL(url_string);
+    free(url_string);
+    return my_url;
+}
+
+
+static server_fill** fill_bucket(proxy_server* server, const char* key)
+{
+    return &server->fills[cache_key_hash(key, strlen(key)) % FILL_BUCKETS];
+}
+
+
+static server_fill* find_fill(proxy_server* server, const char* key)
+{
+    for (server_fill* fill = *fill_bucket(server, key); fill != NULL; fill = fill->next)
+        if (strcmp(fill->key, key) == 0)
+            return fill;
+
+    return NULL;
+}
+
+
+static void unshare_fill(server_fill* fill)
+{
+    if (!fill->shared)
+        return;
+
+    for (server_fill** link = fill_bucket(fill->server, fill->key); *link != NULL; link = &(*link)->next)
+    {
+        if (*link == fill)
+        {
+            *link = fill->next;
+            break;
+        }
+    }
+
+    fill->shared = 0;
+}
+
+
+static void release_fill_if_unused(server_fill* fill)
+{
+    if (fill->leader != NULL || fill->followers != NULL || fill->background)
+        return;
+
+    // Nobody wants the response anymore
+    if (!fill->done)
+        fetch_cancel(&fill->upstream);
+
+    unshare_fill(fill);
+    free(fill->key);
+    free_full_URL(fill->url);
+    event_loop_release(&fill->server->loop, fill); // Its watcher may still have a pending event
+}
+
+
+static void detach_client(client_conn* conn)
+{
+    server_fill* fill = conn->fill;
+    conn->fill = NULL;
+
+    if (fill->leader == conn)
+    {
+        // Only the leader pauses the fetch, the followers read from the file
+        fill->leader = NULL;
+        if (!fill->done)
+            fetch_resume(&fill->upstream);
+    }
+    else
+    {
+        for (client_conn** link = &fill->followers; *link != NULL; link = &(*link)->next_follower)
+        {
+            if (*link == conn)
+            {
+                *link = conn->next_follower;
+                break;
+            }
+        }
+    }
+
+    release_fill_if_unused(fill);
+}
+
+
+static void close_client(client_conn* conn)
+{
+    proxy_server* server = conn->server;
+
+    if (conn->watcher.fd != -1)
+    {
+        int sd = conn->watcher.fd;
+        event_loop_remove(&server->loop, &conn->watcher);
+        close(sd);
+    }
+
+    if (conn->fill != NULL)
+        detach_client(conn);
+
+    if (conn->file_fd != -1)
+        close(conn->file_fd);
+
+    if (conn->decoder != NULL)
+    {
+        body_decoder_close(conn->decoder);
+        free(conn->decoder);
+    }
+
+    mem_cache_release(conn->memory_entry);
+    free_full_URL(conn->url);
+    event_loop_release(&server->loop, conn);
+    server->active_clients--;
+}
+
+
+static int flush_output(client_conn* conn)
+{
+    // A header followed by a cached file goes out in the same segments as the start of the file
+    int flags = MSG_NOSIGNAL | (conn->state == CLIENT_SENDING_FILE ? MSG_MORE : 0);
+
+    while (conn->out_offset < conn->out_length)
+    {
+        ssize_t wrote_bytes = send(conn->watcher.fd, conn->out + conn->out_offset,
+                                   conn->out_length - conn->out_offset, flags);
+        if (wrote_bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0; // Wait for the client to become writable again
+            return -1;
+        }
+
+        conn->out_offset += wrote_bytes;
+    }
+
+    conn->out_length = 0;
+    conn->out_offset = 0;
+    return 1;
+}
+
+
+static void send_status(client_conn* conn, const char* status)
+{
+    conn->out_length = snprintf(conn->out, sizeof(conn->out),
+                                "HTTP/1.0 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    conn->out_offset = 0;
+    conn->state = CLIENT_CLOSING;
+
+    int flushed = flush_output(conn);
+    if (flushed != 0)
+        close_client(conn);
+    else
+        event_loop_modify(&conn->server->loop, &conn->watcher, EPOLLOUT);
+}
+
+
+static void send_file_chunk(client_conn* conn)
+{
+    // The header goes first
+    int flushed = flush_output(conn);
+    if (flushed == 0)
+        return;
+
+    if (flushed == -1)
+    {
+        close_client(conn);
+        return;
+    }
+
+    // The body is moved by the kernel from the page cache to the socket
+    while (conn->file_offset < conn->file_size)
+    {
+        ssize_t sent_bytes = sendfile(conn->watcher.fd, conn->file_fd, &conn->file_offset,
+                                      conn->file_size - conn->file_offset);
+        if (sent_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return; // Wait for the client to become writable again
+
+        if (sent_bytes < 0 && errno == EINTR)
+            continue;
+
+        // Failed, or the file shrank meanwhile
+        if (sent_bytes <= 0)
+            break;
+    }
+
+    close_client(conn);
+}
+
+
+static void send_decoded_chunk(client_conn* conn)
+{
+    while (1)
+    {
+        // The header, then each decoded part, is sent before the next part is decoded
+        int flushed = flush_output(conn);
+        if (flushed == 0)
+            return;
+
+        if (flushed == -1)
+            break;
+
+        // Done, or the object is corrupt: the client sees the body end early, as the length was not announced
+        ssize_t decoded_bytes = body_decoder_read(conn->decoder, conn->out, sizeof(conn->out));
+        if (decoded_bytes <= 0)
+            break;
+
+        conn->out_length = decoded_bytes;
+    }
+
+    close_client(conn);
+}
+
+
+static void send_memory_chunk(client_conn* conn)
+{
+    mem_entry* entry = conn->memory_entry;
+
+    while (conn->memory_offset < entry->size)
+    {
+        ssize_t sent_bytes = send(conn->watcher.fd, entry->data + conn->memory_offset,
+                                  entry->size - conn->memory_offset, MSG_NOSIGNAL);
+        if (sent_bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // Wait for the client to become writable again
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        conn->memory_offset += sent_bytes;
+    }
+
+    close_client(conn);
+}
+
+
+static void serve_from_memory(client_conn* conn, mem_entry* entry)
+{
+    conn->memory_entry = entry;
+    conn->memory_offset = 0;
+    conn->state = CLIENT_SENDING_MEMORY;
+
+    if (event_loop_modify(&conn->server->loop, &conn->watcher, EPOLLOUT) == -1)
+    {
+        close_client(conn);
+        return;
+    }
+
+    // Most responses fit in the socket buffer, try right away instead of waiting for EPOLLOUT
+    send_memory_chunk(conn);
+}
+
+
+static int serve_decoded(client_conn* conn, off_t object_size, content_encoding encoding)
+{
+    conn->decoder = (body_decoder*)malloc(sizeof(body_decoder));
+    if (conn->decoder == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        close_client(conn);
+        return 1;
+    }
+
+    // The decoded length is only known at the end, so the body ends when the connection closes
+    body_decoder_init(conn->decoder, encoding, conn->file_fd, object_size);
+    conn->out_length = format_cached_header(conn->out, sizeof(conn->out), -1, ENCODING_IDENTITY);
+    conn->out_offset = 0;
+    conn->state = CLIENT_DECODING_FILE;
+    if (event_loop_modify(&conn->server->loop, &conn->watcher, EPOLLOUT) == -1)
+        close_client(conn);
+    return 1;
+}
+
+
+static int serve_cached(client_conn* conn, int max_staleness)
+{
+    proxy_server* server = conn->server;
+
+    // Recently served responses are answered without touching the file system
+    mem_entry* entry = mem_cache_lookup(&server->memory, conn->url);
+    if (entry != NULL && encoding_accepted(conn->accepted_encodings, entry->encoding))
+    {
+        serve_from_memory(conn, entry);
+        return 1;
+    }
+
+    // Compressed, and the client needs it decoded from the file
+    mem_cache_release(entry);
+
+    // Serve the file from the cache if it exists
+    off_t object_size;
+    cache_metadata metadata;
+    conn->file_fd = cache_store_open_object(conn->url, &object_size, &metadata);
+    if (conn->file_fd == -1)
+        return 0;
+
+    // A file stale for too long is revalidated with the origin first
+    if (!cache_is_usable(&metadata, max_staleness))
+    {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        return 0;
+    }
+
+    // The cache keeps what the origin sent, decompress it for clients that do not accept its coding
+    if (!encoding_accepted(conn->accepted_encodings, metadata.encoding))
+        return serve_decoded(conn, object_size, metadata.encoding);
+
+    // Small files are loaded into memory once and served from there afterwards, stale ones could not be
+    entry = cache_is_fresh(&metadata) ? mem_cache_insert_file(&server->memory, conn->url, conn->file_fd, object_size,
+                                                              &metadata)
+                                      : NULL;
+    if (entry != NULL)
+    {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        serve_from_memory(conn, entry);
+        return 1;
+    }
+
+    conn->out_length = format_cached_header(conn->out, sizeof(conn->out), object_size, metadata.encoding);
+    conn->file_offset = 0;
+    conn->file_size = object_size;
+    conn->state = CLIENT_SENDING_FILE;
+    if (event_loop_modify(&server->loop, &conn->watcher, EPOLLOUT) == -1)
+        close_client(conn);
+    return 1;
+}
+
+
+static int has_usable_copy(full_URL* my_url, int max_staleness)
+{
+    cache_metadata metadata;
+    return cache_store_lookup(my_url, NULL, &metadata) && cache_is_usable(&metadata, max_staleness);
+}
+
+
+static void relay_to_leader(client_conn* conn, fetch* upstream, const char* data, size_t length)
+{
+    // The client gets the cached copy once the fetch is done, not the 304 response
+    if (upstream->response.not_modified || conn->awaiting_fill || conn->stale_on_error)
+        return;
+
+    // An origin error is replaced by a recent enough stale copy, decided before anything was relayed
+    http_response* response = &upstream->response;
+    if (conn->relayed_bytes == 0 && response->header_end_found && response->status_code >= 500 &&
+        options.stale_if_error > 0 && has_usable_copy(conn->url, options.stale_if_error))
+    {
+        conn->stale_on_error = 1;
+        return;
+    }
+
+    // A body the client cannot decode is decoded from the cache once saved. Decided with the first bytes,
+    // so a header longer than a read is relayed as-is
+    if (conn->relayed_bytes == 0 && response->header_end_found && response->save_file_flag &&
+        !encoding_accepted(conn->accepted_encodings, response->metadata.encoding))
+    {
+        conn->awaiting_fill = 1;
+        return;
+    }
+
+    // The fetch is paused whenever bytes are pending, so the buffer is empty here
+    memcpy(conn->out, data, length);
+    conn->out_length = length;
+    conn->out_offset = 0;
+    conn->relayed_bytes += length;
+
+    int flushed = flush_output(conn);
+    if (flushed == -1)
+    {
+        close_client(conn);
+        return;
+    }
+
+    // The client is slower than the origin, wait until it drained the buffer
+    if (flushed == 0)
+    {
+        fetch_pause(upstream);
+        event_loop_modify(&conn->server->loop, &conn->watcher, EPOLLOUT);
+    }
+}
+
+
+static void watch_follower(client_conn* conn, uint32_t events)
+{
+    if (conn->follower_events == events)
+        return;
+
+    conn->follower_events = events;
+    event_loop_modify(&conn->server->loop, &conn->watcher, events);
+}
+
+
+static void send_follow_chunk(client_conn* conn)
+{
+    server_fill* fill = conn->fill;
+
+    // The header goes first
+    int flushed = flush_output(conn);
+    if (flushed == -1)
+    {
+        close_client(conn);
+        return;
+    }
+
+    // Then whatever the fetch saved so far
+    while (flushed == 1 && conn->file_offset < (off_t)fill->saved_bytes)
+    {
+        ssize_t sent_bytes = sendfile(conn->watcher.fd, conn->file_fd, &conn->file_offset,
+                                      fill->saved_bytes - conn->file_offset);
+        if (sent_bytes < 0 && errno == EINTR)
+            continue;
+
+        if (sent_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (sent_bytes <= 0)
+        {
+            close_client(conn);
+            return;
+        }
+    }
+
+    // Caught up with a finished fill: the body is complete, or ends early if the fetch failed
+    int behind = conn->out_length > 0 || conn->file_offset < (off_t)fill->saved_bytes;
+    if (!behind && fill->done)
+    {
+        close_client(conn);
+        return;
+    }
+
+    // Wait for the client when it is behind, else for the next bytes from the origin
+    watch_follower(conn, behind ? EPOLLOUT : 0);
+}
+
+
+static void start_following(client_conn* conn)
+{
+    server_fill* fill = conn->fill;
+    http_response* response = &fill->upstream.response;
+
+    // A body the client cannot decode is served decoded once saved
+    if (!encoding_accepted(conn->accepted_encodings, response->metadata.encoding))
+        return;
+
+    conn->file_fd = open(response->full_file_path, O_RDONLY | O_CLOEXEC);
+    if (conn->file_fd == -1)
+        return; // Served from the cache once the fill is done
+
+    // The length is known up front unless the origin sends the body in chunks or until it closes
+    off_t body_size = response->chunked ? -1 : response->content_length;
+    conn->out_length = format_cached_header(conn->out, sizeof(conn->out), body_size,
+                                            (content_encoding)response->metadata.encoding);
+    conn->out_offset = 0;
+    conn->file_offset = 0;
+    conn->following = 1;
+    send_follow_chunk(conn);
+}
+
+
+static int start_fill(client_conn* conn, char* key);
+
+
+static void end_background(server_fill* fill)
+{
+    if (!fill->background)
+        return;
+
+    fill->background = 0;
+    fill->server->background_fills--;
+}
+
+
+static void publish_header(server_fill* fill)
+{
+    http_response* response = &fill->upstream.response;
+    fill->header_seen = 1;
+
+    // A 304 refreshes the cached copy, which the followers get once the fill is done
+    if (response->not_modified)
+        return;
+
+    if (response->save_file_flag && response->file != NULL)
+    {
+        fill->streaming = 1;
+        for (client_conn* follower = fill->followers, *next; follower != NULL; follower = next)
+        {
+            next = follower->next_follower;
+            start_following(follower);
+        }
+        return;
+    }
+
+    // A response that is not cached is not shared either: every follower fetches it for itself
+    unshare_fill(fill);
+    while (fill->followers != NULL)
+    {
+        client_conn* follower = fill->followers;
+        fill->followers = follower->next_follower;
+        follower->fill = NULL;
+
+        char* key = cache_key(follower->url);
+        if (key == NULL || start_fill(follower, key) == -1)
+            send_status(follower, "502 Bad Gateway");
+    }
+
+    // A prefetch nobody can use is not worth finishing
+    end_background(fill);
+    release_fill_if_unused(fill);
+}
+
+
+static void handle_fill_data(fetch* upstream, const char* data, size_t length, void* ctx)
+{
+    server_fill* fill = (server_fill*)ctx;
+    http_response* response = &upstream->response;
+
+    if (!fill->header_seen && response->header_end_found)
+        publish_header(fill);
+
+    // Followers send what reached the cache file, so the stdio buffer is flushed for them
+    if (fill->streaming && fill->followers != NULL && response->file != NULL && fflush(response->file) == 0)
+    {
+        fill->saved_bytes = response->body_bytes;
+        for (client_conn* follower = fill->followers, *next; follower != NULL; follower = next)
+        {
+            next = follower->next_follower;
+            if (follower->following)
+                send_follow_chunk(follower);
+        }
+    }
+
+    // The leader gets the origin response as-is
+    if (fill->leader != NULL)
+        relay_to_leader(fill->leader, upstream, data, length);
+}
+
+
+static void cache_in_memory(proxy_server* server, full_URL* my_url)
+{
+    off_t object_size;
+    cache_metadata metadata;
+    int fd = cache_store_open_object(my_url, &object_size, &metadata);
+    if (fd == -1)
+        return;
+
+    mem_cache_release(mem_cache_insert_file(&server->memory, my_url, fd, object_size, &metadata));
+    close(fd);
+}
+
+
+static void finish_leader(client_conn* conn, fetch* upstream, int result)
+{
+    // The origin failed before the client got anything: a recent enough stale copy is better than an error
+    if (conn->stale_on_error || (result == -1 && conn->relayed_bytes == 0 && options.stale_if_error > 0))
+    {
+        if (serve_cached(conn, options.stale_if_error))
+            conn->server->stale_responses++;
+        else
+            send_status(conn, "502 Bad Gateway");
+        return;
+    }
+
+    // The origin confirmed the stale copy, serve it even if it must be revalidated again next time.
+    // Responses the client cannot decode are served from the copy just saved
+    if (upstream->response.not_modified || conn->awaiting_fill)
+    {
+        if (result != 1 || !serve_cached(conn, -1))
+            send_status(conn, "502 Bad Gateway");
+        return;
+    }
+
+    // Nothing was forwarded yet, so the client can still get a proper error
+    if (result == -1 && conn->relayed_bytes == 0)
+    {
+        send_status(conn, "502 Bad Gateway");
+        return;
+    }
+
+    conn->state = CLIENT_CLOSING;
+    if (conn->out_length == 0)
+        close_client(conn);
+}
+
+
+static server_fill* create_fill(proxy_server* server, client_conn* leader, full_URL* fill_url, char* key);
+
+
+static void prefetch_links(server_fill* fill)
+{
+    proxy_server* server = fill->server;
+
+    char** links;
+    ssize_t count = prefetch_collect(fill->url, options.prefetch, &links);
+    for (ssize_t i = 0; i < count && server->background_fills < MAX_PREFETCH_FILLS; i++)
+    {
+        full_URL* link_url = parse_URL(links[i]);
+        if (link_url == NULL)
+            continue;
+
+        // Subresources already cached, being fetched or known to fail are left alone
+        off_t object_size;
+        cache_metadata metadata;
+        char* key = cache_key(link_url);
+        if (key == NULL || find_fill(server, key) != NULL ||
+            (cache_store_lookup(link_url, &object_size, &metadata) && cache_is_fresh(&metadata)) ||
+            cache_store_lookup_failure(link_url) != 0)
+        {
+            free(key);
+            free_full_URL(link_url);
+            continue;
+        }
+
+        server_fill* prefetch = create_fill(server, NULL, link_url, key);
+        if (prefetch == NULL)
+            continue;
+
+        prefetch->depth = fill->depth + 1;
+        prefetch->background = 1;
+        server->background_fills++;
+        server->prefetches++;
+    }
+
+    free_links(links, count > 0 ? (size_t)count : 0);
+}
+
+
+static void handle_fill_done(fetch* upstream, int result, void* ctx)
+{
+    server_fill* fill = (server_fill*)ctx;
+    fill->done = 1;
+
+    if (options.timing != TIMING_OFF)
+        latency_stats_record(fill->server->latency, &upstream->timing);
+
+    // Requests from now on find the object in the cache, or start a new fill
+    unshare_fill(fill);
+
+    // Keep the saved response in memory for the next clients
+    if (result == 1 && !upstream->response.not_modified)
+    {
+        fill->saved_bytes = upstream->response.body_bytes;
+        cache_in_memory(fill->server, fill->url);
+
+        // The subresources of a page are likely the next requests of its client
+        if (upstream->response.is_html && options.prefetch > 0 && fill->depth < options.prefetch_depth)
+            prefetch_links(fill);
+    }
+
+    // The clients may detach and release the fill, so the leader is read first. A background fill is held until
+    // the end of this function
+    client_conn* leader = fill->leader;
+    int background = fill->background;
+
+    // Followers get the saved copy, or when the fetch failed a recent enough stale one
+    for (client_conn* follower = fill->followers, *next; follower != NULL; follower = next)
+    {
+        next = follower->next_follower;
+        if (follower->following)
+            send_follow_chunk(follower);
+        else if (!serve_cached(follower, result == 1 ? -1 : options.stale_if_error))
+            send_status(follower, "502 Bad Gateway");
+    }
+
+    if (leader != NULL)
+        finish_leader(leader, upstream, result);
+
+    if (background)
+    {
+        end_background(fill);
+        release_fill_if_unused(fill);
+    }
+}
+
+
+static server_fill* create_fill(proxy_server* server, client_conn* leader, full_URL* fill_url, char* key)
+{
+    server_fill* fill = (server_fill*)calloc(1, sizeof(server_fill));
+    if (fill == NULL || fill_url == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        free(fill);
+        free_full_URL(fill_url);
+        free(key);
+        return NULL;
+    }
+
+    fill->server = server;
+    fill->key = key;
+    fill->url = fill_url;
+    fill->leader = leader;
+    if (leader != NULL)
+        leader->fill = fill;
+
+    if (fetch_start(&fill->upstream, &server->env, fill->url, handle_fill_data, handle_fill_done, fill) == -1)
+    {
+        if (leader != NULL)
+            leader->fill = NULL;
+        free(fill->key);
+        free_full_URL(fill->url);
+        free(fill);
+        return NULL;
+    }
+
+    // Later requests for the same URL follow this fill
+    if (key != NULL)
+    {
+        server_fill** bucket = fill_bucket(server, key);
+        fill->next = *bucket;
+        *bucket = fill;
+        fill->shared = 1;
+    }
+    server->origin_fetches++;
+    return fill;
+}
+
+
+static int start_fill(client_conn* conn, char* key)
+{
+    proxy_server* server = conn->server;
+
+    if (create_fill(server, conn, duplicate_full_URL(conn->url), key) == NULL)
+        return -1;
+
+    // The client socket stays quiet until the fetch has bytes it cannot take right away
+    conn->state = CLIENT_RELAYING;
+    event_loop_modify(&server->loop, &conn->watcher, 0);
+    return 0;
+}
+
+
+static void follow_fill(client_conn* conn, server_fill* fill)
+{
+    conn->fill = fill;
+    conn->next_follower = fill->followers;
+    fill->followers = conn;
+    conn->state = CLIENT_FOLLOWING;
+    conn->follower_events = 0;
+    conn->server->coalesced_requests++;
+
+    // Quiet until the body starts arriving
+    event_loop_modify(&conn->server->loop, &conn->watcher, 0);
+    if (fill->streaming)
+        start_following(conn);
+}
+
+
+static int refresh_stale(proxy_server* server, full_URL* my_url)
+{
+    cache_metadata metadata;
+    if (!cache_store_lookup(my_url, NULL, &metadata) || cache_is_fresh(&metadata) ||
+        !cache_is_usable(&metadata, options.stale_while_revalidate))
+        return 0;
+
+    // One refresh per URL, the requests meanwhile get the stale copy too
+    char* key = cache_key(my_url);
+    if (key == NULL || find_fill(server, key) != NULL)
+    {
+        free(key);
+        return 1;
+    }
+
+    // The fetch revalidates the copy with its validators, and a 304 only renews its freshness
+    server_fill* refresh = create_fill(server, NULL, duplicate_full_URL(my_url), key);
+    if (refresh != NULL)
+    {
+        refresh->background = 1;
+        server->background_fills++;
+        server->refreshes++;
+    }
+
+    return 1;
+}
+
+
+static void start_serving(client_conn* conn)
+{
+    proxy_server* server = conn->server;
+
+    // Only the lookup and the start of sending a hit are timed, the rest goes at the pace of the client
+    phase_timer timing;
+    phase_timer_start(&timing);
+    int is_cached = serve_cached(conn, 0);
+
+    // A copy stale for less than the stale-while-revalidate window is served right away and refreshed behind it
+    if (!is_cached && options.stale_while_revalidate > 0 && refresh_stale(server, conn->url))
+    {
+        is_cached = serve_cached(conn, options.stale_while_revalidate);
+        server->stale_responses += is_cached;
+    }
+
+    if (is_cached && options.timing != TIMING_OFF)
+    {
+        phase_timer_end(&timing, PHASE_CACHE_READ);
+        latency_stats_record(server->latency, &timing);
+    }
+
+    if (is_cached)
+        return;
+
+    // The URL failed moments ago, it gets the same error until its negative entry expires
+    int failed_status = cache_store_lookup_failure(conn->url);
+    if (failed_status != 0)
+    {
+        char status_text[64];
+        negative_status_text(failed_status, status_text, sizeof(status_text));
+        server->negative_responses++;
+        send_status(conn, status_text);
+        return;
+    }
+
+    // A URL the cache has no room for is still proxied, by a fill of its own that nobody follows
+    char* key = cache_key(conn->url);
+    if (key == NULL)
+    {
+        if (start_fill(conn, NULL) == -1)
+            send_status(conn, "502 Bad Gateway");
+        return;
+    }
+
+    // Another client is fetching the same URL, share its fetch instead of asking the origin again
+    server_fill* fill = find_fill(server, key);
+    if (fill != NULL)
+    {
+        free(key);
+        follow_fill(conn, fill);
+        return;
+    }
+
+    // Not cached, fetch it from the origin
+    if (start_fill(conn, key) == -1)
+        send_status(conn, "502 Bad Gateway");
+}
+
+
+static void serve_metrics(client_conn* conn)
+{
+    // The histograms are sent like a response from the memory cache, from an entry no cache holds
+    char* body = NULL;
+    size_t body_length = 0;
+    FILE* stream = open_memstream(&body, &body_length);
+    if (stream == NULL)
+    {
+        send_status(conn, "500 Internal Server Error");
+        return;
+    }
+
+    // Each worker records its own requests, and a scrape reaches any one of them: it gets the sum of all
+    latency_stats sum;
+    const latency_stats* stats = conn->server->latency;
+    if (worker_latency != NULL)
+    {
+        latency_stats_init(&sum);
+        for (int i = 0; i < worker_count; i++)
+            latency_stats_add(&sum, &worker_latency[i]);
+        stats = &sum;
+    }
+
+    latency_stats_write(stream, stats, options.timing);
+    fclose(stream);
+
+    const char* content_type = options.timing == TIMING_JSON ? "application/json" : "text/plain; version=0.0.4";
+    char header[256];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                                 content_type, body_length);
+
+    mem_entry* entry = (mem_entry*)calloc(1, sizeof(mem_entry));
+    char* data = (char*)malloc(header_length + body_length);
+    if (entry == NULL || data == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        free(entry);
+        free(data);
+        free(body);
+        send_status(conn, "500 Internal Server Error");
+        return;
+    }
+
+    memcpy(data, header, header_length);
+    memcpy(data + header_length, body, body_length);
+    free(body);
+
+    entry->data = data;
+    entry->size = header_length + body_length;
+    entry->refs = 1; // Freed by mem_cache_release once sent
+    serve_from_memory(conn, entry);
+}
+
+
+static void read_request(client_conn* conn)
+{
+    while (1)
+    {
+        ssize_t read_bytes = read(conn->watcher.fd, conn->request + conn->request_length,
+                                  MAX_REQUEST_SIZE - conn->request_length);
+        if (read_bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+
+            close_client(conn);
+            return;
+        }
+
+        // The client closed the connection before sending a full request
+        if (read_bytes == 0)
+        {
+            close_client(conn);
+            return;
+        }
+
+        conn->request_length += read_bytes;
+        conn->request[conn->request_length] = '\0';
+
+        if (strstr(conn->request, "\r\n\r\n") != NULL)
+            break;
+
+        if (conn->request_length == MAX_REQUEST_SIZE)
+        {
+            send_status(conn, "431 Request Header Fields Too Large");
+            return;
+        }
+    }
+
+    // With timing on, the proxy answers the metrics path itself
+    const char* metrics_request = "GET " METRICS_PATH " ";
+    if (options.timing != TIMING_OFF && strncmp(conn->request, metrics_request, strlen(metrics_request)) == 0)
+    {
+        serve_metrics(conn);
+        return;
+    }
+
+    conn->url = parse_client_request(conn->request);
+    if (conn->url == NULL)
+    {
+        send_status(conn, "400 Bad Request");
+        return;
+    }
+
+    conn->accepted_encodings = parse_accept_encoding(conn->request);
+
+    start_serving(conn);
+}
+
+
+static void handle_client_event(event_loop* loop, uint32_t events, void* ctx)
+{
+    (void)loop;
+    client_conn* conn = (client_conn*)ctx;
+
+    // The client went away, stop whatever is being served to it
+    if ((events & (EPOLLERR | EPOLLHUP)) && conn->state != CLIENT_READING_REQUEST)
+    {
+        close_client(conn);
+        return;
+    }
+
+    switch (conn->state)
+    {
+        case CLIENT_READING_REQUEST:
+            read_request(conn);
+            break;
+
+        case CLIENT_SENDING_MEMORY:
+            send_memory_chunk(conn);
+            break;
+
+        case CLIENT_SENDING_FILE:
+            send_file_chunk(conn);
+            break;
+
+        case CLIENT_DECODING_FILE:
+            send_decoded_chunk(conn);
+            break;
+
+        case CLIENT_RELAYING:
+        {
+            int flushed = flush_output(conn);
+            if (flushed == -1)
+                close_client(conn);
+            else if (flushed == 1)
+            {
+                // Drained, go back to reading from the origin
+                event_loop_modify(&conn->server->loop, &conn->watcher, 0);
+                fetch_resume(&conn->fill->upstream);
+            }
+            break;
+        }
+
+        case CLIENT_FOLLOWING:
+            if (conn->following)
+                send_follow_chunk(conn);
+            break;
+
+        case CLIENT_CLOSING:
+            if (flush_output(conn) != 0)
+                close_client(conn);
+            break;
+    }
+}
+
+
+static void accept_clients(event_loop* loop, uint32_t events, void* ctx)
+{
+    (void)events;
+    proxy_server* server = (proxy_server*)ctx;
+
+    while (1)
+    {
+        int sd = accept4(server->watcher.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                perror("accept\n");
+            return;
+        }
+
+        client_conn* conn = (client_conn*)malloc(sizeof(client_conn));
+        if (conn == NULL)
+        {
+            fprintf(stderr, "Malloc failed\n");
+            close(sd);
+            continue;
+        }
+
+        conn->server = server;
+        conn->state = CLIENT_READING_REQUEST;
+        conn->request_length = 0;
+        conn->url = NULL;
+        conn->out_length = 0;
+        conn->out_offset = 0;
+        conn->file_fd = -1;
+        conn->file_offset = 0;
+        conn->file_size = 0;
+        conn->decoder = NULL;
+        conn->accepted_encodings = 1u << ENCODING_IDENTITY;
+        conn->memory_entry = NULL;
+        conn->memory_offset = 0;
+        conn->fill = NULL;
+        conn->next_follower = NULL;
+        conn->following = 0;
+        conn->follower_events = 0;
+        conn->awaiting_fill = 0;
+        conn->stale_on_error = 0;
+        conn->relayed_bytes = 0;
+        event_watcher_init(&conn->watcher, sd, handle_client_event, conn);
+
+        if (event_loop_add(loop, &conn->watcher, EPOLLIN) == -1)
+        {
+            close(sd);
+            free(conn);
+            continue;
+        }
+
+        server->active_clients++;
+    }
+}
+
+
+static void expire_idle_sockets(event_loop* loop, void* ctx)
+{
+    (void)loop;
+    conn_pool_expire((conn_pool*)ctx);
+
+    // Finish the evictions the fills left over the disk cache budget
+    cache_store_evict(CACHE_EVICTION_STEPS);
+}
+
+
+static void stop_server(event_loop* loop, uint32_t events, void* ctx)
+{
+    (void)events;
+    proxy_server* server = (proxy_server*)ctx;
+
+    struct signalfd_siginfo info;
+    if (read(server->signal_watcher.fd, &info, sizeof(info)) == sizeof(info))
+        event_loop_stop(loop);
+}
+
+
+static int watch_stop_signals(proxy_server* server)
+{
+    // SIGINT and SIGTERM are read from a descriptor so the server shuts down from its loop
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) == -1)
+    {
+        perror("sigprocmask\n");
+        return -1;
+    }
+
+    int fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("signalfd\n");
+        return -1;
+    }
+
+    event_watcher_init(&server->signal_watcher, fd, stop_server, server);
+    if (event_loop_add(&server->loop, &server->signal_watcher, EPOLLIN) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void print_memory_cache_stats(mem_cache* cache)
+{
+    unsigned long lookups = cache->hits + cache->misses;
+    printf("Memory cache: %lu hits, %lu misses (%.1f%% hit rate), %lu insertions, %lu evictions, "
+           "%zu responses using %zu of %zu bytes\n",
+           cache->hits, cache->misses, lookups == 0 ? 0.0 : 100.0 * cache->hits / lookups,
+           cache->insertions, cache->evictions, cache->entries, cache->used, cache->budget);
+}
+
+
+static void print_disk_cache_stats(void)
+{
+    int64_t bytes, objects, evictions;
+    if (cache_store_usage(&bytes, &objects, &evictions) == -1)
+        return;
+
+    printf("Disk cache: %lld objects using %lld bytes, %lld evictions\n", (long long)objects, (long long)bytes,
+           (long long)evictions);
+}
+
+
+static int run_worker(proxy_options* options, int worker)
+{
+    proxy_server server;
+    memset(server.fills, 0, sizeof(server.fills));
+    server.origin_fetches = 0;
+    server.coalesced_requests = 0;
+    server.prefetches = 0;
+    server.stale_responses = 0;
+    server.refreshes = 0;
+    server.negative_responses = 0;
+    server.background_fills = 0;
+    server.active_clients = 0;
+    latency_stats local_latency;
+    latency_stats_init(&local_latency);
+    server.latency = worker == -1 ? &local_latency : &worker_latency[worker];
+
+    // Writing to a peer that went away must fail with EPIPE instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    int sd = create_listener(options->listen_port, worker != -1);
+    if (sd == -1)
+        return -1;
+
+    if (event_loop_init(&server.loop) == -1)
+    {
+        close(sd);
+        return -1;
+    }
+
+    // Before the resolver threads start, so they inherit the blocked signals
+    if (watch_stop_signals(&server) == -1)
+    {
+        event_loop_close(&server.loop);
+        close(sd);
+        return -1;
+    }
+
+    conn_pool_init(&server.pool, options->max_host_connections, options->idle_timeout);
+    if (resolver_init(&server.dns, &server.loop, options->dns_ttl) == -1)
+    {
+        close(server.signal_watcher.fd);
+        event_loop_close(&server.loop);
+        close(sd);
+        return -1;
+    }
+
+    server.env.loop = &server.loop;
+    server.env.pool = &server.pool;
+    server.env.dns = &server.dns;
+    mem_cache_init(&server.memory, options->memory_cache_size);
+
+    event_watcher_init(&server.watcher, sd, accept_clients, &server);
+    if (event_loop_add(&server.loop, &server.watcher, EPOLLIN) == -1 ||
+        event_timer_start(&server.loop, &server.expiry_timer, 1000, expire_idle_sockets, &server.pool) == -1)
+    {
+        close(server.signal_watcher.fd);
+        resolver_close(&server.dns);
+        event_loop_close(&server.loop);
+        close(sd);
+        return -1;
+    }
+
+    if (worker == -1)
+    {
+        printf("Listening on port %d\n", options->listen_port);
+        fflush(stdout);
+    }
+
+    int result = event_loop_run(&server.loop);
+
+    // The statistics are per worker
+    if (worker != -1)
+        printf("Worker %d:\n", worker);
+
+    print_memory_cache_stats(&server.memory);
+    print_disk_cache_stats();
+    printf("Origin fetches: %lu (%lu prefetches), requests coalesced onto a fetch in progress: %lu\n",
+           server.origin_fetches, server.prefetches, server.coalesced_requests);
+    if (options->stale_while_revalidate > 0 || options->stale_if_error > 0)
+        printf("Stale responses: %lu, background refreshes: %lu\n", server.stale_responses, server.refreshes);
+    if (options->negative_ttl > 0)
+        printf("Negative responses: %lu\n", server.negative_responses);
+
+    event_timer_stop(&server.loop, &server.expiry_timer);
+    close(server.signal_watcher.fd);
+    conn_pool_close(&server.pool);
+    resolver_close(&server.dns);
+    mem_cache_close(&server.memory);
+    event_loop_close(&server.loop);
+    close(sd);
+    return result;
+}
+
+
+static void pin_to_cpu(const cpu_set_t* allowed, int worker)
+{
+    // Worker i runs on the i-th CPU the server may use, wrapping around when there are more workers
+    int cpu_count = CPU_COUNT(allowed);
+    int wanted = worker % cpu_count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, allowed) || wanted-- > 0)
+            continue;
+
+        cpu_set_t pinned;
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        if (sched_setaffinity(0, sizeof(pinned), &pinned) == -1)
+            perror("sched_setaffinity\n");
+        return;
+    }
+}
+
+
+static void signal_workers(pid_t* workers, int count, int signal_number)
+{
+    for (int i = 0; i < count; i++)
+        if (workers[i] > 0)
+            kill(workers[i], signal_number);
+}
+
+
+static int run_workers(proxy_options* options)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        perror("sched_getaffinity\n");
+        return -1;
+    }
+
+    int count = options->workers == 0 ? CPU_COUNT(&allowed) : options->workers;
+    pid_t* workers = (pid_t*)calloc(count, sizeof(pid_t));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "Malloc failed\n");
+        return -1;
+    }
+
+    // The workers write their own histograms and read every other one, for the metrics
+    size_t latency_size = count * sizeof(latency_stats);
+    worker_latency = (latency_stats*)mmap(NULL, latency_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                                          -1, 0);
+    if (worker_latency == MAP_FAILED)
+    {
+        perror("mmap\n");
+        worker_latency = NULL;
+        free(workers);
+        return -1;
+    }
+    worker_count = count;
+    for (int i = 0; i < count; i++)
+        latency_stats_init(&worker_latency[i]);
+
+    // The signals wait until the parent takes them, the workers watch SIGINT and SIGTERM on their own
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    int running = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            perror("fork\n");
+            failed = 1;
+            break;
+        }
+
+        if (pid == 0)
+        {
+            // Nothing was started before the fork: each worker gets its own loop, pool, resolver threads, memory
+            // cache and descriptor of the disk cache index, whose lock keeps the workers from corrupting it
+            free(workers);
+            sigset_t child_signals;
+            sigemptyset(&child_signals);
+            sigaddset(&child_signals, SIGCHLD);
+            sigprocmask(SIG_UNBLOCK, &child_signals, NULL);
+            cache_store_after_fork();
+            if (options->pin_workers)
+                pin_to_cpu(&allowed, i);
+
+            int result = run_worker(options, i);
+            fflush(stdout);
+            exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        workers[i] = pid;
+        running++;
+    }
+
+    if (!failed)
+    {
+        printf("Listening on port %d with %d workers\n", options->listen_port, count);
+        fflush(stdout);
+    }
+    else
+        signal_workers(workers, count, SIGTERM);
+
+    // Stop signals are passed on to the workers, and a worker that stops on its own stops the others
+    int stopping = failed;
+    while (running > 0)
+    {
+        int signal_number = sigwaitinfo(&signals, NULL);
+        if (signal_number == SIGINT || signal_number == SIGTERM)
+        {
+            stopping = 1;
+            signal_workers(workers, count, signal_number);
+            continue;
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (int i = 0; i < count; i++)
+                if (workers[i] == pid)
+                    workers[i] = 0;
+            running--;
+
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+                failed = 1;
+            if (!stopping)
+            {
+                fprintf(stderr, "Worker %d exited, stopping the others\n", (int)pid);
+                stopping = 1;
+                signal_workers(workers, count, SIGTERM);
+            }
+        }
+    }
+
+    munmap(worker_latency, latency_size);
+    worker_latency = NULL;
+    free(workers);
+    return failed ? -1 : 0;
+}
+
+
+int run_server(proxy_options* options)
+{
+    if (options->workers == 1)
+        return run_worker(options, -1);
+
+    return run_workers(options);
+}
@@ -0,0 +1,139 @@
+#ifndef CPROXY_SERVER_H
+#define CPROXY_SERVER_H
+
+
+#include "cproxy.h"
+#include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include "event_loop.h"
+#include "fetch.h"
+#include "conn_pool.h"
+#include "resolver.h"
+#include "mem_cache.h"
+#include "cache_store.h"
+#include "latency_stats.h"
+#include "prefetch.h"
+
+
+#define MAX_REQUEST_SIZE 8192 // Maximum size of a client request header
+#define LISTEN_BACKLOG 1024 // Length of the pending connections queue
+#define FILL_BUCKETS 1024 // Number of hash buckets of the fills in progress
+#define MAX_PREFETCH_FILLS 64 // Most background fills in progress for prefetching, links found beyond are not fetched
+
+typedef enum{
+    CLIENT_READING_REQUEST, // Waiting for the complete request header
+    CLIENT_SENDING_MEMORY, // Serving a response from the memory cache
+    CLIENT_SENDING_FILE, // Serving a cached file
+    CLIENT_DECODING_FILE, // Serving a compressed cached file decoded, to a client that does not accept its coding
+    CLIENT_RELAYING, // Forwarding the origin response while it is saved to the cache
+    CLIENT_FOLLOWING, // Sending the body another client's fetch is saving, as it reaches the cache file
+    CLIENT_CLOSING // Sending the last buffered bytes before closing
+} client_state;
+
+typedef struct proxy_server proxy_server;
+typedef struct server_fill server_fill;
+typedef struct client_conn client_conn;
+
+struct client_conn{
+    proxy_server* server; // Server the connection belongs to
+    event_watcher watcher; // Watcher of the client socket
+    client_state state; // Current state
+    char request[MAX_REQUEST_SIZE + 1]; // Client request header
+    size_t request_length; // Bytes of request read so far
+    full_URL* url; // Requested URL
+    unsigned accepted_encodings; // Content codings the client accepts, as returned by parse_accept_encoding
+    char out[READ_BUFFER_SIZE]; // Bytes waiting to be written to the client
+    size_t out_length; // Number of bytes in out
+    size_t out_offset; // Bytes of out already written
+    int file_fd; // Cached file being served, or -1
+    off_t file_offset; // Bytes of the cached file already sent
+    off_t file_size; // Size of the cached file
+    body_decoder* decoder; // Decompression of the cached file, or NULL
+    mem_entry* memory_entry; // Response being served from the memory cache, or NULL
+    size_t memory_offset; // Bytes of the memory response already sent
+    server_fill* fill; // Fetch of the requested URL the client leads or follows, or NULL
+    client_conn* next_follower; // Next client following the same fill
+    int following; // 1 once the client streams the body of the fill from the cache file
+    uint32_t follower_events; // Events watched while following, changed only when needed
+    int awaiting_fill; // 1 if the response is served decoded from the cache once the fetch saved it
+    int stale_on_error; // 1 if the origin answered 5xx and the stale cached copy is served instead
+    size_t relayed_bytes; // Bytes of the origin response forwarded to the client
+};
+
+// A fetch from the origin shared by every client that asks for the same URL while it runs
+struct server_fill{
+    proxy_server* server; // Server the fill belongs to
+    char* key; // Normalized URL, as built by cache_key, or NULL for a URL too long to cache, which is not shared
+    full_URL* url; // URL being fetched, owned by the fill
+    fetch upstream; // Fetch from the origin
+    client_conn* leader; // Client that started the fill and gets the origin response as-is, or NULL once gone
+    client_conn* followers; // Later clients for the same URL
+    int shared; // 1 while later requests for the URL can follow the fill
+    int header_seen; // 1 once the header of the response was parsed
+    int streaming; // 1 if the body is being saved, so followers can stream it from the cache file
+    size_t saved_bytes; // Body bytes flushed to the cache file, which followers may send
+    int done; // 1 once the fetch finished
+    int depth; // Links followed from a page a client asked for to this URL, 0 for client requests
+    int background; // 1 for a prefetch or a refresh, which runs to its end whether clients follow it or not
+    server_fill* next; // Next fill in the same bucket
+};
+
+struct proxy_server{
+    event_loop loop; // Loop driving the listener and all connections
+    event_watcher watcher; // Watcher of the listening socket
+    conn_pool pool; // Keep-alive sockets to the origins
+    resolver dns; // Caching resolver of the origin host names
+    fetch_env env; // What the fetches use: the loop, the pool and the resolver
+    mem_cache memory; // Recently served responses, checked before the disk cache
+    event_timer expiry_timer; // Periodically closes idle sockets of the pool
+    event_watcher signal_watcher; // Signalfd of SIGINT and SIGTERM, which stop the server
+    server_fill* fills[FILL_BUCKETS]; // Fills in progress that new requests can follow, hashed by key
+    unsigned long origin_fetches; // Fills started
+    unsigned long coalesced_requests; // Requests that followed a fill instead of fetching again
+    unsigned long prefetches; // Subresources of HTML pages fetched ahead of the clients
+    unsigned long stale_responses; // Stale copies served while refreshed, or because the origin failed
+    unsigned long refreshes; // Stale copies refreshed behind the clients they were served to
+    unsigned long negative_responses; // Requests answered with the error a URL or its origin failed with moments ago
+    size_t background_fills; // Prefetches and refreshes in progress
+    latency_stats* latency; // Histograms of the phases of the hits and origin fetches, filled when timing is on
+    size_t active_clients; // Number of open client connections
+};
+
+
+/**
+ * Creates a non-blocking TCP socket listening on all interfaces.
+ *
+ * @param port: The port to listen on.
+ * @param reuse_port: 1 to set SO_REUSEPORT, so every worker process listens on the port with its own socket.
+ * @return The listening socket descriptor, or -1 on failure.
+ */
+int create_listener(int, int);
+
+/**
+ * Parses a client request header into a 'full_URL' structure.
+ * Both absolute requests ("GET http://host/path") and origin requests with a Host header are accepted.
+ *
+ * @param request: The null-terminated request header.
+ * @return
+ *   - A pointer to a newly allocated 'full_URL' structure on success.
+ *   - NULL if the request is malformed, is not a GET request, or memory allocation fails.
+ */
+full_URL* parse_client_request(const char*);
+
+/**
+ * Runs the proxy server: accepts client HTTP GET requests and serves them from the cache or the origin.
+ * With several workers, each is a process with its own SO_REUSEPORT listener, event loop, connection pool and memory
+ * cache, and they share the disk cache. The parent only passes the stop signals on and waits for them.
+ *
+ * @param options: A pointer to a 'proxy_options' structure with the port to listen on, the number of workers,
+ *                 the memory cache budget and the connection options.
+ * @return 0 when stopped by SIGINT or SIGTERM, or -1 on failure.
+ */
+int run_server(proxy_options*);
+
+
+#endif //CPROXY_SERVER_H